@@ -0,0 +1,95 @@
+#!/bin/sh
+# Benchmark suite for quash, run by `make bench`.
+# Builds an optimized quash, runs every benchmark RUNS times and prints the
+# results as JSON: the median and the 99th percentile run (the slow tail,
+# so for rates p99 is the lower number). Sizes can be changed through the
+# environment:
+#   RUNS        runs per benchmark (default 11)
+#   SPAWN_N     /bin/true lines per spawn run (default 2000)
+#   BUILTIN_N   builtin lines per builtin run (default 100000)
+#   PIPE_MB     size of the file pushed through the pipeline (default 64)
+#   JOBS_N      background jobs kept alive for jobs and kill (default 10000)
+
+RUNS=${RUNS:-11}
+SPAWN_N=${SPAWN_N:-2000}
+BUILTIN_N=${BUILTIN_N:-100000}
+PIPE_MB=${PIPE_MB:-64}
+JOBS_N=${JOBS_N:-10000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+cd "$(dirname "$0")" || exit 1
+gcc -Wall -O2 -pthread quash.c -o "$DIR/quash" || exit 1
+QUASH="$DIR/quash"
+
+now() {
+    date +%s.%N
+}
+
+# Reads one number per line and prints "median p99" (nearest rank)
+percentiles() {
+    sort -g | awk '{ v[NR] = $1 }
+        END {
+            m = int((NR + 1) / 2); p = int(NR * 0.99 + 0.999)
+            if (p < 1) p = 1
+            printf "%s %s\n", v[m], v[p]
+        }'
+}
+
+# Prints a JSON member for a benchmark whose runs each took some seconds to
+# handle AMOUNT units: "name": {"unit": ..., "median": ..., "p99": ...}
+rate_json() {
+    name=$1 unit=$2 amount=$3 times=$4
+    echo "$times" | percentiles | awk -v n="$name" -v u="$unit" -v a="$amount" -v r="$RUNS" \
+        '{ printf "  \"%s\": {\"unit\": \"%s\", \"runs\": %d, \"median\": %.1f, \"p99\": %.1f}", n, u, r, a / $1, a / $2 }'
+}
+
+# Runs a quash script RUNS times and prints how long each run took
+time_script() {
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        start=$(now)
+        "$QUASH" "$1" > /dev/null
+        end=$(now)
+        awk -v s="$start" -v e="$end" 'BEGIN { printf "%.9f\n", e - s }'
+        i=$((i + 1))
+    done
+}
+
+# Commands per second for trivial external commands
+awk -v n="$SPAWN_N" 'BEGIN { for (i = 0; i < n; i++) print "/bin/true" }' > "$DIR/spawn"
+spawn=$(rate_json spawn "commands/s" "$SPAWN_N" "$(time_script "$DIR/spawn")")
+
+# Lines per second when every line is a builtin
+awk -v n="$BUILTIN_N" 'BEGIN { for (i = 0; i < n; i++) print (i % 2 ? "true" : "echo line " i) }' > "$DIR/builtin"
+builtin=$(rate_json builtin "lines/s" "$BUILTIN_N" "$(time_script "$DIR/builtin")")
+
+# MB/s through a four stage pipeline, the data is the same on every run
+awk -v mb="$PIPE_MB" 'BEGIN {
+        line = "the quick brown fox jumps over the lazy dog 0123456789 abcdefghijklmnopqrstuvwxyz"
+        for (i = 0; i < mb * 1048576 / 84; i++) print line
+    }' > "$DIR/big"
+echo "cat $DIR/big | tr a-z A-Z | tr -d 0-9 | wc -c" > "$DIR/pipeline"
+size_mb=$(awk -v b="$(wc -c < "$DIR/big")" 'BEGIN { printf "%.3f", b / 1048576 }')
+pipeline=$(rate_json pipeline "MB/s" "$size_mb" "$(time_script "$DIR/pipeline")")
+rm -f "$DIR/big"
+
+# Cost of jobs and kill with JOBS_N background jobs, taken from the
+# builtin spans of a QUASH_TRACE trace (microseconds per call)
+{
+    awk -v n="$JOBS_N" 'BEGIN { for (i = 0; i < n; i++) print "sleep 1000 &" }'
+    awk -v r="$RUNS" 'BEGIN { for (i = 0; i < r; i++) print "jobs > /dev/null" }'
+    awk -v n="$JOBS_N" 'BEGIN { for (i = 1; i <= n; i++) print "kill 9 %" i }'
+} > "$DIR/jobs"
+QUASH_TRACE="$DIR/trace.json" "$QUASH" "$DIR/jobs" > /dev/null
+span_json() {
+    name=$1
+    grep "\"name\":\"builtin\".*\"detail\":\"$name\"" "$DIR/trace.json" |
+        sed 's/.*"dur":\([0-9.]*\).*/\1/' | percentiles |
+        awk -v n="$name" -v j="$JOBS_N" \
+            '{ printf "  \"%s\": {\"unit\": \"us\", \"jobs\": %d, \"median\": %.3f, \"p99\": %.3f}", n, j, $1, $2 }'
+}
+jobs=$(span_json jobs)
+kill=$(span_json kill)
+
+printf '{\n%s,\n%s,\n%s,\n%s,\n%s\n}\n' "$spawn" "$builtin" "$pipeline" "$jobs" "$kill"
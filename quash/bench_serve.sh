@@ -0,0 +1,34 @@
+#!/bin/sh
+# Measures what running one command line costs when a new quash is started
+# for it (quash -c, as system() would) and when it goes to a quash --serve
+# daemon through quashc.
+# Usage: ./bench_serve.sh [number of command lines]
+
+N=${1:-2000}
+DIR=$(mktemp -d)
+trap 'kill $daemon 2>/dev/null; rm -rf "$DIR"' EXIT
+
+gcc -Wall -O2 -pthread quash.c -o "$DIR/quash" || exit 1
+gcc -Wall -O2 quashc.c -o "$DIR/quashc" || exit 1
+
+"$DIR/quash" --serve "$DIR/sock" &
+daemon=$!
+while [ ! -S "$DIR/sock" ]; do
+    sleep 0.1
+done
+
+for variant in startup serve; do
+    start=$(date +%s.%N)
+    i=0
+    while [ $i -lt "$N" ]; do
+        if [ "$variant" = startup ]; then
+            "$DIR/quash" -c 'x=1; echo $x' > /dev/null
+        else
+            "$DIR/quashc" "$DIR/sock" 'x=1; echo $x' > /dev/null
+        fi
+        i=$((i + 1))
+    done
+    end=$(date +%s.%N)
+    awk -v n="$N" -v s="$start" -v e="$end" -v v="$variant" \
+        'BEGIN { printf "%s: %.0f command lines/sec\n", v, n / (e - s) }'
+done
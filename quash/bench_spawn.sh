@@ -0,0 +1,33 @@
+#!/bin/sh
+# Measures how many external commands per second quash can launch: with the
+# old fork+execvp path, with the posix_spawn launcher, and with the zygote
+# that QUASH_ZYGOTE=1 starts commands from.
+# Usage: ./bench_spawn.sh [number of commands]
+
+N=${1:-5000}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+
+gcc -Wall -O2 -pthread quash.c -o "$DIR/quash-spawn" || exit 1
+gcc -Wall -O2 -pthread -DQUASH_NO_SPAWN quash.c -o "$DIR/quash-fork" || exit 1
+
+i=0
+while [ $i -lt "$N" ]; do
+    echo /bin/true
+    i=$((i + 1))
+done > "$DIR/script"
+echo exit >> "$DIR/script"
+
+for variant in fork spawn zygote; do
+    binary=$variant
+    zygote=
+    if [ "$variant" = zygote ]; then
+        binary=spawn
+        zygote=1
+    fi
+    start=$(date +%s.%N)
+    QUASH_ZYGOTE=$zygote "$DIR/quash-$binary" < "$DIR/script" > /dev/null
+    end=$(date +%s.%N)
+    awk -v n="$N" -v s="$start" -v e="$end" -v v="$variant" \
+        'BEGIN { printf "%s: %.0f spawns/sec\n", v, n / (e - s) }'
+done
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,1016 +6,8929 @@
 #include <sys/wait.h>
 #include <fcntl.h>
 #include <sys/stat.h>
+#include <spawn.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sched.h>
+#include <limits.h>
+#include "serve.h"
 
-#define MAX_COMMAND_LENGTH 100
-#define MAX_ARGUMENTS 30
+extern char **environ; // Only read once, to import the starting environment
 
-// Structure to store information about background jobs
-struct Job
+#define ARENA_CHUNK_SIZE 4096 // Smallest block the line arena allocates
+
+#define REDIRECT_FDS 10 // Fds 0 to 9 can be redirected, the shell keeps its own fds above them
+
+#define JOB_SLAB_SIZE 256    // Job records allocated at a time
+#define JOB_HASH_INITIAL 64  // Starting number of buckets in the job indexes
+
+#define DEADLINE_GRACE_DEFAULT 5000000000LL // Nanoseconds from SIGTERM to SIGKILL unless timeout -k says otherwise
+
+// Block of memory the arena hands out pieces of
+struct ArenaChunk
 {
-    pid_t pid;
-    char command[MAX_COMMAND_LENGTH];
-    int completed;
-    int job_id; // Unique job ID
-    struct Job *next;
-    char status[20];
+    struct ArenaChunk *next;
+    size_t size;
+    size_t used;
+    char data[];
 };
 
-struct Job *jobs_list = NULL; // Initialize the list of background jobs
-int next_job_id = 1;          // Initialize the next job ID
+// Bump allocator for everything that only lives as long as one command line
+// (expanded text, tokens, argv arrays). Nothing allocated from it is freed on
+// its own, the whole arena is reset at once before the next line is read.
+struct Arena
+{
+    struct ArenaChunk *head; // Chunk currently being filled
+    size_t total;            // Bytes handed out since the last reset
+};
 
-// Function to add a new background job to the list
-void add_job(pid_t pid, char input[MAX_COMMAND_LENGTH])
+struct Arena line_arena = {NULL, 0}; // Memory for the line being run
+
+// Function to allocate memory from an arena, aligned for any type
+void *arena_alloc(struct Arena *arena, size_t size)
 {
-    int i = 0;
-    while (input[i] != '&')
+    size = (size + 15) & ~(size_t)15;
+    struct ArenaChunk *chunk = arena->head;
+    if (chunk == NULL || chunk->size - chunk->used < size)
     {
-        if (input[i] == '\0')
+        size_t chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        chunk = (struct ArenaChunk *)malloc(sizeof(struct ArenaChunk) + chunk_size);
+        if (chunk == NULL)
         {
-            input[i] = ' ';
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-        i++;
+        chunk->next = arena->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->head = chunk;
     }
-    input[i] = '\0';
 
-    struct Job *new_job = (struct Job *)malloc(sizeof(struct Job));
-    new_job->pid = pid;
-    strncpy(new_job->command, input, sizeof(new_job->command));
-    new_job->completed = 0;
-    new_job->job_id = next_job_id++;
-    strncpy(new_job->status, "Running", sizeof(new_job->status));
-    printf("Background job started: [%i] %d %s\n", new_job->job_id, new_job->pid, new_job->command);
-    new_job->next = jobs_list;
+    void *memory = chunk->data + chunk->used;
+    chunk->used += size;
+    arena->total += size;
+    return memory;
+}
 
-    jobs_list = new_job;
+// Function to copy a string into an arena
+char *arena_strdup(struct Arena *arena, const char *str)
+{
+    size_t length = strlen(str) + 1;
+    return memcpy(arena_alloc(arena, length), str, length);
 }
 
-// Function to update and report the status of background jobs
-void update_jobs_status()
+// Function to release everything allocated from an arena in one step
+// If the last line needed more than one chunk, they are replaced with a
+// single chunk big enough for all of it, so a run of long lines settles on
+// one allocation that is reused every time.
+void arena_reset(struct Arena *arena)
 {
-    struct Job *job = jobs_list;
-    while (job != NULL)
+    struct ArenaChunk *chunk = arena->head;
+    if (chunk != NULL && chunk->next != NULL)
     {
-        int status;
-
-        pid_t result = waitpid(job->pid, &status, WNOHANG); // Check job status without blocking
-        if (result == -1)
-        {
-            strncpy(job->status, "Terminated", sizeof(job->status));
-        }
-        else if (result == 0)
-        {
-            strncpy(job->status, "Running", sizeof(job->status));
-        }
-        else
+        while (chunk != NULL)
         {
-            // The job has completed
-            job->completed = 1;
-            if (strcmp(job->status, "Terminated") != 0)
-            {
-                strncpy(job->status, "Completed", sizeof(job->status));
-            }
+            struct ArenaChunk *next = chunk->next;
+            free(chunk);
+            chunk = next;
         }
-        job = job->next;
+        arena->head = NULL;
+        arena_alloc(arena, arena->total);
+        chunk = arena->head;
     }
+    if (chunk != NULL)
+    {
+        chunk->used = 0;
+    }
+    arena->total = 0;
+}
 
-    // Clean up completed jobs
-    struct Job *current = jobs_list;
-    struct Job *prev = NULL;
-
-    while (current != NULL)
+// Function to free all of an arena's memory
+void arena_free(struct Arena *arena)
+{
+    while (arena->head != NULL)
     {
+        struct ArenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+    arena->total = 0;
+}
 
-        if (current->completed || strcmp(current->status, "Terminated") == 0)
-        {
-            if (strcmp(current->status, "Completed") == 0)
-            {
-                printf("%s: [%i] %d %s\n", current->status, current->job_id, current->pid, current->command);
-            }
+// Position in an arena that everything allocated after it can be released back to
+struct ArenaMark
+{
+    struct ArenaChunk *head;
+    size_t used;
+    size_t total;
+};
 
-            if (prev == NULL)
-            {
-                jobs_list = current->next;
-            }
-            else
-            {
-                prev->next = current->next;
-            }
-            if (!(strcmp(current->status, "Terminated") == 0))
-            {
-                free(current);
-            }
-            current = prev ? prev->next : jobs_list;
-        }
-        else
-        {
-            prev = current;
-            current = current->next;
-        }
-    }
+// Function to remember how far an arena is filled
+struct ArenaMark arena_mark(struct Arena *arena)
+{
+    struct ArenaMark mark = {arena->head, arena->head ? arena->head->used : 0, arena->total};
+    return mark;
 }
 
-// Function to handle built-in commands
-int handle_builtin(char **args, int in_fd, int out_fd, int identify)
+// Function to release everything allocated from an arena since a mark
+// A loop releases its arena this way on every iteration, so a long loop runs
+// in the memory of one iteration.
+void arena_release(struct Arena *arena, struct ArenaMark mark)
 {
-    if (identify == 0 || identify == 5)
+    while (arena->head != mark.head)
     {
-        if (in_fd != 0)
-        {
-            if (dup2(in_fd, 0) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-        }
-
-        if (out_fd != 1)
-        {
-            if (dup2(out_fd, 1) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-        }
+        struct ArenaChunk *next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
     }
-
-    if (strcmp(args[0], "echo") == 0)
+    if (arena->head != NULL)
     {
-        for (int i = 1; args[i] != NULL; i++)
-        {
-            if (args[i][0] == '$')
-            {
-                // Check if the argument is an environment variable
-                char *env_var_name = args[i] + 1; // Skip the '$' character
-                char *env_var_value = getenv(env_var_name);
-                if (env_var_value != NULL)
-                {
-                    printf("%s ", env_var_value);
-                }
-                else
-                {
-                    fprintf(stderr, "echo: Undefined environment variable: %s\n", env_var_name);
-                }
-            }
-            else
-            {
-                printf("%s ", args[i]);
-            }
-        }
-        printf("\n");
+        arena->head->used = mark.used;
     }
+    arena->total = mark.total;
+}
+
+// Arena that parsed commands live in, shared by everything that points into it
+// Each command is parsed and compiled into one. A function defined by the
+// command keeps a reference, so its body outlives the command; the arena
+// is freed when the last reference goes away.
+struct SharedArena
+{
+    struct Arena arena;
+    int references;
+};
 
-    else if (strcmp(args[0], "export") == 0)
+// Function to create a shared arena with one reference, held by the caller
+struct SharedArena *shared_arena_new()
+{
+    struct SharedArena *shared = (struct SharedArena *)malloc(sizeof(struct SharedArena));
+    if (shared == NULL)
     {
-        if (args[1] != NULL)
-        {
-            char *env_var = args[1];
-            if (strchr(env_var, '=') != NULL)
-            {
-                char *var_name = strtok(env_var, "=");
-                char *var_value = strtok(NULL, "=");
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    shared->arena.head = NULL;
+    shared->arena.total = 0;
+    shared->references = 1;
+    return shared;
+}
 
-                setenv(var_name, var_value, 1); // Update the environment variable
-            }
-            else
-            {
-                fprintf(stderr, "export: invalid argument\n");
-            }
-        }
-        else
-        {
-            fprintf(stderr, "export: missing argument\n");
-        }
+// Function to drop a reference to a shared arena, freeing it after the last one
+void shared_arena_release(struct SharedArena *shared)
+{
+    if (--shared->references == 0)
+    {
+        arena_free(&shared->arena);
+        free(shared);
     }
+}
+
+// Structure for a string that grows as it is appended to
+struct StringBuffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
 
-    else if (strcmp(args[0], "cd") == 0)
+// Function to make sure a growable string has room for extra more bytes
+void buffer_reserve(struct StringBuffer *buffer, size_t extra)
+{
+    if (buffer->length + extra + 1 > buffer->capacity)
     {
-        if (args[1] == NULL)
-        {
-            fprintf(stderr, "cd: missing directory\n");
-        }
-        else if (chdir(args[1]) == 0)
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (buffer->length + extra + 1 > capacity)
         {
-            char *new_pwd = getcwd(NULL, 0);
-            if (new_pwd != NULL)
-            {
-                setenv("PWD", new_pwd, 1);
-                free(new_pwd);
-            }
-            else
-            {
-                perror("getcwd");
-            }
+            capacity *= 2;
         }
-        else
+        buffer->data = (char *)realloc(buffer->data, capacity);
+        if (buffer->data == NULL)
         {
-            perror("chdir");
+            perror("realloc");
+            exit(EXIT_FAILURE);
         }
+        buffer->capacity = capacity;
     }
+}
+
+// Function to append bytes to a growable string
+void buffer_append(struct StringBuffer *buffer, const char *data, size_t length)
+{
+    buffer_reserve(buffer, length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+    buffer->data[buffer->length] = '\0';
+}
+
+#define TRACE_FLUSH_SIZE 65536 // Buffered trace events are written out past this size
+
+// Structure a forked child sends back just before it execs a command
+struct TraceExec
+{
+    pid_t pid;
+    long long start; // when the child started running after fork
+    long long exec;  // just before execve
+};
+
+int tracing = 0;                                  // QUASH_TRACE is set, every trace point checks only this
+int trace_fd = -1;                                // File the trace goes to
+int trace_exec_pipe[2] = {-1, -1};                // Close-on-exec pipe children report exec times over
+struct StringBuffer trace_buffer = {NULL, 0, 0}; // Events not written out yet
+int trace_children = 1;                           // Children forked now are waited for, so they can add to the trace
 
-    else if (strcmp(args[0], "pwd") == 0)
+// Function to get the time in nanoseconds for a trace event
+long long trace_now()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Function to write out the buffered trace events
+void trace_flush()
+{
+    size_t done = 0;
+    while (done < trace_buffer.length)
     {
-        char cwd[1024];
-        if (getcwd(cwd, sizeof(cwd)) != NULL)
+        ssize_t count = write(trace_fd, trace_buffer.data + done, trace_buffer.length - done);
+        if (count == -1 && errno == EINTR)
         {
-            printf("%s\n", cwd);
+            continue;
         }
-        else
+        if (count <= 0)
         {
-            perror("getcwd");
+            perror("QUASH_TRACE");
+            break;
         }
+        done += count;
     }
+    trace_buffer.length = 0;
+}
 
-    else if (strcmp(args[0], "jobs") == 0)
+// Function to add a complete event (a span) to the trace
+// Times are in nanoseconds, the trace format wants microseconds. The detail,
+// usually a command name, is shown as an argument of the span.
+void trace_event(const char *name, pid_t pid, long long start, long long end, const char *detail)
+{
+    char event[256];
+    int length = snprintf(event, sizeof(event), ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%lld.%03lld,\"dur\":%lld.%03lld",
+                          name, (int)getpid(), (int)pid, start / 1000, start % 1000, (end - start) / 1000, (end - start) % 1000);
+    buffer_append(&trace_buffer, event, length);
+    if (detail != NULL)
     {
-        update_jobs_status();
-        struct Job *job = jobs_list;
-        struct Job *jobs[MAX_COMMAND_LENGTH];
-        int start = 0;
-        int index = 0;
-        int total = 0;
-        while (job != NULL)
+        // Escape the detail as a JSON string
+        const char *args = ",\"args\":{\"detail\":\"";
+        buffer_append(&trace_buffer, args, strlen(args));
+        for (const char *c = detail; *c; c++)
         {
-            if (!job->completed)
+            if (*c == '"' || *c == '\\')
             {
-                jobs[index++] = job;
+                buffer_append(&trace_buffer, "\\", 1);
+                buffer_append(&trace_buffer, c, 1);
+            }
+            else if ((unsigned char)*c < 0x20)
+            {
+                snprintf(event, sizeof(event), "\\u%04x", *c);
+                buffer_append(&trace_buffer, event, 6);
+            }
+            else
+            {
+                buffer_append(&trace_buffer, c, 1);
             }
-            job = job->next;
-        }
-        total = index;
-        index--;
-
-        while (start < index)
-        {
-            struct Job *tmp = jobs[start];
-            jobs[start] = jobs[index];
-            jobs[index] = tmp;
-            start++;
-            index--;
-        }
-        for (int i = 0; i < total; i++)
-        {
-            printf("[%d] %d %s\n", jobs[i]->job_id, jobs[i]->pid, jobs[i]->command);
         }
+        buffer_append(&trace_buffer, "\"}", 2);
     }
-    else if (strcmp(args[0], "kill") == 0)
+    buffer_append(&trace_buffer, "}", 1);
+    if (trace_buffer.length > TRACE_FLUSH_SIZE)
     {
+        trace_flush();
+    }
+}
 
-        long long int pid = strtoll(args[2], NULL, 0);
-        int signum = atoi(args[1]);
-        struct Job *job = jobs_list;
+// Function to add a span of the shell itself that started at start and ends now
+void trace_span(const char *name, long long start, const char *detail)
+{
+    trace_event(name, getpid(), start, trace_now(), detail);
+}
 
-        while (job != NULL)
-        {
-            if (job->pid == pid)
-            {
-                strncpy(job->status, "Terminated", sizeof(job->status));
-                job->completed = 1;
-                break;
-            }
-            job = job->next;
-        }
+// Function to move an fd the shell keeps for itself above the ones redirections can name
+// The fd stays close-on-exec. Returns the new fd.
+int move_fd_high(int fd)
+{
+    int high = fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+    if (high == -1)
+    {
+        return fd;
+    }
+    close(fd);
+    return high;
+}
 
-        update_jobs_status();
-        if (kill(pid, signum) == -1)
-        {
-            perror("kill");
-        }
+// Function to start tracing into the file QUASH_TRACE names
+// The file is a Chrome trace-event JSON array, which Perfetto and
+// chrome://tracing load directly. Each phase of running a command is a span
+// on the shell's track; the time a forked child spent before execve is a
+// span on the child's own track.
+void setup_tracing(const char *path)
+{
+    trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if (trace_fd == -1)
+    {
+        perror(path);
+        return;
     }
-    else
+    trace_fd = move_fd_high(trace_fd);
+    // Children write into the pipe right before exec, after which it is closed
+    if (pipe2(trace_exec_pipe, O_CLOEXEC) == -1 || fcntl(trace_exec_pipe[0], F_SETFL, O_NONBLOCK) == -1)
     {
-
-        return 0; // not a built-in command
+        perror("pipe2");
+        close(trace_fd);
+        return;
     }
-    if (identify == 0 || identify == 5)
+    trace_exec_pipe[0] = move_fd_high(trace_exec_pipe[0]);
+    trace_exec_pipe[1] = move_fd_high(trace_exec_pipe[1]);
+    char header[128];
+    int length = snprintf(header, sizeof(header), "[\n{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"quash\"}}", (int)getpid());
+    buffer_append(&trace_buffer, header, length);
+    tracing = 1;
+}
+
+// Function to record, from a forked child, that it is about to exec
+// A record this small is written to the pipe in one piece.
+void trace_exec(long long start)
+{
+    struct TraceExec record = {getpid(), start, trace_now()};
+    if (write(trace_exec_pipe[1], &record, sizeof(record)) == -1)
     {
-        if (in_fd != 0)
-        {
-            close(in_fd);
-        }
+        // The trace just misses this exec
+    }
+}
 
-        if (out_fd != 1)
-        {
-            close(out_fd);
-        }
+// Function to turn the exec times children sent back into trace events
+void trace_collect_execs()
+{
+    struct TraceExec record;
+    while (read(trace_exec_pipe[0], &record, sizeof(record)) == sizeof(record))
+    {
+        trace_event("exec", record.pid, record.start, record.exec, NULL);
     }
-    return 1; // Command was a built-in command
 }
 
-// Function to expand environment variables in a string
-char *expand_environment_variables(char *input)
+// Function to stop tracing in a forked child the shell will not wait for
+// The parent may close the trace before such a child is done, and anything
+// the child wrote after the closing ] would make the file invalid JSON, so
+// the child records nothing at all.
+void drop_tracing()
 {
-    char expanded[10 * MAX_COMMAND_LENGTH]; // Allocate space for possible expansion
+    close(trace_fd);
+    close(trace_exec_pipe[0]);
+    close(trace_exec_pipe[1]);
+    trace_buffer.length = 0;
+    tracing = 0;
+}
 
-    const char *token = input;
-    char *output = expanded; // Pointer to the current position in the output buffer
+// Function to finish the trace when the shell exits
+void finish_tracing()
+{
+    trace_collect_execs();
+    buffer_append(&trace_buffer, "\n]\n", 3);
+    trace_flush();
+    close(trace_fd);
+    close(trace_exec_pipe[0]);
+    close(trace_exec_pipe[1]);
+    free(trace_buffer.data);
+    tracing = 0;
+}
 
-    while (*token)
-    {
-        if (*token == '$' && (token == input || token[-1] != '\\'))
-        {
-            const char *start = token + 1;
-            const char *end = start;
+// States a background job, or one of its processes, can be in
+enum JobState
+{
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_COMPLETED
+};
 
-            // Parse the variable name
-            while (*end && ((*end >= 'a' && *end <= 'z') || (*end >= 'A' && *end <= 'Z') || (*end >= '0' && *end <= '9') || *end == '_'))
-            {
-                end++;
-            }
+struct Job;
 
-            if (end > start)
-            {
-                size_t var_name_length = end - start;
-                char var_name[var_name_length + 1];
-                strncpy(var_name, start, var_name_length);
-                var_name[var_name_length] = '\0';
+// Structure for one process of a background job
+struct JobProcess
+{
+    pid_t pid;
+    enum JobState state;
+    int status;                     // Wait status once it has exited
+    struct Job *job;                // Job it belongs to
+    struct JobProcess *pid_next;    // Chain in the pid index
+};
 
-                char *var_value = getenv(var_name);
-                if (var_value != NULL)
-                {
-                    size_t var_value_length = strlen(var_value);
-                    strncpy(output, var_value, var_value_length);
-                    output += var_value_length;
-                    token = end;
-                }
-                else
-                {
-                    // If the environment variable doesn't exist, keep the original text
-                    while (start < end)
-                    {
-                        *output = *start;
-                        output++;
-                        start++;
-                    }
-                }
-            }
-            else
-            {
-                // If there is no variable name, keep the original character
-                *output = *token;
-                output++;
-                token++;
-            }
-        }
-        else
-        {
-            *output = *token;
-            output++;
-            token++;
-        }
-    }
+// Structure to store information about background jobs
+// A job is a whole pipeline in a process group of its own, so one kill of
+// the group reaches every stage.
+struct Job
+{
+    pid_t pgid;                  // Process group, the pid of its first process
+    char *command;
+    enum JobState state;
+    int job_id;                  // Unique job ID
+    int status;                  // Exit status of the last process once completed
+    int notify;                  // Still to be reported when it completes
+    long long deadline;          // Serial of its deadline, 0 if it has none
+    struct JobProcess *processes; // Every process of the pipeline, in order
+    int process_count;
+    int running;                 // Processes not reaped yet
+    int stopped;                 // Processes stopped by a signal
+    struct Job *prev, *next;     // Jobs in the order they were started
+    struct Job *id_next;         // Chain in the job ID index
+    struct Job *finished_next;   // Chain of jobs waiting to be reported
+    struct rusage usage;         // Resources used by its processes reaped so far
+};
 
-    *output = '\0'; // Null-terminate the expanded string
-    strcpy(input, expanded);
+// Block of job records, jobs are carved out of these instead of malloc'd one by one
+struct JobSlab
+{
+    struct JobSlab *next;
+    struct Job jobs[JOB_SLAB_SIZE];
+};
 
-    return input;
-}
+struct Job *jobs_list = NULL;      // Initialize the list of background jobs
+struct Job *jobs_tail = NULL;      // Last job started, new jobs go after it
+struct Job *finished_jobs = NULL;  // Jobs that exited since the last report
+struct Job *free_jobs = NULL;      // Unused job records
+struct JobSlab *job_slabs = NULL;  // Every slab allocated so far
+struct JobProcess **processes_by_pid = NULL; // pid -> process of a job hash
+struct Job **jobs_by_id = NULL;    // job ID -> job hash
+size_t job_buckets = 0;            // Buckets in each of the two hashes
+size_t job_count = 0;              // Jobs currently in the table
+size_t job_process_count = 0;      // Processes of those jobs
+size_t jobs_running = 0;           // Jobs in the table that are running
+int next_job_id = 1;               // Initialize the next job ID
+pid_t last_background_pid = 0;     // $!, the last process of the last job started
+int last_status = 0;               // Exit status of the last foreground command
+int exit_requested = 0;            // quit or exit was run, stop after this line
+int interactive = 0;               // Reading commands from a terminal, so prompt and report jobs
+char *shell_name = "quash";        // $0, the script name when running one
+char **positional_args = NULL;     // $1 and up
+int positional_count = 0;          // $#
 
-// Function to execute a command with input and output redirection
-void execute_command(char **args, int in_fd, int out_fd, int final, int background, int start, char input[MAX_COMMAND_LENGTH])
+
+// Function to add a process to the pid index
+void index_process(struct JobProcess *process)
 {
-    pid_t pid = fork();
+    size_t bucket = (size_t)process->pid & (job_buckets - 1);
+    process->pid_next = processes_by_pid[bucket];
+    processes_by_pid[bucket] = process;
+}
 
-    if (pid < 0)
+// Function to grow both job indexes and rehash every job into them
+void resize_job_indexes(size_t buckets)
+{
+    free(processes_by_pid);
+    free(jobs_by_id);
+    processes_by_pid = (struct JobProcess **)calloc(buckets, sizeof(struct JobProcess *));
+    jobs_by_id = (struct Job **)calloc(buckets, sizeof(struct Job *));
+    if (processes_by_pid == NULL || jobs_by_id == NULL)
     {
-        perror("fork");
+        perror("calloc");
         exit(EXIT_FAILURE);
     }
+    job_buckets = buckets;
 
-    if (pid == 0)
-    { // Child process
-        if (in_fd != 0)
-        {
-
-            if (dup2(in_fd, 0) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-            close(in_fd);
-        }
-
-        if (out_fd != 1)
-        {
-            if (dup2(out_fd, 1) == -1)
-            {
-                perror("dup2");
-                exit(EXIT_FAILURE);
-            }
-            close(out_fd);
-        }
-
-        if (strstr(" echo export cd pwd quit exit jobs kill ", args[0]) != NULL)
-        {
-            handle_builtin(args, in_fd, out_fd, 1);
-            exit(EXIT_SUCCESS);
-        }
-        else
+    for (struct Job *job = jobs_list; job != NULL; job = job->next)
+    {
+        for (int i = 0; i < job->process_count; i++)
         {
-            execvp(args[0], args);
-            perror("execvp");
-            exit(EXIT_FAILURE);
+            index_process(&job->processes[i]);
         }
+        size_t id_bucket = (size_t)job->job_id & (job_buckets - 1);
+        job->id_next = jobs_by_id[id_bucket];
+        jobs_by_id[id_bucket] = job;
     }
-    else
-    { // Parent process
-        if (background == 0)
-        {
-            int status;
-            waitpid(pid, &status, 0);
-        }
-        if (background == 1 && start == 1)
-        {
-            add_job(pid, input);
-        }
+}
 
-        if (in_fd != 0)
+// Function to take a job record from the free list, allocating a new slab if needed
+struct Job *alloc_job()
+{
+    if (free_jobs == NULL)
+    {
+        struct JobSlab *slab = (struct JobSlab *)malloc(sizeof(struct JobSlab));
+        if (slab == NULL)
         {
-            close(in_fd);
+            perror("malloc");
+            exit(EXIT_FAILURE);
         }
-        if (out_fd != 1)
+        slab->next = job_slabs;
+        job_slabs = slab;
+        for (int i = 0; i < JOB_SLAB_SIZE; i++)
         {
-            close(out_fd);
+            slab->jobs[i].next = free_jobs;
+            free_jobs = &slab->jobs[i];
         }
     }
+
+    struct Job *job = free_jobs;
+    free_jobs = job->next;
+    return job;
 }
 
-int tokenize_input(char *input, char **args, int arg_count)
+// Function to add a new background job to the list
+// pids are the processes of the pipeline in order, those that are zero or
+// below never started and are left out. The processes and the command text
+// share one allocation. Returns the job, or NULL if nothing started.
+struct Job *add_job(const pid_t *pids, int count, pid_t pgid, const char *command)
 {
-    char *token;
-    int inside_single_quote = 0;
-    int inside_double_quote = 0;
-    int comment = 0;
-
-    // Split the input using whitespace as the initial delimiter
-    token = strtok(input, " ");
+    int started = 0;
+    for (int i = 0; i < count; i++)
+    {
+        started += pids[i] > 0;
+    }
+    if (started == 0)
+    {
+        return NULL;
+    }
+    while (job_process_count + started > job_buckets || job_count + 1 > job_buckets)
+    {
+        resize_job_indexes(job_buckets ? job_buckets * 2 : JOB_HASH_INITIAL);
+    }
 
-    while (token != NULL)
+    struct Job *new_job = alloc_job();
+    size_t length = strlen(command) + 1;
+    new_job->processes = (struct JobProcess *)malloc(started * sizeof(struct JobProcess) + length);
+    if (new_job->processes == NULL)
     {
-        // Check if this token starts a comment
-        if (!inside_single_quote && !inside_double_quote && token[0] == '#')
-        {
-            // Ignore the rest of the line and break
-            break;
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    new_job->command = memcpy((char *)(new_job->processes + started), command, length);
+    new_job->process_count = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (pids[i] > 0)
+        {
+            struct JobProcess *process = &new_job->processes[new_job->process_count++];
+            process->pid = pids[i];
+            process->state = JOB_RUNNING;
+            process->status = 0;
+            process->job = new_job;
+            index_process(process);
+            last_background_pid = pids[i];
+        }
+    }
+    new_job->pgid = pgid;
+    new_job->state = JOB_RUNNING;
+    jobs_running++;
+    new_job->job_id = next_job_id++;
+    new_job->status = 0;
+    new_job->notify = 1;
+    new_job->deadline = 0;
+    new_job->running = started;
+    new_job->stopped = 0;
+    memset(&new_job->usage, 0, sizeof(new_job->usage));
+
+    new_job->prev = jobs_tail;
+    new_job->next = NULL;
+    if (jobs_tail != NULL)
+    {
+        jobs_tail->next = new_job;
+    }
+    else
+    {
+        jobs_list = new_job;
+    }
+    jobs_tail = new_job;
+
+    size_t id_bucket = (size_t)new_job->job_id & (job_buckets - 1);
+    new_job->id_next = jobs_by_id[id_bucket];
+    jobs_by_id[id_bucket] = new_job;
+    job_count++;
+    job_process_count += started;
+    return new_job;
+}
+
+// Function to add a job started in the background, telling a terminal about it
+void add_background_job(const pid_t *pids, int count, pid_t pgid, const char *command)
+{
+    struct Job *job = add_job(pids, count, pgid, command);
+    if (job != NULL && interactive)
+    {
+        printf("Background job started: [%i] %d %s\n", job->job_id, job->pgid, job->command);
+    }
+}
+
+// Function to find the process of a background job with the given pid
+struct JobProcess *find_job_process(pid_t pid)
+{
+    if (job_buckets == 0)
+    {
+        return NULL;
+    }
+    struct JobProcess *process = processes_by_pid[(size_t)pid & (job_buckets - 1)];
+    while (process != NULL && process->pid != pid)
+    {
+        process = process->pid_next;
+    }
+    return process;
+}
+
+// Function to find the background job one of whose processes has the given pid
+struct Job *find_job(pid_t pid)
+{
+    struct JobProcess *process = find_job_process(pid);
+    return process != NULL ? process->job : NULL;
+}
+
+// Function to find a background job by its job ID
+struct Job *find_job_by_id(int job_id)
+{
+    if (job_buckets == 0)
+    {
+        return NULL;
+    }
+    struct Job *job = jobs_by_id[(size_t)job_id & (job_buckets - 1)];
+    while (job != NULL && job->job_id != job_id)
+    {
+        job = job->id_next;
+    }
+    return job;
+}
+
+// Function to change a job's state, keeping count of the jobs that are running
+void set_job_state(struct Job *job, enum JobState state)
+{
+    jobs_running += (state == JOB_RUNNING) - (job->state == JOB_RUNNING);
+    job->state = state;
+}
+
+// Function to take a job out of the list and indexes and recycle its record
+void remove_job(struct Job *job)
+{
+    jobs_running -= job->state == JOB_RUNNING;
+    for (int i = 0; i < job->process_count; i++)
+    {
+        struct JobProcess **link = &processes_by_pid[(size_t)job->processes[i].pid & (job_buckets - 1)];
+        while (*link != &job->processes[i])
+        {
+            link = &(*link)->pid_next;
+        }
+        *link = job->processes[i].pid_next;
+    }
+
+    struct Job **link = &jobs_by_id[(size_t)job->job_id & (job_buckets - 1)];
+    while (*link != job)
+    {
+        link = &(*link)->id_next;
+    }
+    *link = job->id_next;
+
+    if (job->prev != NULL)
+    {
+        job->prev->next = job->next;
+    }
+    else
+    {
+        jobs_list = job->next;
+    }
+    if (job->next != NULL)
+    {
+        job->next->prev = job->prev;
+    }
+    else
+    {
+        jobs_tail = job->prev;
+    }
+
+    job_process_count -= job->process_count;
+    free(job->processes);
+    job->next = free_jobs;
+    free_jobs = job;
+    job_count--;
+}
+
+// Function to release every job record and index, used when the shell exits
+void free_jobs_table()
+{
+    while (jobs_list != NULL)
+    {
+        remove_job(jobs_list);
+    }
+    while (job_slabs != NULL)
+    {
+        struct JobSlab *next = job_slabs->next;
+        free(job_slabs);
+        job_slabs = next;
+    }
+    free_jobs = NULL;
+    finished_jobs = NULL;
+    free(processes_by_pid);
+    free(jobs_by_id);
+    processes_by_pid = NULL;
+    jobs_by_id = NULL;
+    job_buckets = 0;
+}
+
+// Structure for a deadline, after which a process group is told to stop
+// The first time it passes the group gets SIGTERM, and it comes back
+// grace later to send SIGKILL. A deadline whose command completes first is
+// taken out of the heap by its serial.
+struct Deadline
+{
+    long long when;   // CLOCK_MONOTONIC nanoseconds
+    long long serial; // Tells this deadline from any other for the same group
+    long long grace;
+    pid_t pgid;
+    int terminated;   // SIGTERM has been sent, SIGKILL is next
+};
+
+struct Deadline *deadlines = NULL; // Min-heap on when
+size_t deadline_count = 0;
+size_t deadline_capacity = 0;
+long long next_deadline_serial = 1;
+long long timeout_serial = 0;      // Deadline of the command timeout is running in the foreground
+int timeout_expired = 0;           // That deadline passed
+int deadline_timer = -1;           // timerfd armed for the earliest deadline, made when first needed
+
+// Function to arm the timer for the earliest deadline
+void arm_deadline_timer()
+{
+    struct itimerspec spec;
+    memset(&spec, 0, sizeof(spec));
+    if (deadline_count > 0)
+    {
+        // 0 would disarm it, a deadline that has passed fires at once either way
+        long long when = deadlines[0].when > 0 ? deadlines[0].when : 1;
+        spec.it_value.tv_sec = when / 1000000000LL;
+        spec.it_value.tv_nsec = when % 1000000000LL;
+    }
+    timerfd_settime(deadline_timer, TFD_TIMER_ABSTIME, &spec, NULL);
+}
+
+// Function to put a deadline at heap position i or wherever above it it belongs
+void sift_deadline_up(size_t i, const struct Deadline *deadline)
+{
+    while (i > 0 && deadlines[(i - 1) / 2].when > deadline->when)
+    {
+        deadlines[i] = deadlines[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    deadlines[i] = *deadline;
+}
+
+// Function to put a deadline at heap position i or wherever below it it belongs
+void sift_deadline_down(size_t i, const struct Deadline *deadline)
+{
+    while (2 * i + 1 < deadline_count)
+    {
+        size_t child = 2 * i + 1;
+        if (child + 1 < deadline_count && deadlines[child + 1].when < deadlines[child].when)
+        {
+            child++;
+        }
+        if (deadline->when <= deadlines[child].when)
+        {
+            break;
+        }
+        deadlines[i] = deadlines[child];
+        i = child;
+    }
+    deadlines[i] = *deadline;
+}
+
+// Function to add a deadline to the heap
+void push_deadline(const struct Deadline *deadline)
+{
+    if (deadline_timer == -1)
+    {
+        deadline_timer = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+        if (deadline_timer == -1)
+        {
+            perror("timerfd_create");
+            exit(EXIT_FAILURE);
+        }
+        deadline_timer = move_fd_high(deadline_timer);
+    }
+    if (deadline_count == deadline_capacity)
+    {
+        deadline_capacity = deadline_capacity ? deadline_capacity * 2 : 16;
+        deadlines = (struct Deadline *)realloc(deadlines, deadline_capacity * sizeof(struct Deadline));
+        if (deadlines == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    sift_deadline_up(deadline_count++, deadline);
+    if (deadlines[0].serial == deadline->serial)
+    {
+        arm_deadline_timer();
+    }
+}
+
+// Function to take the deadline at heap position i out of the heap
+struct Deadline remove_deadline_at(size_t i)
+{
+    struct Deadline removed = deadlines[i];
+    struct Deadline last = deadlines[--deadline_count];
+    if (i < deadline_count)
+    {
+        if (i > 0 && deadlines[(i - 1) / 2].when > last.when)
+        {
+            sift_deadline_up(i, &last);
+        }
+        else
+        {
+            sift_deadline_down(i, &last);
+        }
+    }
+    return removed;
+}
+
+// Function to set a deadline duration from now for a process group
+// Returns its serial.
+long long add_deadline(pid_t pgid, long long duration, long long grace)
+{
+    struct Deadline deadline;
+    deadline.when = trace_now() + duration;
+    deadline.serial = next_deadline_serial++;
+    deadline.grace = grace;
+    deadline.pgid = pgid;
+    deadline.terminated = 0;
+    push_deadline(&deadline);
+    return deadline.serial;
+}
+
+// Function to drop a deadline whose command has completed
+void cancel_deadline(long long serial)
+{
+    for (size_t i = 0; i < deadline_count; i++)
+    {
+        if (deadlines[i].serial == serial)
+        {
+            remove_deadline_at(i);
+            if (i == 0)
+            {
+                arm_deadline_timer();
+            }
+            return;
+        }
+    }
+}
+
+// Function to act on every deadline that has passed, then arm the timer for the next
+void expire_deadlines()
+{
+    long long now = trace_now();
+    if (deadline_count == 0 || deadlines[0].when > now)
+    {
+        return;
+    }
+    while (deadline_count > 0 && deadlines[0].when <= now)
+    {
+        struct Deadline deadline = remove_deadline_at(0);
+        if (deadline.serial == timeout_serial)
+        {
+            timeout_expired = 1;
+        }
+        if (deadline.terminated)
+        {
+            kill(-deadline.pgid, SIGKILL);
+            continue;
+        }
+        // A stopped group would not act on SIGTERM until continued
+        kill(-deadline.pgid, SIGTERM);
+        kill(-deadline.pgid, SIGCONT);
+        deadline.terminated = 1;
+        deadline.when = now + deadline.grace;
+        push_deadline(&deadline);
+    }
+    arm_deadline_timer();
+}
+
+volatile sig_atomic_t children_exited = 0; // Set by the SIGCHLD handler
+int sigchld_pipe[2] = {-1, -1};              // Self-pipe that wakes the prompt when a child exits
+int prompt_pending = 0;                      // The prompt is on screen without a newline after it
+int signal_fd = -1;                          // Terminal signals of an interactive shell, -1 otherwise
+sigset_t child_signal_mask;                  // Signal mask commands start with
+int interrupt_pending = 0;                   // Ctrl-C was pressed and the line it was on not ended yet
+int zygote_fd = -1;                          // Socket to the zygote that starts commands, -1 without one
+
+// SIGCHLD handler, only records the event so the reaping happens outside the handler
+void handle_sigchld(int signum)
+{
+    int saved_errno = errno;
+    children_exited = 1;
+    if (write(sigchld_pipe[1], "x", 1) == -1)
+    {
+        // The pipe is full, which already means a wakeup is pending
+    }
+    errno = saved_errno;
+}
+
+// Function to install the SIGCHLD handler and its self-pipe
+void setup_sigchld()
+{
+    if (pipe2(sigchld_pipe, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        perror("pipe2");
+        exit(EXIT_FAILURE);
+    }
+    sigchld_pipe[0] = move_fd_high(sigchld_pipe[0]);
+    sigchld_pipe[1] = move_fd_high(sigchld_pipe[1]);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = handle_sigchld;
+    sigemptyset(&action.sa_mask);
+    action.sa_flags = SA_RESTART; // jobs that stop or continue are reported too
+    if (sigaction(SIGCHLD, &action, NULL) == -1)
+    {
+        perror("sigaction");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Function to set up the signals of the shell itself
+// Commands start with the mask the shell was given. An interactive shell
+// then blocks Ctrl-C, Ctrl-\ and Ctrl-Z, which are meant for the command in
+// the foreground, and reads them from signal_fd next to its other events:
+// Ctrl-C only drops the line being typed or stops a wait. SIGCHLD keeps its
+// handler, as the flag it sets lets a script check for exited jobs after
+// every line without a system call.
+void setup_signals()
+{
+    sigprocmask(SIG_BLOCK, NULL, &child_signal_mask);
+    setup_sigchld();
+    if (!interactive)
+    {
+        return;
+    }
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGINT);
+    sigaddset(&mask, SIGQUIT);
+    sigaddset(&mask, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+    signal_fd = signalfd(-1, &mask, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (signal_fd == -1)
+    {
+        perror("signalfd");
+        exit(EXIT_FAILURE);
+    }
+    signal_fd = move_fd_high(signal_fd);
+}
+
+// Function to give a forked child the signal handling of a command
+void setup_child_signals()
+{
+    signal(SIGPIPE, SIG_DFL);
+    sigprocmask(SIG_SETMASK, &child_signal_mask, NULL);
+    if (signal_fd != -1)
+    {
+        close(signal_fd);
+        signal_fd = -1;
+    }
+    // The deadlines are for the parent shell to act on
+    deadline_count = 0;
+    if (deadline_timer != -1)
+    {
+        close(deadline_timer);
+        deadline_timer = -1;
+    }
+    // Commands the child starts are its own to start
+    if (zygote_fd != -1)
+    {
+        close(zygote_fd);
+        zygote_fd = -1;
+    }
+}
+
+// Function to read the terminal signals that came in, returning 1 if one was Ctrl-C
+int read_signals()
+{
+    int interrupted = 0;
+    struct signalfd_siginfo info;
+    while (signal_fd != -1 && read(signal_fd, &info, sizeof(info)) == sizeof(info))
+    {
+        interrupted |= info.ssi_signo == SIGINT;
+    }
+    interrupt_pending |= interrupted;
+    return interrupted;
+}
+
+// Function to add the resources one process used to a running total
+// Times, faults and context switches add up; max RSS is the largest seen.
+void add_usage(struct rusage *total, const struct rusage *usage)
+{
+    timeradd(&total->ru_utime, &usage->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &usage->ru_stime, &total->ru_stime);
+    if (usage->ru_maxrss > total->ru_maxrss)
+    {
+        total->ru_maxrss = usage->ru_maxrss;
+    }
+    total->ru_minflt += usage->ru_minflt;
+    total->ru_majflt += usage->ru_majflt;
+    total->ru_nvcsw += usage->ru_nvcsw;
+    total->ru_nivcsw += usage->ru_nivcsw;
+}
+
+// Function to take what was used up to an earlier sample out of a later one
+void subtract_usage(struct rusage *usage, const struct rusage *before)
+{
+    timersub(&usage->ru_utime, &before->ru_utime, &usage->ru_utime);
+    timersub(&usage->ru_stime, &before->ru_stime, &usage->ru_stime);
+    usage->ru_minflt -= before->ru_minflt;
+    usage->ru_majflt -= before->ru_majflt;
+    usage->ru_nvcsw -= before->ru_nvcsw;
+    usage->ru_nivcsw -= before->ru_nivcsw;
+}
+
+// Function to turn a wait status into the exit status the shell reports
+int exit_status(int status)
+{
+    if (WIFEXITED(status))
+    {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status))
+    {
+        return 128 + WTERMSIG(status);
+    }
+    return status;
+}
+
+// Function to record a change reported by wait for a process of a background job, if it is one
+// Processes can stop and continue as well as exit. A job has completed
+// once every one of its processes has been reaped, and is stopped while
+// any of them is.
+void job_exited(pid_t pid, int status, const struct rusage *usage)
+{
+    struct JobProcess *process = find_job_process(pid);
+    if (process == NULL || process->state == JOB_COMPLETED)
+    {
+        return;
+    }
+    struct Job *job = process->job;
+    if (process->state == JOB_STOPPED && !WIFSTOPPED(status))
+    {
+        job->stopped--;
+    }
+    if (WIFSTOPPED(status))
+    {
+        job->stopped += process->state != JOB_STOPPED;
+        process->state = JOB_STOPPED;
+    }
+    else if (WIFCONTINUED(status))
+    {
+        process->state = JOB_RUNNING;
+    }
+    else
+    {
+        add_usage(&job->usage, usage);
+        process->state = JOB_COMPLETED;
+        process->status = status;
+        job->running--;
+    }
+
+    if (job->running == 0)
+    {
+        // The job has completed, its status is that of its last process
+        set_job_state(job, JOB_COMPLETED);
+        if (job->deadline != 0)
+        {
+            cancel_deadline(job->deadline);
+            job->deadline = 0;
+        }
+        job->status = exit_status(job->processes[job->process_count - 1].status);
+        job->finished_next = finished_jobs;
+        finished_jobs = job;
+    }
+    else
+    {
+        set_job_state(job, job->stopped > 0 ? JOB_STOPPED : JOB_RUNNING);
+    }
+}
+
+// Function to reap every child that changed state since the last call
+// Does nothing unless SIGCHLD came in. Jobs that complete are put on the
+// finished list.
+void reap_children()
+{
+    if (!children_exited)
+    {
+        return;
+    }
+    children_exited = 0;
+
+    // Drain the self-pipe before reaping so a later exit wakes us again
+    char buf[64];
+    while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+    {
+    }
+
+    int status;
+    pid_t pid;
+    struct rusage usage;
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &usage)) > 0)
+    {
+        job_exited(pid, status, &usage);
+    }
+    if (tracing)
+    {
+        trace_collect_execs();
+    }
+}
+
+// Function to update and report the status of background jobs
+// Does nothing unless a child has changed state since the last call, or a
+// job completed while fg or wait was waiting for it. Otherwise every
+// changed child is reaped with a single wait4(-1) loop and matched to its
+// job through the pid index, so the cost depends on how many children
+// exited and not on how many jobs exist. A terminal gets told about
+// completed jobs, which are then dropped; a script keeps them until wait
+// or jobs has seen them, so wait can still give their status. Returns the
+// number of completion notices printed.
+int update_jobs_status()
+{
+    int notices = 0;
+
+    if (deadline_count > 0)
+    {
+        expire_deadlines();
+    }
+    if (!children_exited && finished_jobs == NULL)
+    {
+        return 0;
+    }
+    reap_children();
+
+    // Report and clean up completed jobs
+    while (finished_jobs != NULL)
+    {
+        struct Job *job = finished_jobs;
+        finished_jobs = job->finished_next;
+
+        if (interactive && job->notify)
+        {
+            if (prompt_pending)
+            {
+                // Don't print the notice on the same line as the prompt
+                printf("\n");
+                prompt_pending = 0;
+            }
+            printf("Completed: [%i] %d %s\n", job->job_id, job->pgid, job->command);
+            notices++;
+        }
+        if (interactive || !job->notify)
+        {
+            remove_job(job);
+        }
+    }
+    return notices;
+}
+
+// Events the shell sleeps until
+enum Event
+{
+    EVENT_INPUT,    // there is input to read
+    EVENT_CHILD,    // a child changed state
+    EVENT_INTERRUPT // Ctrl-C was pressed
+};
+
+// Function to sleep until there is input on fd (-1 for none), a child
+// changes state or, in a terminal, Ctrl-C is pressed
+// All of them are fds polled together, so the shell uses no CPU while it
+// waits however many jobs are outstanding. Child changes come first, so a
+// job that completed is seen before an interrupt of the wait for it.
+// Deadlines that pass meanwhile are acted on without returning.
+enum Event wait_for_event(int fd)
+{
+    struct pollfd fds[4];
+    fds[0].fd = sigchld_pipe[0];
+    fds[0].events = POLLIN;
+    fds[1].fd = signal_fd;
+    fds[1].events = POLLIN;
+    fds[2].fd = fd;
+    fds[2].events = POLLIN;
+    fds[3].fd = deadline_timer;
+    fds[3].events = POLLIN;
+
+    while (1)
+    {
+        fflush(stdout);
+        if (poll(fds, 4, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("poll");
+            return EVENT_INPUT;
+        }
+        if (fds[3].revents & POLLIN)
+        {
+            unsigned long long expirations;
+            if (read(deadline_timer, &expirations, sizeof(expirations)) == -1)
+            {
+                // Already read, or the timer was moved since it fired
+            }
+            expire_deadlines();
+        }
+        if (fds[0].revents & POLLIN)
+        {
+            return EVENT_CHILD;
+        }
+        if ((fds[1].revents & POLLIN) && read_signals())
+        {
+            return EVENT_INTERRUPT;
+        }
+        if (fds[2].revents & (POLLIN | POLLHUP | POLLERR))
+        {
+            return EVENT_INPUT;
+        }
+    }
+}
+
+// Function to wait4 for a child, keeping deadlines going while it blocks
+// Without deadlines pending this is a plain blocking wait4. With some the
+// shell sleeps in wait_for_event instead, so they fire on time. The jobs
+// are reaped later as usual, children_exited stays set for that.
+pid_t wait_child(pid_t pid, int *status, int options, struct rusage *usage)
+{
+    pid_t result = 0;
+    while (deadline_count > 0 && result == 0)
+    {
+        result = wait4(pid, status, options | WNOHANG, usage);
+        if (result == 0 && wait_for_event(-1) == EVENT_CHILD)
+        {
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+            {
+            }
+        }
+    }
+    if (result == 0)
+    {
+        result = wait4(pid, status, options, usage);
+    }
+    if (result > 0 && WIFSIGNALED(*status) && WTERMSIG(*status) == SIGINT)
+    {
+        // Ctrl-C ended it, and left the cursor after the ^C
+        interrupt_pending = 1;
+    }
+    return result;
+}
+
+// Function to wait until there is input to read, reporting finished jobs
+// as soon as they exit instead of at the next prompt. Used for terminals,
+// the prompt is drawn again under any notices that were printed. Returns 1
+// if Ctrl-C dropped the line being typed, 0 once there is input.
+int wait_for_input(int fd, const char *prompt)
+{
+    while (1)
+    {
+        enum Event event = wait_for_event(fd);
+        if (event == EVENT_INPUT)
+        {
+            return 0;
+        }
+        if (event == EVENT_INTERRUPT)
+        {
+            // The terminal has thrown away what was typed
+            prompt_pending = 0;
+            return 1;
+        }
+        if (update_jobs_status() > 0)
+        {
+            printf("%s", prompt);
+            prompt_pending = 1;
+        }
+    }
+}
+
+#define INPUT_CHUNK_SIZE 65536 // Bytes asked for per read of a script
+
+// Structure for where commands come from: a terminal, a script or a -c string
+// The shell does its own buffering instead of using stdio, so a script is
+// read in a few large reads and parsed straight out of the buffer.
+struct InputSource
+{
+    int fd;          // -1 when all the text is already in data
+    char *data;      // text read so far, always NUL terminated
+    size_t length;   // bytes in data
+    size_t capacity; // bytes allocated for data
+    size_t pos;      // where the next command starts
+    int eof;         // nothing more will come from fd
+    int interrupted; // Ctrl-C dropped the command being typed
+};
+
+// Function to set up an input source that reads from a file descriptor
+void open_input(struct InputSource *source, int fd)
+{
+    source->fd = fd;
+    source->capacity = INPUT_CHUNK_SIZE;
+    struct stat info;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode))
+    {
+        // Read a script file in one go
+        source->capacity = info.st_size + 1 > INPUT_CHUNK_SIZE ? (size_t)info.st_size + 1 : INPUT_CHUNK_SIZE;
+    }
+    source->data = (char *)malloc(source->capacity);
+    if (source->data == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    source->data[0] = '\0';
+    source->length = 0;
+    source->pos = 0;
+    source->eof = 0;
+    source->interrupted = 0;
+}
+
+// Function to set up an input source holding a fixed string (quash -c)
+void open_string_input(struct InputSource *source, const char *text)
+{
+    source->fd = -1;
+    source->data = strdup(text);
+    source->length = strlen(text);
+    source->capacity = source->length + 1;
+    source->pos = 0;
+    source->eof = 1;
+    source->interrupted = 0;
+}
+
+// Function to read more text into an input source
+// Text already used up is dropped first so the buffer does not keep growing.
+void fill_input(struct InputSource *source, const char *prompt)
+{
+    if (source->eof)
+    {
+        return;
+    }
+    if (source->pos > 0)
+    {
+        memmove(source->data, source->data + source->pos, source->length - source->pos + 1);
+        source->length -= source->pos;
+        source->pos = 0;
+    }
+    if (source->capacity - source->length < INPUT_CHUNK_SIZE / 2)
+    {
+        source->capacity *= 2;
+        source->data = (char *)realloc(source->data, source->capacity);
+        if (source->data == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (interactive && wait_for_input(source->fd, prompt))
+    {
+        // Forget every line of the command so far
+        source->data[0] = '\0';
+        source->length = 0;
+        source->interrupted = 1;
+        return;
+    }
+    long long trace_start = tracing ? trace_now() : 0;
+    ssize_t count;
+    do
+    {
+        count = read(source->fd, source->data + source->length, source->capacity - source->length - 1);
+    } while (count == -1 && errno == EINTR);
+    if (tracing)
+    {
+        trace_span("read", trace_start, NULL);
+    }
+
+    if (count <= 0)
+    {
+        if (count == -1)
+        {
+            perror("read");
+        }
+        source->eof = 1;
+        return;
+    }
+    source->length += count;
+    source->data[source->length] = '\0';
+}
+
+#define BUILTIN_FLUSH_SIZE 65536 // Buffered builtin output is written out past this size
+
+// Structure for where a builtin reads and writes
+// Builtins never touch the shell's own stdin and stdout, they write to these
+// fds directly. Output is collected in a buffer and written in large pieces.
+// An out_fd of -1 means the output is being captured by a command
+// substitution, and it all stays in the buffer. An fd a redirection closed
+// is FD_CLOSED, which any read or write fails on like a closed fd.
+struct BuiltinIO
+{
+    int in_fd;
+    int out_fd;
+    int err_fd;
+    struct StringBuffer out; // output not written yet
+    int error;               // errno of a failed write, 0 if none
+};
+
+// Function to write out everything a builtin has buffered
+void io_flush(struct BuiltinIO *io)
+{
+    if (io->out_fd == -1)
+    {
+        return;
+    }
+    size_t done = 0;
+    while (done < io->out.length && io->error == 0)
+    {
+        ssize_t count = write(io->out_fd, io->out.data + done, io->out.length - done);
+        if (count == -1 && errno != EINTR)
+        {
+            io->error = errno;
+        }
+        else if (count > 0)
+        {
+            done += count;
+        }
+    }
+    io->out.length = 0;
+}
+
+// Function to add bytes to a builtin's output
+void io_write(struct BuiltinIO *io, const char *data, size_t length)
+{
+    buffer_append(&io->out, data, length);
+    if (io->out.length >= BUILTIN_FLUSH_SIZE)
+    {
+        io_flush(io);
+    }
+}
+
+// Function to add formatted text to a builtin's output
+void io_printf(struct BuiltinIO *io, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(NULL, 0, format, ap);
+    va_end(ap);
+
+    // Make room, then format straight into the buffer
+    buffer_reserve(&io->out, length);
+    va_start(ap, format);
+    vsnprintf(io->out.data + io->out.length, length + 1, format, ap);
+    va_end(ap);
+    io->out.length += length;
+    if (io->out.length >= BUILTIN_FLUSH_SIZE)
+    {
+        io_flush(io);
+    }
+}
+
+// Function to report an error from a builtin, written at once and unbuffered
+void io_error(struct BuiltinIO *io, const char *format, ...)
+{
+    char message[512];
+    va_list ap;
+    va_start(ap, format);
+    int length = vsnprintf(message, sizeof(message), format, ap);
+    va_end(ap);
+    if (length > (int)sizeof(message) - 1)
+    {
+        length = sizeof(message) - 1;
+    }
+    if (write(io->err_fd, message, length) == -1)
+    {
+        // Nowhere left to report it
+    }
+}
+
+#define VARIABLE_HASH_INITIAL 256 // Starting number of buckets in the variable store
+
+// Structure for a shell variable
+// The name and value are kept together as "NAME=value", so exported
+// variables can go into a child's environment without being copied.
+struct Variable
+{
+    char *entry;        // "NAME=value"
+    size_t name_length; // the value starts at entry + name_length + 1
+    int exported;
+    struct Variable *next;
+};
+
+struct Variable **variables = NULL; // name -> variable hash
+size_t variable_buckets = 0;
+size_t variable_count = 0;
+size_t exported_count = 0;
+unsigned long env_generation = 1;   // Bumped whenever an exported variable changes
+unsigned long path_generation = 1;  // Bumped whenever PATH changes
+char **cached_envp = NULL;          // Environment handed to children
+unsigned long envp_generation = 0;  // env_generation cached_envp was built for
+
+// Function to find the end of a variable name starting at name
+const char *variable_name_end(const char *name)
+{
+    while ((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || (*name >= '0' && *name <= '9') || *name == '_')
+    {
+        name++;
+    }
+    return name;
+}
+
+// Function to tell if the text up to end is a valid variable name
+int valid_name(const char *name, const char *end)
+{
+    return name < end && !(*name >= '0' && *name <= '9') && variable_name_end(name) == end;
+}
+
+// Function to hash length bytes of data (FNV-1a)
+// Every hash table of the shell uses it: variables, remembered commands,
+// builtins and functions.
+unsigned int hash_bytes(const char *data, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Function to find a variable, name_length bytes of name are compared
+struct Variable *find_variable(const char *name, size_t name_length)
+{
+    if (variable_buckets == 0)
+    {
+        return NULL;
+    }
+    struct Variable *variable = variables[hash_bytes(name, name_length) & (variable_buckets - 1)];
+    while (variable != NULL && (variable->name_length != name_length || memcmp(variable->entry, name, name_length) != 0))
+    {
+        variable = variable->next;
+    }
+    return variable;
+}
+
+// Function to get the value of a shell variable, NULL if it is not set
+char *lookup_variable(const char *name)
+{
+    struct Variable *variable = find_variable(name, strlen(name));
+    return variable ? variable->entry + variable->name_length + 1 : NULL;
+}
+
+// Function to put a variable into its bucket
+void link_variable(struct Variable *variable)
+{
+    size_t bucket = hash_bytes(variable->entry, variable->name_length) & (variable_buckets - 1);
+    variable->next = variables[bucket];
+    variables[bucket] = variable;
+}
+
+// Function to double the variable store and rehash every variable
+void grow_variables()
+{
+    struct Variable **old = variables;
+    size_t old_buckets = variable_buckets;
+    variable_buckets = old_buckets ? old_buckets * 2 : VARIABLE_HASH_INITIAL;
+    variables = (struct Variable **)calloc(variable_buckets, sizeof(struct Variable *));
+    if (variables == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < old_buckets; i++)
+    {
+        struct Variable *variable = old[i];
+        while (variable != NULL)
+        {
+            struct Variable *next = variable->next;
+            link_variable(variable);
+            variable = next;
+        }
+    }
+    free(old);
+}
+
+// Function to note that something about an exported variable changed
+void variable_changed(struct Variable *variable)
+{
+    if (variable->exported)
+    {
+        env_generation++;
+    }
+    if (variable->name_length == 4 && memcmp(variable->entry, "PATH", 4) == 0)
+    {
+        path_generation++;
+    }
+}
+
+// Function to set a variable from a "NAME=value" string
+// A variable that already exists keeps its exported flag, a new one is
+// exported only if export is set.
+struct Variable *set_variable_entry(const char *entry, int export)
+{
+    size_t name_length = strchr(entry, '=') - entry;
+    struct Variable *variable = find_variable(entry, name_length);
+    if (variable == NULL)
+    {
+        if (variable_count + 1 > variable_buckets)
+        {
+            grow_variables();
+        }
+        variable = (struct Variable *)malloc(sizeof(struct Variable));
+        if (variable == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        variable->entry = strdup(entry);
+        variable->name_length = name_length;
+        variable->exported = 0;
+        link_variable(variable);
+        variable_count++;
+    }
+    else if (strlen(entry) <= strlen(variable->entry))
+    {
+        // A value no longer than the old one (a counter in a loop) is
+        // written over it instead of going through the allocator
+        strcpy(variable->entry, entry);
+    }
+    else
+    {
+        free(variable->entry);
+        variable->entry = strdup(entry);
+    }
+    if (export && !variable->exported)
+    {
+        variable->exported = 1;
+        exported_count++;
+    }
+    variable_changed(variable);
+    return variable;
+}
+
+// Function to set a variable by name and value
+struct Variable *set_variable(const char *name, const char *value, int export)
+{
+    size_t name_length = strlen(name);
+    size_t value_length = strlen(value);
+    char entry[name_length + value_length + 2];
+    memcpy(entry, name, name_length);
+    entry[name_length] = '=';
+    memcpy(entry + name_length + 1, value, value_length + 1);
+    return set_variable_entry(entry, export);
+}
+
+// Function to mark a variable as exported, creating it empty if needed
+void export_variable(const char *name)
+{
+    struct Variable *variable = find_variable(name, strlen(name));
+    if (variable == NULL)
+    {
+        set_variable(name, "", 1);
+    }
+    else if (!variable->exported)
+    {
+        variable->exported = 1;
+        exported_count++;
+        variable_changed(variable);
+    }
+}
+
+// Function to remove a variable
+void unset_variable(const char *name)
+{
+    size_t name_length = strlen(name);
+    if (variable_buckets == 0)
+    {
+        return;
+    }
+    struct Variable **link = &variables[hash_bytes(name, name_length) & (variable_buckets - 1)];
+    while (*link != NULL)
+    {
+        struct Variable *variable = *link;
+        if (variable->name_length == name_length && memcmp(variable->entry, name, name_length) == 0)
+        {
+            variable_changed(variable);
+            if (variable->exported)
+            {
+                exported_count--;
+            }
+            *link = variable->next;
+            free(variable->entry);
+            free(variable);
+            variable_count--;
+            return;
+        }
+        link = &variable->next;
+    }
+}
+
+// Function to load the environment the shell was started with
+void import_environment()
+{
+    for (char **env = environ; *env != NULL; env++)
+    {
+        if (strchr(*env, '=') != NULL)
+        {
+            set_variable_entry(*env, 1);
+        }
+    }
+}
+
+// Function to get the environment for a child process
+// The array is only rebuilt when an exported variable changed since the
+// last time, otherwise the cached one is handed out again.
+char **get_envp()
+{
+    if (envp_generation == env_generation)
+    {
+        return cached_envp;
+    }
+
+    free(cached_envp);
+    cached_envp = (char **)malloc((exported_count + 1) * sizeof(char *));
+    if (cached_envp == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    size_t count = 0;
+    for (size_t i = 0; i < variable_buckets; i++)
+    {
+        for (struct Variable *variable = variables[i]; variable != NULL; variable = variable->next)
+        {
+            if (variable->exported)
+            {
+                cached_envp[count++] = variable->entry;
+            }
+        }
+    }
+    cached_envp[count] = NULL;
+    envp_generation = env_generation;
+    return cached_envp;
+}
+
+// Function to free the variable store when the shell exits
+void free_variables()
+{
+    for (size_t i = 0; i < variable_buckets; i++)
+    {
+        struct Variable *variable = variables[i];
+        while (variable != NULL)
+        {
+            struct Variable *next = variable->next;
+            free(variable->entry);
+            free(variable);
+            variable = next;
+        }
+    }
+    free(variables);
+    free(cached_envp);
+    variables = NULL;
+    cached_envp = NULL;
+    variable_buckets = variable_count = exported_count = 0;
+}
+
+#define PATH_HASH_BUCKETS 256
+
+// Structure to remember where a command was found in $PATH
+struct HashedCommand
+{
+    char *name;
+    char *path; // NULL for a command that is not in $PATH (negative entry)
+    int hits;
+    struct HashedCommand *next;
+};
+
+struct HashedCommand *path_hash[PATH_HASH_BUCKETS]; // command name -> absolute path
+unsigned long path_hash_generation = 1;             // path_generation the table was filled under
+
+// Function to forget every remembered command location
+void hash_clear()
+{
+    for (int i = 0; i < PATH_HASH_BUCKETS; i++)
+    {
+        struct HashedCommand *entry = path_hash[i];
+        while (entry != NULL)
+        {
+            struct HashedCommand *next = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        path_hash[i] = NULL;
+    }
+}
+
+// Function to forget where a single command was found
+void hash_forget(const char *name)
+{
+    struct HashedCommand **link = &path_hash[hash_bytes(name, strlen(name)) % PATH_HASH_BUCKETS];
+    while (*link != NULL)
+    {
+        struct HashedCommand *entry = *link;
+        if (strcmp(entry->name, name) == 0)
+        {
+            *link = entry->next;
+            free(entry->name);
+            free(entry->path);
+            free(entry);
+            return;
+        }
+        link = &entry->next;
+    }
+}
+
+// Function to search $PATH for an executable, returns a malloc'd path or NULL
+char *search_path(const char *name)
+{
+    const char *path_env = lookup_variable("PATH");
+    if (path_env == NULL)
+    {
+        path_env = "/usr/bin:/bin";
+    }
+
+    size_t name_length = strlen(name);
+    const char *dir = path_env;
+    while (1)
+    {
+        const char *end = strchr(dir, ':');
+        size_t dir_length = end ? (size_t)(end - dir) : strlen(dir);
+
+        // An empty entry means the current directory
+        char candidate[dir_length + name_length + 3];
+        if (dir_length == 0)
+        {
+            strcpy(candidate, ".");
+            dir_length = 1;
+        }
+        else
+        {
+            memcpy(candidate, dir, dir_length);
+        }
+        candidate[dir_length] = '/';
+        memcpy(candidate + dir_length + 1, name, name_length + 1);
+
+        struct stat info;
+        if (stat(candidate, &info) == 0 && S_ISREG(info.st_mode) && access(candidate, X_OK) == 0)
+        {
+            return strdup(candidate);
+        }
+
+        if (end == NULL)
+        {
+            return NULL;
+        }
+        dir = end + 1;
+    }
+}
+
+// Function to find the absolute path of a command, using the hash table
+// Names containing a slash are used as they are. Anything else is looked up
+// in $PATH only the first time it is run, misses included.
+// Returns NULL if the command does not exist.
+const char *hash_lookup(const char *name)
+{
+    if (strchr(name, '/') != NULL)
+    {
+        return name;
+    }
+    if (path_hash_generation != path_generation)
+    {
+        // PATH changed, remembered locations may not be valid any more
+        hash_clear();
+        path_hash_generation = path_generation;
+    }
+
+    unsigned int bucket = hash_bytes(name, strlen(name)) % PATH_HASH_BUCKETS;
+    struct HashedCommand *entry = path_hash[bucket];
+    while (entry != NULL)
+    {
+        if (strcmp(entry->name, name) == 0)
+        {
+            entry->hits++;
+            return entry->path;
+        }
+        entry = entry->next;
+    }
+
+    entry = (struct HashedCommand *)malloc(sizeof(struct HashedCommand));
+    entry->name = strdup(name);
+    entry->path = search_path(name);
+    entry->hits = 1;
+    entry->next = path_hash[bucket];
+    path_hash[bucket] = entry;
+    return entry->path;
+}
+
+// Function to list the remembered command locations for the hash builtin
+void hash_print(struct BuiltinIO *io)
+{
+    int empty = 1;
+    for (int i = 0; i < PATH_HASH_BUCKETS; i++)
+    {
+        for (struct HashedCommand *entry = path_hash[i]; entry != NULL; entry = entry->next)
+        {
+            if (empty)
+            {
+                io_printf(io, "hits\tcommand\n");
+                empty = 0;
+            }
+            if (entry->path != NULL)
+            {
+                io_printf(io, "%4d\t%s\n", entry->hits, entry->path);
+            }
+            else
+            {
+                io_printf(io, "%4d\t%s (not found)\n", entry->hits, entry->name);
+            }
+        }
+    }
+    if (empty)
+    {
+        io_printf(io, "hash: hash table empty\n");
+    }
+}
+
+#define COPY_CHUNK_SIZE (1 << 20) // Bytes asked for per copy_file_range, splice, sendfile or tee call
+#define COPY_BUFFER_SIZE 65536    // Buffer for copies that have to go through user space
+
+// Function to tell if an errno means the kernel cannot copy between these two kinds of fd
+int copy_unsupported(int err)
+{
+    return err == EINVAL || err == EXDEV || err == ENOSYS || err == EOPNOTSUPP || err == EBADF;
+}
+
+// Function to write a whole buffer, returns 0 or the errno of the failed write
+int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = write(fd, data, length);
+        if (count == -1 && errno != EINTR)
+        {
+            return errno;
+        }
+        if (count > 0)
+        {
+            data += count;
+            length -= count;
+        }
+    }
+    return 0;
+}
+
+// Function to copy the rest of in_fd to out_fd through a user space buffer
+int copy_through_buffer(int in_fd, int out_fd)
+{
+    char *buffer = (char *)malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return ENOMEM;
+    }
+    int err = 0;
+    while (err == 0)
+    {
+        ssize_t count = read(in_fd, buffer, COPY_BUFFER_SIZE);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            err = count == -1 ? errno : 0;
+            break;
+        }
+        err = write_all(out_fd, buffer, count);
+    }
+    free(buffer);
+    return err;
+}
+
+// Function to read everything left in an fd onto the end of a growable string
+// The string doubles whenever it fills up, so there is no limit on the size
+// and each byte is moved only a few times however much there is. Returns 0,
+// or the errno of the read that failed.
+int read_all(int fd, struct StringBuffer *buffer)
+{
+    int err = 0;
+    while (1)
+    {
+        buffer_reserve(buffer, COPY_BUFFER_SIZE / 16);
+        ssize_t count = read(fd, buffer->data + buffer->length, buffer->capacity - buffer->length - 1);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            err = count == -1 ? errno : 0;
+            break;
+        }
+        buffer->length += count;
+    }
+    buffer->data[buffer->length] = '\0';
+    return err;
+}
+
+// Function to copy everything left in in_fd to out_fd
+// The data stays in the kernel whenever the two ends allow it:
+// copy_file_range between regular files, splice when either end is a pipe,
+// sendfile from a regular file to anything else. A call the fds turn out not
+// to support moves on to the next way; the file positions already show what
+// was copied. Returns 0, or the errno of the read or write that failed.
+int copy_fd(int in_fd, int out_fd)
+{
+    struct stat in_info;
+    struct stat out_info;
+    if (fstat(in_fd, &in_info) == -1 || fstat(out_fd, &out_info) == -1)
+    {
+        return errno;
+    }
+    int in_file = S_ISREG(in_info.st_mode);
+    int out_file = S_ISREG(out_info.st_mode);
+    int either_pipe = S_ISFIFO(in_info.st_mode) || S_ISFIFO(out_info.st_mode);
+
+    // 0 copy_file_range, 1 splice, 2 sendfile, 3 read and write
+    int method = (in_file && out_file) ? 0 : either_pipe ? 1 : in_file ? 2 : 3;
+    while (method < 3)
+    {
+        ssize_t count;
+        if (method == 0)
+        {
+            count = copy_file_range(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, 0);
+        }
+        else if (method == 1)
+        {
+            count = splice(in_fd, NULL, out_fd, NULL, COPY_CHUNK_SIZE, SPLICE_F_MOVE);
+        }
+        else
+        {
+            count = sendfile(out_fd, in_fd, NULL, COPY_CHUNK_SIZE);
+        }
+
+        if (count == 0)
+        {
+            return 0;
+        }
+        if (count == -1 && errno != EINTR)
+        {
+            if (!copy_unsupported(errno))
+            {
+                return errno;
+            }
+            method = (method < 2 && in_file) ? 2 : 3;
+        }
+    }
+    return copy_through_buffer(in_fd, out_fd);
+}
+
+// Function to move exactly length bytes from a pipe to out_fd with splice
+int splice_all(int in_fd, int out_fd, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = splice(in_fd, NULL, out_fd, NULL, length, SPLICE_F_MOVE);
+        if (count == -1 && errno != EINTR)
+        {
+            return errno;
+        }
+        if (count == 0)
+        {
+            return EIO;
+        }
+        if (count > 0)
+        {
+            length -= count;
+        }
+    }
+    return 0;
+}
+
+// Function to tell if splice can write to fd: a pipe, or a file not opened for appending
+int splice_target(int fd)
+{
+    struct stat info;
+    if (fstat(fd, &info) == -1)
+    {
+        return 0;
+    }
+    return S_ISFIFO(info.st_mode) || (S_ISREG(info.st_mode) && !(fcntl(fd, F_GETFL) & O_APPEND));
+}
+
+// Function to copy everything from in_fd to each of the count fds in out_fds
+// When reading from a pipe, each chunk is duplicated with tee(2) into an
+// empty scratch pipe and spliced from there to every target but the last,
+// which is given the original by splice. The scratch pipe is made as big as
+// the input pipe, so a duplicate always fits whole. When the input is not a
+// pipe, or a target cannot take splice (a terminal, a file opened for
+// appending), the data is read once and written to every target instead.
+// Returns 0 or the errno of the first failure.
+int tee_fds(int in_fd, int *out_fds, int count)
+{
+    struct stat info;
+    int zero_copy = fstat(in_fd, &info) == 0 && S_ISFIFO(info.st_mode);
+    for (int i = 0; i < count && zero_copy; i++)
+    {
+        zero_copy = splice_target(out_fds[i]);
+    }
+    if (count == 1)
+    {
+        return copy_fd(in_fd, out_fds[0]);
+    }
+
+    int scratch[2];
+    if (zero_copy && pipe2(scratch, O_CLOEXEC) == -1)
+    {
+        zero_copy = 0;
+    }
+    if (zero_copy)
+    {
+        int size = fcntl(in_fd, F_GETPIPE_SZ);
+        if (size > 0)
+        {
+            fcntl(scratch[1], F_SETPIPE_SZ, size);
+        }
+
+        int err = 0;
+        while (err == 0)
+        {
+            ssize_t length = tee(in_fd, scratch[1], COPY_CHUNK_SIZE, 0);
+            if (length == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (length <= 0)
+            {
+                err = length == -1 ? errno : 0;
+                break;
+            }
+            for (int i = 0; i < count - 1 && err == 0; i++)
+            {
+                if (i > 0)
+                {
+                    // The chunk is still at the head of the input, duplicate it again
+                    ssize_t again;
+                    do
+                    {
+                        again = tee(in_fd, scratch[1], length, 0);
+                    } while (again == -1 && errno == EINTR);
+                    if (again != length)
+                    {
+                        err = again == -1 ? errno : EIO;
+                        break;
+                    }
+                }
+                err = splice_all(scratch[0], out_fds[i], length);
+            }
+            if (err == 0)
+            {
+                err = splice_all(in_fd, out_fds[count - 1], length);
+            }
+        }
+        close(scratch[0]);
+        close(scratch[1]);
+        return err;
+    }
+
+    char *buffer = (char *)malloc(COPY_BUFFER_SIZE);
+    if (buffer == NULL)
+    {
+        return ENOMEM;
+    }
+    int err = 0;
+    while (err == 0)
+    {
+        ssize_t length = read(in_fd, buffer, COPY_BUFFER_SIZE);
+        if (length == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (length <= 0)
+        {
+            err = length == -1 ? errno : 0;
+            break;
+        }
+        for (int i = 0; i < count && err == 0; i++)
+        {
+            err = write_all(out_fds[i], buffer, length);
+        }
+    }
+    free(buffer);
+    return err;
+}
+
+// cat [FILE...]
+// Copies with copy_fd, so the bytes usually never leave the kernel
+int builtin_cat(char **args, struct BuiltinIO *io)
+{
+    // No files, or -, means standard input
+    char *standard_input[] = {"-", NULL};
+    char **files = args[1] != NULL ? args + 1 : standard_input;
+    int status = 0;
+    io_flush(io);
+    for (int i = 0; files[i] != NULL; i++)
+    {
+        const char *name = files[i];
+        int fd = io->in_fd;
+        if (strcmp(name, "-") != 0 && (fd = open(name, O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            io_error(io, "cat: %s: %s\n", name, strerror(errno));
+            status = 1;
+            continue;
+        }
+        // Captured output is read straight into the builtin's buffer
+        int err = io->out_fd == -1 ? read_all(fd, &io->out) : copy_fd(fd, io->out_fd);
+        if (fd != io->in_fd)
+        {
+            close(fd);
+        }
+        if (err == EPIPE)
+        {
+            io->error = EPIPE;
+            return 1;
+        }
+        if (err != 0)
+        {
+            io_error(io, "cat: %s: %s\n", name, strerror(err));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// tee [-a] FILE...
+int builtin_tee(char **args, struct BuiltinIO *io)
+{
+    int flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_TRUNC;
+    int i = 1;
+    if (args[1] != NULL && strcmp(args[1], "-a") == 0)
+    {
+        flags = O_WRONLY | O_CREAT | O_CLOEXEC | O_APPEND;
+        i++;
+    }
+
+    int status = 0;
+    int count = 1;
+    int files = 0;
+    while (args[i + files] != NULL)
+    {
+        files++;
+    }
+    int *fds = (int *)malloc((files + 1) * sizeof(int));
+    if (fds == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    fds[0] = io->out_fd;
+    for (; args[i] != NULL; i++)
+    {
+        int fd = open(args[i], flags, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+        if (fd == -1)
+        {
+            io_error(io, "tee: %s: %s\n", args[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+        fds[count++] = fd;
+    }
+
+    int err;
+    if (io->out_fd == -1)
+    {
+        // Output being captured: read it all into the buffer, then copy it to the files
+        size_t start = io->out.length;
+        err = read_all(io->in_fd, &io->out);
+        for (int j = 1; j < count && err == 0; j++)
+        {
+            err = write_all(fds[j], io->out.data + start, io->out.length - start);
+        }
+    }
+    else
+    {
+        io_flush(io);
+        err = tee_fds(io->in_fd, fds, count);
+    }
+    for (int j = 1; j < count; j++)
+    {
+        close(fds[j]);
+    }
+    free(fds);
+    if (err == EPIPE)
+    {
+        io->error = EPIPE;
+    }
+    else if (err != 0)
+    {
+        io_error(io, "tee: %s\n", strerror(err));
+        status = 1;
+    }
+    return status;
+}
+
+// echo [-n] args...
+int builtin_echo(char **args, struct BuiltinIO *io)
+{
+    int newline = 1;
+    int i = 1;
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+    {
+        newline = 0;
+        i++;
+    }
+    // Variables were already expanded along with the rest of the line
+    for (int first = i; args[i] != NULL; i++)
+    {
+        if (i > first)
+        {
+            io_write(io, " ", 1);
+        }
+        io_write(io, args[i], strlen(args[i]));
+    }
+    if (newline)
+    {
+        io_write(io, "\n", 1);
+    }
+    return 0;
+}
+
+// export [NAME[=VALUE]...]
+int builtin_export(char **args, struct BuiltinIO *io)
+{
+    if (args[1] == NULL)
+    {
+        for (char **env = get_envp(); *env != NULL; env++)
+        {
+            io_printf(io, "export %s\n", *env);
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        char *equals = strchr(args[i], '=');
+        if (!valid_name(args[i], equals ? equals : args[i] + strlen(args[i])))
+        {
+            io_error(io, "export: `%s': not a valid identifier\n", args[i]);
+            status = 1;
+        }
+        else if (equals != NULL)
+        {
+            set_variable_entry(args[i], 1);
+        }
+        else
+        {
+            export_variable(args[i]);
+        }
+    }
+    return status;
+}
+
+// unset NAME...
+int builtin_unset(char **args, struct BuiltinIO *io)
+{
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        unset_variable(args[i]);
+    }
+    return 0;
+}
+
+// cd DIRECTORY
+int builtin_cd(char **args, struct BuiltinIO *io)
+{
+    if (args[1] == NULL)
+    {
+        io_error(io, "cd: missing directory\n");
+        return 1;
+    }
+    if (chdir(args[1]) != 0)
+    {
+        io_error(io, "cd: %s: %s\n", args[1], strerror(errno));
+        return 1;
+    }
+
+    char *new_pwd = getcwd(NULL, 0);
+    if (new_pwd == NULL)
+    {
+        io_error(io, "getcwd: %s\n", strerror(errno));
+        return 1;
+    }
+    set_variable("PWD", new_pwd, 0);
+    free(new_pwd);
+    return 0;
+}
+
+// pwd
+int builtin_pwd(char **args, struct BuiltinIO *io)
+{
+    char *cwd = getcwd(NULL, 0);
+    if (cwd == NULL)
+    {
+        io_error(io, "getcwd: %s\n", strerror(errno));
+        return 1;
+    }
+    io_printf(io, "%s\n", cwd);
+    free(cwd);
+    return 0;
+}
+
+// hash [-r] [NAME...]
+int builtin_hash(char **args, struct BuiltinIO *io)
+{
+    if (args[1] == NULL)
+    {
+        hash_print(io);
+        return 0;
+    }
+    if (strcmp(args[1], "-r") == 0)
+    {
+        hash_clear();
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        hash_forget(args[i]);
+        if (hash_lookup(args[i]) == NULL)
+        {
+            io_error(io, "hash: %s: not found\n", args[i]);
+            status = 1;
+        }
+    }
+    return status;
+}
+
+// Function to read what a process that is still running has used so far
+// rusage is only available once a process is reaped, so this reads the
+// same counters from /proc. Returns -1 if the process is gone.
+int sample_usage(pid_t pid, struct rusage *usage)
+{
+    char path[64];
+    char data[1024];
+    memset(usage, 0, sizeof(*usage));
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    ssize_t length = fd == -1 ? -1 : read(fd, data, sizeof(data) - 1);
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    if (length <= 0)
+    {
+        return -1;
+    }
+    data[length] = '\0';
+
+    // Fields after the command name, which may itself hold spaces, start
+    // with the state; faults are the 10th and 12th, times the 14th and 15th
+    char *field = strrchr(data, ')');
+    unsigned long long values[16] = {0};
+    for (int i = 3; i <= 15 && field != NULL; i++)
+    {
+        field = strchr(field + 1, ' ');
+        if (field != NULL && i > 3)
+        {
+            values[i] = strtoull(field + 1, NULL, 10);
+        }
+    }
+    long ticks = sysconf(_SC_CLK_TCK);
+    usage->ru_minflt = values[10];
+    usage->ru_majflt = values[12];
+    usage->ru_utime.tv_sec = values[14] / ticks;
+    usage->ru_utime.tv_usec = (values[14] % ticks) * 1000000 / ticks;
+    usage->ru_stime.tv_sec = values[15] / ticks;
+    usage->ru_stime.tv_usec = (values[15] % ticks) * 1000000 / ticks;
+
+    // Peak RSS and context switches are only in the status file
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE *status = fopen(path, "re");
+    if (status != NULL)
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), status) != NULL)
+        {
+            sscanf(line, "VmHWM: %ld", &usage->ru_maxrss);
+            sscanf(line, "voluntary_ctxt_switches: %ld", &usage->ru_nvcsw);
+            sscanf(line, "nonvoluntary_ctxt_switches: %ld", &usage->ru_nivcsw);
+        }
+        fclose(status);
+    }
+    return 0;
+}
+
+// Function to print resource usage in the format time and jobs -l share
+void print_usage(struct BuiltinIO *io, const struct rusage *usage)
+{
+    io_printf(io, "user %ld.%03lds sys %ld.%03lds maxrss %ldKB faults %ld/%ld ctxsw %ld/%ld",
+              (long)usage->ru_utime.tv_sec, (long)usage->ru_utime.tv_usec / 1000,
+              (long)usage->ru_stime.tv_sec, (long)usage->ru_stime.tv_usec / 1000,
+              usage->ru_maxrss, usage->ru_minflt, usage->ru_majflt, usage->ru_nvcsw, usage->ru_nivcsw);
+}
+
+// Function to find the job a builtin argument names
+// %N is a job ID, a number is the pid of any process of a job, and no
+// argument, %% or %+ is the job started last.
+struct Job *job_argument(const char *name, const char *arg, struct BuiltinIO *io)
+{
+    struct Job *job;
+    if (arg == NULL || strcmp(arg, "%%") == 0 || strcmp(arg, "%+") == 0)
+    {
+        job = jobs_tail;
+    }
+    else if (arg[0] == '%')
+    {
+        job = find_job_by_id(atoi(arg + 1));
+    }
+    else
+    {
+        job = find_job((pid_t)strtol(arg, NULL, 10));
+    }
+    if (job == NULL)
+    {
+        io_error(io, "%s: %s: no such job\n", name, arg != NULL ? arg : "current");
+    }
+    return job;
+}
+
+// jobs [-l]
+// With -l every job also shows what it has used so far: its reaped
+// processes plus a sample of the ones still running. A script sees its
+// completed jobs here once, after which they are forgotten.
+int builtin_jobs(char **args, struct BuiltinIO *io)
+{
+    static const char *states[] = {"Running", "Stopped", "Done"};
+    int long_format = args[1] != NULL && strcmp(args[1], "-l") == 0;
+    update_jobs_status();
+    // The list is kept in the order jobs were started
+    struct Job *next;
+    for (struct Job *job = jobs_list; job != NULL; job = next)
+    {
+        next = job->next;
+        if (!long_format)
+        {
+            io_printf(io, "[%d] %d %s\n", job->job_id, job->pgid, job->command);
+        }
+        else
+        {
+            struct rusage usage = job->usage;
+            struct rusage live;
+            for (int i = 0; i < job->process_count; i++)
+            {
+                if (job->processes[i].state != JOB_COMPLETED && sample_usage(job->processes[i].pid, &live) == 0)
+                {
+                    add_usage(&usage, &live);
+                }
+            }
+            io_printf(io, "[%d] %d %s ", job->job_id, job->pgid, states[job->state]);
+            print_usage(io, &usage);
+            io_printf(io, " %s\n", job->command);
+        }
+        if (job->state == JOB_COMPLETED)
+        {
+            remove_job(job);
+        }
+    }
+    return 0;
+}
+
+// kill SIGNUM PID|%JOB
+// A job is signalled as a whole, through its process group.
+int builtin_kill(char **args, struct BuiltinIO *io)
+{
+    if (args[1] == NULL || args[2] == NULL)
+    {
+        io_error(io, "kill: usage: kill SIGNUM PID|%%JOB\n");
+        return 1;
+    }
+
+    long long int pid;
+    int signum = atoi(args[1]);
+    struct Job *job = NULL;
+
+    // A %N argument names a job by its ID instead of its pid
+    if (args[2][0] == '%')
+    {
+        job = job_argument("kill", args[2], io);
+        if (job == NULL)
+        {
+            return 1;
+        }
+        pid = -job->pgid;
+    }
+    else
+    {
+        pid = strtoll(args[2], NULL, 0);
+    }
+
+    update_jobs_status();
+    if (kill(pid, signum) == -1)
+    {
+        io_error(io, "kill: %s\n", strerror(errno));
+        return 1;
+    }
+    if (job != NULL && job->state == JOB_STOPPED && (signum == SIGTERM || signum == SIGHUP))
+    {
+        // A stopped job only sees these once it runs again
+        kill(pid, SIGCONT);
+    }
+    return 0;
+}
+
+// Function to make a stopped job run again
+void continue_job(struct Job *job)
+{
+    kill(-job->pgid, SIGCONT);
+    for (int i = 0; i < job->process_count; i++)
+    {
+        if (job->processes[i].state == JOB_STOPPED)
+        {
+            job->processes[i].state = JOB_RUNNING;
+        }
+    }
+    job->stopped = 0;
+    set_job_state(job, JOB_RUNNING);
+}
+
+// Function to hand the terminal to a process group
+// SIGTTOU is held off, a shell that has given the terminal away would
+// otherwise be stopped taking it back.
+void give_terminal(pid_t pgid)
+{
+    sigset_t block;
+    sigset_t saved;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTTOU);
+    sigprocmask(SIG_BLOCK, &block, &saved);
+    tcsetpgrp(0, pgid);
+    sigprocmask(SIG_SETMASK, &saved, NULL);
+}
+
+// Function to wait for a job to complete or stop, then report its status
+// The job must be current, update_jobs_status having run since the last
+// wait. A foreground wait gives the job the terminal and continues it if
+// it was stopped; any other wait sleeps in wait_for_event, so Ctrl-C can
+// end it with 130. A completed job is forgotten without a notice.
+int wait_for_job(struct Job *job, int foreground)
+{
+    int already_completed = job->state == JOB_COMPLETED;
+    int terminal = foreground && interactive;
+    if (terminal)
+    {
+        give_terminal(job->pgid);
+    }
+    if (foreground && job->state == JOB_STOPPED)
+    {
+        continue_job(job);
+    }
+    while (!foreground && job->state == JOB_RUNNING)
+    {
+        reap_children();
+        if (job->state == JOB_RUNNING && wait_for_event(-1) == EVENT_INTERRUPT)
+        {
+            return 130;
+        }
+    }
+    while (job->state == JOB_RUNNING)
+    {
+        // Only the job's own processes, it is the only thing in its group
+        int status;
+        struct rusage usage;
+        pid_t pid = wait_child(-job->pgid, &status, WUNTRACED, &usage);
+        if (pid == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (pid == -1)
+        {
+            break;
+        }
+        job_exited(pid, status, &usage);
+    }
+    if (terminal)
+    {
+        give_terminal(getpgrp());
+    }
+
+    if (job->state != JOB_COMPLETED)
+    {
+        return 128 + SIGTSTP;
+    }
+    int status = job->status;
+    if (already_completed)
+    {
+        remove_job(job);
+    }
+    else
+    {
+        // It is waiting on the finished list, drop it from there
+        job->notify = 0;
+        update_jobs_status();
+    }
+    return status;
+}
+
+// fg [%JOB]
+int builtin_fg(char **args, struct BuiltinIO *io)
+{
+    update_jobs_status();
+    struct Job *job = job_argument("fg", args[1], io);
+    if (job == NULL)
+    {
+        return 1;
+    }
+    io_printf(io, "%s\n", job->command);
+    io_flush(io);
+    int job_id = job->job_id;
+    pid_t pgid = job->pgid;
+    int status = wait_for_job(job, 1);
+    if (find_job_by_id(job_id) != NULL)
+    {
+        io_printf(io, "Stopped: [%d] %d %s\n", job_id, pgid, job->command);
+    }
+    return status;
+}
+
+// bg [%JOB]
+int builtin_bg(char **args, struct BuiltinIO *io)
+{
+    update_jobs_status();
+    struct Job *job = job_argument("bg", args[1], io);
+    if (job == NULL)
+    {
+        return 1;
+    }
+    if (job->state == JOB_STOPPED)
+    {
+        continue_job(job);
+    }
+    io_printf(io, "[%d] %d %s &\n", job->job_id, job->pgid, job->command);
+    return 0;
+}
+
+// Function to wait for the next job to complete and forget it, returning its status
+// A script's jobs that completed before count as well. Returns 127 if no
+// job is running, or 130 if Ctrl-C ended the wait.
+int wait_for_next_job()
+{
+    update_jobs_status();
+    for (struct Job *job = jobs_list; job != NULL; job = job->next)
+    {
+        if (job->state == JOB_COMPLETED)
+        {
+            int status = job->status;
+            remove_job(job);
+            return status;
+        }
+    }
+    while (1)
+    {
+        reap_children();
+        if (finished_jobs != NULL)
+        {
+            struct Job *job = finished_jobs;
+            int status = job->status;
+            job->notify = 0;
+            update_jobs_status();
+            return status;
+        }
+        if (jobs_running == 0)
+        {
+            return 127;
+        }
+        if (wait_for_event(-1) == EVENT_INTERRUPT)
+        {
+            return 130;
+        }
+    }
+}
+
+// wait [-n] [%JOB|PID ...]
+// With no argument waits for every job that is running and forgets every
+// completed one; with -n for whichever job completes first; otherwise the
+// status is that of the last job named.
+int builtin_wait(char **args, struct BuiltinIO *io)
+{
+    if (args[1] != NULL && strcmp(args[1], "-n") == 0)
+    {
+        return wait_for_next_job();
+    }
+    if (args[1] == NULL)
+    {
+        reap_children();
+        while (jobs_running > 0)
+        {
+            if (wait_for_event(-1) == EVENT_INTERRUPT)
+            {
+                return 130;
+            }
+            reap_children();
+        }
+        update_jobs_status();
+        struct Job *next;
+        for (struct Job *job = jobs_list; job != NULL; job = next)
+        {
+            next = job->next;
+            if (job->state == JOB_COMPLETED)
+            {
+                remove_job(job);
+            }
+        }
+        return 0;
+    }
+
+    int status = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        update_jobs_status();
+        struct Job *job = job_argument("wait", args[i], io);
+        status = job != NULL ? wait_for_job(job, 0) : 127;
+    }
+    return status;
+}
+
+// exit [STATUS], also known as quit
+int builtin_exit(char **args, struct BuiltinIO *io)
+{
+    // an optional number is the status to exit with, anything else is a mistake
+    char *status_end = NULL;
+    long status = args[1] != NULL ? strtol(args[1], &status_end, 10) : last_status;
+    if (args[1] != NULL && (args[2] != NULL || *args[1] == '\0' || *status_end != '\0'))
+    {
+        io_printf(io, "%s does not require additional arguments\n", args[0]);
+        return 1;
+    }
+    exit_requested = 1;
+    return status & 0xff;
+}
+
+#define FD_CLOSED -2    // A plan leaves the fd closed
+#define FD_PARKED -3    // The spare fd a cycle of moves is broken on, see park_fd
+
+// Structure for the fds a command is started with
+// fds[n] is the shell fd the command gets as its fd n, FD_CLOSED, or n
+// itself when the command inherits the shell's own. Pipe ends and opened
+// files the plan uses are owned by it, and the shell closes them once the
+// command has started.
+struct FdPlan
+{
+    int fds[REDIRECT_FDS];
+    int owned[REDIRECT_FDS];
+    int owned_count;
+};
+
+// Structure for one step of putting a plan in place: dup2(from, to), or close(to) if from is FD_CLOSED
+struct FdMove
+{
+    int from;
+    int to;
+};
+
+#define FD_MOVES_MAX (2 * REDIRECT_FDS + 1) // Most moves a plan can need
+
+// Function to start a plan that gives a command in_fd as stdin and out_fd as stdout
+// The plan owns the fds that are not the shell's own stdin and stdout.
+void init_plan(struct FdPlan *plan, int in_fd, int out_fd)
+{
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        plan->fds[fd] = fd;
+    }
+    plan->fds[0] = in_fd;
+    plan->fds[1] = out_fd;
+    plan->owned_count = 0;
+    if (in_fd != 0)
+    {
+        plan->owned[plan->owned_count++] = in_fd;
+    }
+    if (out_fd != 1)
+    {
+        plan->owned[plan->owned_count++] = out_fd;
+    }
+}
+
+// Function to tell if a plan owns an fd
+int plan_owns(const struct FdPlan *plan, int fd)
+{
+    for (int i = 0; i < plan->owned_count; i++)
+    {
+        if (plan->owned[i] == fd)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to give a command's fd a new source, closing an owned fd nothing uses any more
+void plan_set(struct FdPlan *plan, int fd, int source)
+{
+    if (source == fd && plan_owns(plan, source))
+    {
+        // An owned fd on the very number it is for would look inherited,
+        // so it is moved up out of the way
+        int high = fcntl(source, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+        if (high != -1)
+        {
+            for (int i = 0; i < REDIRECT_FDS; i++)
+            {
+                plan->fds[i] = plan->fds[i] == source ? high : plan->fds[i];
+            }
+            for (int i = 0; i < plan->owned_count; i++)
+            {
+                plan->owned[i] = plan->owned[i] == source ? high : plan->owned[i];
+            }
+            close(source);
+            source = high;
+        }
+    }
+    int old = plan->fds[fd];
+    plan->fds[fd] = source;
+    for (int i = 0; i < REDIRECT_FDS; i++)
+    {
+        if (plan->fds[i] == old)
+        {
+            return;
+        }
+    }
+    for (int i = 0; i < plan->owned_count; i++)
+    {
+        if (plan->owned[i] == old)
+        {
+            close(old);
+            plan->owned[i] = plan->owned[--plan->owned_count];
+            return;
+        }
+    }
+}
+
+// Function to add an fd the shell opened for a command to its plan
+void plan_own(struct FdPlan *plan, int fd, int source)
+{
+    plan->owned[plan->owned_count++] = source;
+    plan_set(plan, fd, source);
+}
+
+// Function to close the fds a plan owns, once the command it was for has started
+void close_plan(struct FdPlan *plan)
+{
+    for (int i = 0; i < plan->owned_count; i++)
+    {
+        close(plan->owned[i]);
+    }
+    plan->owned_count = 0;
+}
+
+// Function to tell if a move still to be made reads from fd
+int fd_still_read(const int *sources, int fd)
+{
+    for (int other = 0; other < REDIRECT_FDS; other++)
+    {
+        if (other != fd && sources[other] != other && sources[other] == fd)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to work out the dup2 and close calls that put a plan in place
+// The plan is a parallel assignment, so an fd is only written once no move
+// still to come reads it. When only cycles are left, as in 3>&1 1>&2 2>&3,
+// one fd is parked on a spare fd to break the cycle. The spare is written
+// FD_PARKED, and park_fd picks the real one when the moves are made. Fds
+// the plan leaves alone cost nothing, so a plain command needs no moves at
+// all. Returns the number of moves.
+int plan_moves(const struct FdPlan *plan, struct FdMove *moves)
+{
+    int sources[REDIRECT_FDS];
+    int pending = 0;
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        sources[fd] = plan->fds[fd];
+        pending += sources[fd] != fd;
+    }
+
+    int count = 0;
+    int parked = 0;
+    while (pending > 0)
+    {
+        int progress = 0;
+        for (int fd = 0; fd < REDIRECT_FDS; fd++)
+        {
+            if (sources[fd] != fd && !fd_still_read(sources, fd))
+            {
+                moves[count].from = sources[fd];
+                moves[count].to = fd;
+                count++;
+                sources[fd] = fd;
+                pending--;
+                progress = 1;
+            }
+        }
+        if (!progress)
+        {
+            int fd = 0;
+            while (sources[fd] == fd)
+            {
+                fd++;
+            }
+            moves[count].from = fd;
+            moves[count].to = FD_PARKED;
+            count++;
+            for (int other = 0; other < REDIRECT_FDS; other++)
+            {
+                if (sources[other] == fd && other != fd)
+                {
+                    sources[other] = FD_PARKED;
+                }
+            }
+            parked = 1;
+        }
+    }
+    if (parked)
+    {
+        moves[count].from = FD_CLOSED;
+        moves[count].to = FD_PARKED;
+        count++;
+    }
+    return count;
+}
+
+// Function to pick the spare fd moves park an fd on, if they park one at all
+// The spare is a fresh close-on-exec copy of the first fd parked, so it is
+// free in this process and in a child forked or spawned from it, and no fd
+// the shell keeps for itself is written over. Every FD_PARKED in the moves
+// is replaced by it. Returns the spare, -1 if the moves need none, or -2 if
+// no fd is left for it.
+int park_fd(struct FdMove *moves, int count)
+{
+    int spare = -1;
+    for (int i = 0; i < count; i++)
+    {
+        if (moves[i].to == FD_PARKED && spare == -1)
+        {
+            spare = fcntl(moves[i].from, F_DUPFD_CLOEXEC, REDIRECT_FDS);
+            if (spare == -1)
+            {
+                return -2;
+            }
+        }
+        moves[i].from = moves[i].from == FD_PARKED ? spare : moves[i].from;
+        moves[i].to = moves[i].to == FD_PARKED ? spare : moves[i].to;
+    }
+    return spare;
+}
+
+pid_t spawn_command(const char *path, char **args, char **envp, const struct FdPlan *plan, pid_t pgid);
+
+// parallel [-j N] COMMAND [ARGS...] ::: ITEM...
+// Runs the external COMMAND once per ITEM, with the item in place of every
+// {} in the arguments or added at the end if there is no {}. Up to N children run at
+// once (one per online CPU by default), each in a job slot that is refilled
+// as soon as its child is reaped. Background jobs that exit meanwhile are
+// left to the job table. Returns the number of runs that failed, at most 101.
+int builtin_parallel(char **args, struct BuiltinIO *io)
+{
+    long slots = sysconf(_SC_NPROCESSORS_ONLN);
+    int i = 1;
+    if (args[i] != NULL && strncmp(args[i], "-j", 2) == 0)
+    {
+        // Both -j N and -jN are accepted
+        char *count = args[i][2] != '\0' ? args[i] + 2 : args[++i];
+        char *end = NULL;
+        slots = count != NULL ? strtol(count, &end, 10) : 0;
+        if (count == NULL || *count == '\0' || *end != '\0' || slots < 1)
+        {
+            io_error(io, "parallel: %s: invalid job count\n", count ? count : "-j");
+            return 2;
+        }
+        i++;
+    }
+    if (slots < 1)
+    {
+        slots = 1;
+    }
+
+    int command_start = i;
+    while (args[i] != NULL && strcmp(args[i], ":::") != 0)
+    {
+        i++;
+    }
+    if (args[i] == NULL || i == command_start)
+    {
+        io_error(io, "parallel: usage: parallel [-j N] COMMAND [ARGS...] ::: ITEM...\n");
+        return 2;
+    }
+    int command_length = i - command_start;
+    char **item = args + i + 1;
+    int replace = 0;
+    for (int j = command_start; j < command_start + command_length; j++)
+    {
+        replace |= strstr(args[j], "{}") != NULL;
+    }
+
+    pid_t *running = (pid_t *)calloc(slots, sizeof(pid_t)); // pid in each job slot, 0 if free
+    char **run_args = (char **)malloc((command_length + 2) * sizeof(char *));
+    size_t *offsets = (size_t *)malloc(command_length * sizeof(size_t));
+    struct StringBuffer text = {NULL, 0, 0}; // arguments with the item put in
+    if (running == NULL || run_args == NULL || offsets == NULL)
+    {
+        perror("malloc");
+        exit(EXIT_FAILURE);
+    }
+    char **envp = get_envp();
+    int active = 0;
+    int failed = 0;
+    io_flush(io);
+
+    while (*item != NULL || active > 0)
+    {
+        // Start a run in every free slot
+        for (long slot = 0; slot < slots && *item != NULL; slot++)
+        {
+            if (running[slot] != 0)
+            {
+                continue;
+            }
+            text.length = 0;
+            for (int j = 0; j < command_length; j++)
+            {
+                char *arg = args[command_start + j];
+                char *brace;
+                offsets[j] = text.length;
+                while (replace && (brace = strstr(arg, "{}")) != NULL)
+                {
+                    buffer_append(&text, arg, brace - arg);
+                    buffer_append(&text, *item, strlen(*item));
+                    arg = brace + 2;
+                }
+                buffer_append(&text, arg, strlen(arg) + 1);
+            }
+            for (int j = 0; j < command_length; j++)
+            {
+                run_args[j] = text.data + offsets[j];
+            }
+            run_args[command_length] = replace ? NULL : *item;
+            run_args[command_length + 1] = NULL;
+            item++;
+
+            const char *path = hash_lookup(run_args[0]);
+            pid_t pid = -1;
+            if (path == NULL)
+            {
+                io_error(io, "%s: command not found\n", run_args[0]);
+            }
+            else
+            {
+                struct FdPlan plan;
+                init_plan(&plan, io->in_fd, io->out_fd);
+                plan.owned_count = 0; // the fds belong to whoever ran parallel
+                plan_set(&plan, 2, io->err_fd);
+                pid = spawn_command(path, run_args, envp, &plan, -1);
+            }
+            if (pid == -1)
+            {
+                failed++;
+                slot--; // try the next item in the same slot
+                continue;
+            }
+            running[slot] = pid;
+            active++;
+        }
+        if (active == 0)
+        {
+            continue;
+        }
+
+        // Wait for one of the runs, the slot it held is filled on the next
+        // pass. Only the pids started here are waited for: other children
+        // belong to the job table and are reaped as usual, and deadlines
+        // keep firing while the shell sleeps in wait_for_event.
+        int status;
+        struct rusage usage;
+        pid_t pid = 0;
+        long slot = 0;
+        while (pid == 0)
+        {
+            // Drained before looking, so an exit after the look wakes the poll
+            char buf[64];
+            while (read(sigchld_pipe[0], buf, sizeof(buf)) > 0)
+            {
+            }
+            for (slot = 0; slot < slots; slot++)
+            {
+                if (running[slot] != 0 && (pid = wait4(running[slot], &status, WNOHANG, &usage)) != 0)
+                {
+                    break;
+                }
+            }
+            if (pid == 0 && wait_for_event(-1) == EVENT_INTERRUPT)
+            {
+                // Ctrl-C went to the runs as well, start no more of them
+                while (*item != NULL)
+                {
+                    item++;
+                }
+            }
+        }
+        if (pid == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        running[slot] = 0;
+        active--;
+        if (pid == -1 || !WIFEXITED(status) || WEXITSTATUS(status) != 0)
+        {
+            failed++;
+        }
+    }
+
+    free(running);
+    free(run_args);
+    free(offsets);
+    free(text.data);
+    return failed > 101 ? 101 : failed;
+}
+
+// Function to read a duration like 10, 1.5s, 2m, 1h or 1d into nanoseconds, -1 if it is not one
+long long parse_duration(const char *text)
+{
+    char *end;
+    double value = strtod(text, &end);
+    double unit = 1;
+    switch (*end)
+    {
+    case 'd':
+        unit *= 24;
+        // fall through
+    case 'h':
+        unit *= 60;
+        // fall through
+    case 'm':
+        unit *= 60;
+        // fall through
+    case 's':
+        end++;
+        break;
+    }
+    // !(value >= 0) also turns away NaN
+    if (end == text || *end != '\0' || !(value >= 0))
+    {
+        return -1;
+    }
+    double nanoseconds = value * unit * 1e9;
+    return nanoseconds < (double)(LLONG_MAX / 2) ? (long long)nanoseconds : LLONG_MAX / 2;
+}
+
+// timeout [-k GRACE] DURATION COMMAND [ARGS...] | %JOB
+// Runs an external command in a process group of its own with a deadline,
+// or sets the deadline of a job, replacing any it had; a duration of 0
+// means none. Once the deadline passes the group gets SIGTERM, and SIGKILL
+// GRACE later if it is still there. Status 124 means the command was
+// stopped by SIGTERM, 137 that it took SIGKILL.
+int builtin_timeout(char **args, struct BuiltinIO *io)
+{
+    long long grace = DEADLINE_GRACE_DEFAULT;
+    int i = 1;
+    if (args[i] != NULL && strcmp(args[i], "-k") == 0)
+    {
+        // With no GRACE after it args[i] is the terminating NULL, a usage error below
+        grace = args[i + 1] != NULL ? parse_duration(args[i + 1]) : -1;
+        i += args[i + 1] != NULL ? 2 : 1;
+    }
+    long long duration = args[i] != NULL && grace >= 0 ? parse_duration(args[i]) : -1;
+    if (duration < 0 || args[i + 1] == NULL)
+    {
+        io_error(io, "timeout: usage: timeout [-k GRACE] DURATION COMMAND [ARGS...] | %%JOB\n");
+        return 125;
+    }
+    char **command = args + i + 1;
+
+    if (command[0][0] == '%')
+    {
+        update_jobs_status();
+        struct Job *job = job_argument("timeout", command[0], io);
+        if (job == NULL)
+        {
+            return 1;
+        }
+        if (job->deadline != 0)
+        {
+            cancel_deadline(job->deadline);
+        }
+        job->deadline = duration > 0 && job->state != JOB_COMPLETED ? add_deadline(job->pgid, duration, grace) : 0;
+        return 0;
+    }
+
+    const char *path = hash_lookup(command[0]);
+    if (path == NULL)
+    {
+        io_error(io, "timeout: %s: command not found\n", command[0]);
+        return 127;
+    }
+    struct FdPlan plan;
+    init_plan(&plan, io->in_fd, io->out_fd);
+    plan.owned_count = 0; // the fds belong to whoever ran timeout
+    plan_set(&plan, 2, io->err_fd);
+    pid_t pid = spawn_command(path, command, get_envp(), &plan, 0);
+    if (pid == -1)
+    {
+        return 126;
+    }
+
+    // The command leads its own group, so the signals reach whatever it
+    // starts too; in a terminal it gets the terminal, and Ctrl-C, as well
+    timeout_expired = 0;
+    timeout_serial = duration > 0 ? add_deadline(pid, duration, grace) : 0;
+    if (interactive)
+    {
+        give_terminal(pid);
+    }
+    int status = 0;
+    struct rusage usage;
+    while (wait_child(pid, &status, 0, &usage) == -1 && errno == EINTR)
+    {
+    }
+    if (interactive)
+    {
+        give_terminal(getpgrp());
+    }
+    if (timeout_serial != 0)
+    {
+        cancel_deadline(timeout_serial);
+        timeout_serial = 0;
+    }
+
+    if (timeout_expired)
+    {
+        return WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL ? 128 + SIGKILL : 124;
+    }
+    return exit_status(status);
+}
+
+// true
+int builtin_true(char **args, struct BuiltinIO *io)
+{
+    return 0;
+}
+
+// false
+int builtin_false(char **args, struct BuiltinIO *io)
+{
+    return 1;
+}
+
+// Structure for the arguments test is working through
+struct TestArgs
+{
+    char **args;
+    int pos;   // next argument to use
+    int end;   // one past the last argument
+    int error; // a message was already printed
+    struct BuiltinIO *io;
+};
+
+// Function to report a problem with the arguments of test
+void test_error(struct TestArgs *test, const char *format, const char *arg)
+{
+    if (!test->error)
+    {
+        io_error(test->io, format, arg);
+        test->error = 1;
+    }
+}
+
+// Function to tell if an argument is a unary operator of test
+int test_unary_operator(const char *arg)
+{
+    return arg[0] == '-' && arg[1] != '\0' && arg[2] == '\0' && strchr("bcdefghknprstuwxzGLOS", arg[1]) != NULL;
+}
+
+// Function to tell if an argument is a binary operator of test
+int test_binary_operator(const char *arg)
+{
+    static const char *operators[] = {"=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef"};
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++)
+    {
+        if (strcmp(arg, operators[i]) == 0)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to read an integer operand of test, blanks around it allowed
+long long test_integer(struct TestArgs *test, const char *arg)
+{
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 10);
+    while (*end == ' ' || *end == '\t')
+    {
+        end++;
+    }
+    if (errno != 0 || end == arg || *end != '\0')
+    {
+        test_error(test, "test: %s: integer expression expected\n", arg);
+    }
+    return value;
+}
+
+// Function to evaluate a unary operator of test on its operand
+int test_unary(struct TestArgs *test, const char *op, const char *arg)
+{
+    struct stat info;
+    switch (op[1])
+    {
+    case 'n':
+        return arg[0] != '\0';
+    case 'z':
+        return arg[0] == '\0';
+    case 't':
+        return isatty((int)test_integer(test, arg));
+    case 'h':
+    case 'L':
+        return lstat(arg, &info) == 0 && S_ISLNK(info.st_mode);
+    case 'r':
+        return access(arg, R_OK) == 0;
+    case 'w':
+        return access(arg, W_OK) == 0;
+    case 'x':
+        return access(arg, X_OK) == 0;
+    }
+
+    if (stat(arg, &info) != 0)
+    {
+        return 0;
+    }
+    switch (op[1])
+    {
+    case 'b':
+        return S_ISBLK(info.st_mode);
+    case 'c':
+        return S_ISCHR(info.st_mode);
+    case 'd':
+        return S_ISDIR(info.st_mode);
+    case 'f':
+        return S_ISREG(info.st_mode);
+    case 'g':
+        return (info.st_mode & S_ISGID) != 0;
+    case 'k':
+        return (info.st_mode & S_ISVTX) != 0;
+    case 'p':
+        return S_ISFIFO(info.st_mode);
+    case 's':
+        return info.st_size > 0;
+    case 'u':
+        return (info.st_mode & S_ISUID) != 0;
+    case 'S':
+        return S_ISSOCK(info.st_mode);
+    case 'O':
+        return info.st_uid == geteuid();
+    case 'G':
+        return info.st_gid == getegid();
+    }
+    return 1; // -e
+}
+
+// Function to evaluate a binary operator of test
+int test_binary(struct TestArgs *test, const char *left, const char *op, const char *right)
+{
+    if (op[0] != '-')
+    {
+        int compare = strcmp(left, right);
+        switch (op[0])
+        {
+        case '<':
+            return compare < 0;
+        case '>':
+            return compare > 0;
+        case '!':
+            return compare != 0;
+        }
+        return compare == 0;
+    }
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0)
+    {
+        // File comparisons, a file that does not exist is older than any other
+        struct stat left_info;
+        struct stat right_info;
+        int have_left = stat(left, &left_info) == 0;
+        int have_right = stat(right, &right_info) == 0;
+        if (op[1] == 'e')
+        {
+            return have_left && have_right && left_info.st_dev == right_info.st_dev && left_info.st_ino == right_info.st_ino;
+        }
+        if (!have_left || !have_right)
+        {
+            return op[1] == 'n' ? have_left : have_right;
+        }
+        long long difference = (long long)(left_info.st_mtim.tv_sec - right_info.st_mtim.tv_sec);
+        if (difference == 0)
+        {
+            difference = left_info.st_mtim.tv_nsec - right_info.st_mtim.tv_nsec;
+        }
+        return op[1] == 'n' ? difference > 0 : difference < 0;
+    }
+
+    long long a = test_integer(test, left);
+    long long b = test_integer(test, right);
+    if (strcmp(op, "-eq") == 0)
+    {
+        return a == b;
+    }
+    if (strcmp(op, "-ne") == 0)
+    {
+        return a != b;
+    }
+    if (strcmp(op, "-lt") == 0)
+    {
+        return a < b;
+    }
+    if (strcmp(op, "-le") == 0)
+    {
+        return a <= b;
+    }
+    if (strcmp(op, "-gt") == 0)
+    {
+        return a > b;
+    }
+    return a >= b;
+}
+
+int test_or(struct TestArgs *test);
+
+// Function to evaluate one term: ! term, ( expression ), a unary or binary test, or a string
+int test_term(struct TestArgs *test)
+{
+    char **args = test->args;
+    int left = test->end - test->pos;
+    if (left <= 0)
+    {
+        test_error(test, "test: argument expected%s\n", "");
+        return 0;
+    }
+    char *arg = args[test->pos];
+    if (left >= 3 && test_binary_operator(args[test->pos + 1]))
+    {
+        test->pos += 3;
+        return test_binary(test, arg, args[test->pos - 2], args[test->pos - 1]);
+    }
+    if (strcmp(arg, "!") == 0)
+    {
+        test->pos++;
+        return !test_term(test);
+    }
+    if (strcmp(arg, "(") == 0)
+    {
+        test->pos++;
+        int value = test_or(test);
+        if (test->pos >= test->end || strcmp(args[test->pos], ")") != 0)
+        {
+            test_error(test, "test: missing `)'%s\n", "");
+            return 0;
+        }
+        test->pos++;
+        return value;
+    }
+    if (left >= 2 && test_unary_operator(arg))
+    {
+        test->pos += 2;
+        return test_unary(test, arg, args[test->pos - 1]);
+    }
+    test->pos++;
+    return arg[0] != '\0';
+}
+
+// Function to evaluate terms joined by -a
+int test_and(struct TestArgs *test)
+{
+    int value = test_term(test);
+    while (test->pos < test->end && strcmp(test->args[test->pos], "-a") == 0)
+    {
+        test->pos++;
+        value = test_term(test) && value;
+    }
+    return value;
+}
+
+// Function to evaluate terms joined by -o, which binds looser than -a
+int test_or(struct TestArgs *test)
+{
+    int value = test_and(test);
+    while (test->pos < test->end && strcmp(test->args[test->pos], "-o") == 0)
+    {
+        test->pos++;
+        value = test_and(test) || value;
+    }
+    return value;
+}
+
+// Function to evaluate count arguments the way POSIX says test decides by their number
+// Up to four arguments the meaning is fixed by how many there are, so a
+// string that looks like an operator is still taken as a string. Longer
+// expressions are parsed with -a, -o, ! and parentheses.
+int test_arguments(struct TestArgs *test, int count)
+{
+    char **args = test->args + test->pos;
+    switch (count)
+    {
+    case 0:
+        return 0;
+    case 1:
+        test->pos++;
+        return args[0][0] != '\0';
+    case 2:
+        if (strcmp(args[0], "!") == 0)
+        {
+            test->pos++;
+            return !test_arguments(test, 1);
+        }
+        if (test_unary_operator(args[0]))
+        {
+            test->pos += 2;
+            return test_unary(test, args[0], args[1]);
+        }
+        test_error(test, "test: %s: unary operator expected\n", args[0]);
+        return 0;
+    case 3:
+        if (test_binary_operator(args[1]))
+        {
+            test->pos += 3;
+            return test_binary(test, args[0], args[1], args[2]);
+        }
+        if (strcmp(args[0], "!") == 0)
+        {
+            test->pos++;
+            return !test_arguments(test, 2);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[2], ")") == 0)
+        {
+            test->pos++;
+            int value = test_arguments(test, 1);
+            test->pos++;
+            return value;
+        }
+        break;
+    case 4:
+        if (strcmp(args[0], "!") == 0)
+        {
+            test->pos++;
+            return !test_arguments(test, 3);
+        }
+        if (strcmp(args[0], "(") == 0 && strcmp(args[3], ")") == 0)
+        {
+            test->pos++;
+            int value = test_arguments(test, 2);
+            test->pos++;
+            return value;
+        }
+        break;
+    }
+    return test_or(test);
+}
+
+// test EXPRESSION, also known as [ EXPRESSION ]
+int builtin_test(char **args, struct BuiltinIO *io)
+{
+    int count = 0;
+    while (args[count + 1] != NULL)
+    {
+        count++;
+    }
+    if (strcmp(args[0], "[") == 0)
+    {
+        if (count == 0 || strcmp(args[count], "]") != 0)
+        {
+            io_error(io, "[: missing `]'\n");
+            return 2;
+        }
+        count--;
+    }
+
+    struct TestArgs test = {args, 1, count + 1, 0, io};
+    int value = test_arguments(&test, count);
+    if (!test.error && test.pos != test.end)
+    {
+        test_error(&test, "test: %s: unexpected argument\n", args[test.pos]);
+    }
+    return test.error ? 2 : !value;
+}
+
+#define PRINTF_SPEC_SIZE 64 // Longest conversion specification printf accepts
+
+// Function to write a backslash escape of printf and return how many characters it used
+// In a %b argument \0NNN is octal and \c stops all output; in the format
+// \NNN is octal. *stop is set for \c.
+int printf_escape(struct BuiltinIO *io, const char *text, int in_argument, int *stop)
+{
+    static const char escapes[] = "\\\\a\ab\bf\fn\nr\rt\tv\v\"\"";
+    char c = text[0];
+    for (size_t i = 0; i + 1 < sizeof(escapes); i += 2)
+    {
+        if (escapes[i] == c)
+        {
+            io_write(io, &escapes[i + 1], 1);
+            return 1;
+        }
+    }
+    if (c == 'c' && in_argument)
+    {
+        *stop = 1;
+        return 1;
+    }
+    if (c >= '0' && c <= '7')
+    {
+        // Up to three octal digits, after the 0 of \0NNN in an argument
+        int used = (in_argument && c == '0') ? 1 : 0;
+        int value = 0;
+        int digits = 0;
+        while (digits < 3 && text[used] >= '0' && text[used] <= '7')
+        {
+            value = value * 8 + (text[used++] - '0');
+            digits++;
+        }
+        char byte = (char)value;
+        io_write(io, &byte, 1);
+        return used;
+    }
+    // Not an escape, keep the backslash
+    io_write(io, "\\", 1);
+    return 0;
+}
+
+// Function to read a numeric argument of printf
+// 'c or "c gives the code of the character c. A bad number is reported and
+// counts as 0 (or as far as it could be read), making printf fail.
+long long printf_integer(struct BuiltinIO *io, const char *arg, int *status)
+{
+    if (arg[0] == '\'' || arg[0] == '"')
+    {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (errno == ERANGE && arg[0] != '-')
+    {
+        // Large unsigned values are fine for %u, %o and %x
+        errno = 0;
+        value = (long long)strtoull(arg, &end, 0);
+    }
+    if (*arg != '\0' && (errno != 0 || *end != '\0' || end == arg))
+    {
+        io_error(io, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// Function to read a floating point argument of printf
+double printf_double(struct BuiltinIO *io, const char *arg, int *status)
+{
+    if (arg[0] == '\'' || arg[0] == '"')
+    {
+        return (unsigned char)arg[1];
+    }
+    char *end;
+    errno = 0;
+    double value = strtod(arg, &end);
+    if (*arg != '\0' && (errno != 0 || *end != '\0'))
+    {
+        io_error(io, "printf: %s: invalid number\n", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+// printf FORMAT [ARGUMENT...]
+// The format is used again as long as arguments are left; missing arguments
+// are empty strings or zero.
+int builtin_printf(char **args, struct BuiltinIO *io)
+{
+    if (args[1] == NULL)
+    {
+        io_error(io, "printf: usage: printf FORMAT [ARGUMENT...]\n");
+        return 2;
+    }
+    const char *format = args[1];
+    char **arg = args + 2;
+    int status = 0;
+    int stop = 0;
+
+    do
+    {
+        int used_argument = 0;
+        for (const char *f = format; *f != '\0' && !stop; f++)
+        {
+            if (*f == '\\')
+            {
+                f += printf_escape(io, f + 1, 0, &stop);
+                continue;
+            }
+            if (*f != '%')
+            {
+                io_write(io, f, 1);
+                continue;
+            }
+            if (f[1] == '%')
+            {
+                io_write(io, "%", 1);
+                f++;
+                continue;
+            }
+
+            // Copy the flags, width and precision, filling in * from the arguments
+            char spec[PRINTF_SPEC_SIZE];
+            size_t length = 0;
+            spec[length++] = '%';
+            f++;
+            while (*f != '\0' && strchr("-+ #0", *f) != NULL && length < PRINTF_SPEC_SIZE - 32)
+            {
+                spec[length++] = *f++;
+            }
+            for (int part = 0; part < 2; part++)
+            {
+                if (part == 1)
+                {
+                    if (*f != '.')
+                    {
+                        break;
+                    }
+                    spec[length++] = *f++;
+                }
+                if (*f == '*')
+                {
+                    long long value = *arg ? printf_integer(io, *arg++, &status) : 0;
+                    used_argument = 1;
+                    length += snprintf(spec + length, 16, "%d", (int)value);
+                    f++;
+                }
+                while (*f >= '0' && *f <= '9' && length < PRINTF_SPEC_SIZE - 8)
+                {
+                    spec[length++] = *f++;
+                }
+            }
+
+            char conversion = *f;
+            if (conversion == '\0' || strchr("diouxXeEfFgGaAcsb", conversion) == NULL)
+            {
+                io_error(io, "printf: %%%c: invalid conversion\n", conversion);
+                return 1;
+            }
+            const char *value = *arg ? *arg++ : "";
+            used_argument = 1;
+
+            if (conversion == 'b')
+            {
+                // %b is a string with its escapes expanded, written as it is
+                for (const char *c = value; *c != '\0' && !stop; c++)
+                {
+                    if (*c == '\\')
+                    {
+                        c += printf_escape(io, c + 1, 1, &stop);
+                    }
+                    else
+                    {
+                        io_write(io, c, 1);
+                    }
+                }
+                continue;
+            }
+            if (strchr("diouxX", conversion) != NULL)
+            {
+                // Always format as long long
+                spec[length++] = 'l';
+                spec[length++] = 'l';
+                spec[length++] = conversion;
+                spec[length] = '\0';
+                io_printf(io, spec, printf_integer(io, value, &status));
+            }
+            else if (strchr("eEfFgGaA", conversion) != NULL)
+            {
+                spec[length++] = conversion;
+                spec[length] = '\0';
+                io_printf(io, spec, printf_double(io, value, &status));
+            }
+            else if (conversion == 'c')
+            {
+                spec[length++] = 'c';
+                spec[length] = '\0';
+                io_printf(io, spec, value[0]);
+            }
+            else
+            {
+                spec[length++] = 's';
+                spec[length] = '\0';
+                io_printf(io, spec, value);
+            }
+        }
+        if (!used_argument)
+        {
+            break;
+        }
+    } while (*arg != NULL && !stop);
+    return status;
+}
+
+#define BUILTIN_PURE 1 // Touches no shell state, so it can run on its own thread
+
+// Structure for an entry in the builtin registry
+struct Builtin
+{
+    const char *name;
+    int (*run)(char **args, struct BuiltinIO *io);
+    int flags;
+    const char *options; // Options it takes, for one that stands in for an external command; NULL if it takes anything
+};
+
+struct Builtin builtins[] = {
+    {"echo", builtin_echo, BUILTIN_PURE},
+    {"pwd", builtin_pwd, BUILTIN_PURE},
+    {"true", builtin_true, BUILTIN_PURE},
+    {"false", builtin_false, BUILTIN_PURE},
+    {"cat", builtin_cat, BUILTIN_PURE, ""},
+    {"tee", builtin_tee, BUILTIN_PURE, "a"},
+    {"test", builtin_test, BUILTIN_PURE},
+    {"[", builtin_test, BUILTIN_PURE},
+    {"printf", builtin_printf, BUILTIN_PURE},
+    {"export", builtin_export, 0},
+    {"unset", builtin_unset, 0},
+    {"cd", builtin_cd, 0},
+    {"hash", builtin_hash, 0},
+    {"jobs", builtin_jobs, 0},
+    {"kill", builtin_kill, 0},
+    {"fg", builtin_fg, 0},
+    {"bg", builtin_bg, 0},
+    {"wait", builtin_wait, 0},
+    {"timeout", builtin_timeout, 0},
+    {"parallel", builtin_parallel, 0},
+    {"exit", builtin_exit, 0},
+    {"quit", builtin_exit, 0},
+};
+
+#define BUILTIN_SLOTS 64 // Size of the builtin lookup table, a power of two well above the number of builtins
+
+struct Builtin *builtin_table[BUILTIN_SLOTS]; // name hash -> builtin, open addressing
+
+// Function to fill the builtin lookup table
+void setup_builtins()
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        unsigned int slot = hash_bytes(builtins[i].name, strlen(builtins[i].name)) & (BUILTIN_SLOTS - 1);
+        while (builtin_table[slot] != NULL)
+        {
+            slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+        }
+        builtin_table[slot] = &builtins[i];
+    }
+}
+
+// Function to find the builtin with exactly this name, NULL if there is none
+struct Builtin *find_builtin(const char *name)
+{
+    unsigned int slot = hash_bytes(name, strlen(name)) & (BUILTIN_SLOTS - 1);
+    while (builtin_table[slot] != NULL)
+    {
+        if (strcmp(builtin_table[slot]->name, name) == 0)
+        {
+            return builtin_table[slot];
+        }
+        slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+    }
+    return NULL;
+}
+
+// Function to tell if a builtin that stands in for an external command can run these arguments
+// Only the options it lists are taken, each on its own and before any file.
+// Anything else that looks like an option (cat -n, tee --append, --) is
+// left to the external command of the same name; a lone - is a file.
+int builtin_takes(const struct Builtin *builtin, char **args)
+{
+    if (builtin->options == NULL)
+    {
+        return 1;
+    }
+    int files = 0;
+    for (int i = 1; args[i] != NULL; i++)
+    {
+        const char *arg = args[i];
+        if (arg[0] != '-' || arg[1] == '\0')
+        {
+            files = 1;
+        }
+        else if (files || arg[2] != '\0' || strchr(builtin->options, arg[1]) == NULL)
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Function to find the builtin that runs a command, NULL if it is an external command
+struct Builtin *find_command_builtin(char **args)
+{
+    struct Builtin *builtin = find_builtin(args[0]);
+    return builtin != NULL && builtin_takes(builtin, args) ? builtin : NULL;
+}
+
+// Function to run a builtin against the given fds and return its exit status
+// A builtin whose output could not be written (its reader went away) gets
+// the status a process killed by SIGPIPE would have.
+int run_builtin(struct Builtin *builtin, char **args, int in_fd, int out_fd, int err_fd)
+{
+    struct BuiltinIO io = {in_fd, out_fd, err_fd, {NULL, 0, 0}, 0};
+    int status = builtin->run(args, &io);
+    io_flush(&io);
+    free(io.out.data);
+    if (io.error == EPIPE)
+    {
+        return 128 + SIGPIPE;
+    }
+    if (io.error != 0)
+    {
+        io_error(&io, "%s: write error: %s\n", args[0], strerror(io.error));
+        return 1;
+    }
+    return status;
+}
+
+// Kinds of token the lexer produces
+enum TokenType
+{
+    TOK_WORD,
+    TOK_PIPE,       // |
+    TOK_AMP,        // &
+    TOK_SEMI,       // ;
+    TOK_AND_IF,     // &&
+    TOK_OR_IF,      // ||
+    TOK_LESS,       // <
+    TOK_GREAT,      // >
+    TOK_DGREAT,     // >>
+    TOK_CLOBBER,    // >|
+    TOK_LESSGREAT,  // <>
+    TOK_GREATAND,   // >&
+    TOK_LESSAND,    // <&
+    TOK_AND_GREAT,  // &>
+    TOK_AND_DGREAT, // &>>
+    TOK_DLESS,      // <<
+    TOK_DLESSDASH,  // <<-
+    TOK_TLESS,      // <<<
+    TOK_LPAREN,     // (
+    TOK_RPAREN,     // )
+    TOK_NEWLINE,
+    TOK_EOF,
+    TOK_ERROR       // the lexer already reported the problem
+};
+
+// Kinds of piece a word is made of
+enum WordPartType
+{
+    PART_LITERAL,       // text with its quotes and escapes already removed
+    PART_VARIABLE,      // $NAME, ${NAME} or ${NAME:-word}, looked up when the command runs
+    PART_ARITH,         // $(( expression )), evaluated when the command runs
+    PART_COMMAND,       // $(list) or `list`, run when the command runs
+    PART_PROCESS_READ,  // <(list), a /dev/fd path to read the output of list from
+    PART_PROCESS_WRITE  // >(list), a /dev/fd path to write the input of list to
+};
+
+struct ListItem;
+struct Code;
+
+// Structure for one piece of a word
+struct WordPart
+{
+    enum WordPartType type;
+    int quoted;   // inside double quotes, so the value is not split into fields
+    char *text;   // the literal text, the variable name or the expression
+    struct ListItem *list; // the command of a command or process substitution
+    struct Code *code;     // and its compiled form
+    struct Word *word;     // the expression of $(( )), or the word of ${NAME:-word} and the like
+    char op;               // -, + or = of ${NAME-word}, ${NAME+word} or ${NAME=word}, 0 for none
+    int colon;             // the operator had a :, so an empty value counts as unset
+    struct WordPart *next;
+};
+
+// Structure for a word of a command, kept unexpanded so it can be run again
+struct Word
+{
+    struct WordPart *parts;
+    char *literal; // the finished word when it needs no expansion, else NULL
+    int quoted;     // part of it was quoted, so it stays a word even when empty
+    int assignment; // starts with an unquoted NAME=
+    struct Word *next;
+};
+
+// Kinds of redirection a command can have
+enum RedirectType
+{
+    REDIRECT_IN,         // <
+    REDIRECT_OUT,        // > and >|
+    REDIRECT_APPEND,     // >>
+    REDIRECT_READ_WRITE, // <>
+    REDIRECT_DUP,        // >& and <&, the target is an fd number or - to close it
+    REDIRECT_HEREDOC,    // << or <<-, the target is the body
+    REDIRECT_HERESTRING  // <<<, the target gets a newline added
+};
+
+// Structure for a redirection of a command
+struct Redirect
+{
+    enum RedirectType type;
+    int fd; // the fd of the command it changes
+    struct Word *target;
+    struct Redirect *next;
+};
+
+// Kinds of command
+enum CommandType
+{
+    COMMAND_SIMPLE,   // assignments, words and redirections
+    COMMAND_GROUP,    // { list; }
+    COMMAND_SUBSHELL, // ( list ), always run by a forked copy of the shell
+    COMMAND_IF,       // if list; then list; [elif ...] [else list;] fi
+    COMMAND_WHILE,    // while list; do list; done
+    COMMAND_UNTIL,    // until list; do list; done
+    COMMAND_FOR,      // for name [in words]; do list; done
+    COMMAND_FUNCTION  // name() compound-command
+};
+
+// Structure for a command, simple or compound
+struct Command
+{
+    enum CommandType type;
+    struct Word *assignments; // NAME=value words before the command name
+    struct Word *words;       // the command's words, or the words a for loop goes over
+    struct Redirect *redirects;
+    struct ListItem *condition;   // if, while and until
+    struct ListItem *body;        // the list a compound command runs
+    struct Command *otherwise;    // elif (an if) or else (a group) of an if
+    char *name;                   // for loop variable or function name
+    int for_in;                   // a for loop has an in list, else it goes over "$@"
+    struct Command *definition;   // body of a function
+    struct Code *code;            // compiled form when it runs as a pipeline stage
+};
+
+// Structure for a pipeline, one or more commands joined by |
+struct Pipeline
+{
+    struct Command **commands;
+    int count;
+    int timed;  // preceded by the time keyword
+    char *text; // source text, used when the pipeline becomes a job
+};
+
+// How an entry of a list is joined to the one before it
+enum ListConnector
+{
+    LIST_SEQUENCE, // ; & or the start of the list, always run
+    LIST_AND,      // &&, run if the previous status was zero
+    LIST_OR        // ||, run if the previous status was not zero
+};
+
+// Structure for one entry of a list of pipelines separated by ; & && || or newlines
+struct ListItem
+{
+    struct Pipeline *pipeline;
+    enum ListConnector connector;
+    int background; // the and-or list it is part of ended with &
+    char *text;     // source of the whole and-or list, on its first entry
+    struct ListItem *next;
+};
+
+// Structure for a token, a word or an operator
+struct Token
+{
+    enum TokenType type;
+    struct Word *word; // TOK_WORD only
+    char *start;       // where the token starts in the input
+    int io_number;     // fd written right before a redirection operator, -1 if none
+};
+
+// Structure for a here-document whose body has not been read yet
+struct PendingHeredoc
+{
+    struct Redirect *redirect;
+    char *delimiter;
+    int quoted;     // part of the delimiter was quoted, so the body is taken literally
+    int strip_tabs; // <<-, leading tabs are removed from every line
+    struct PendingHeredoc *next;
+};
+
+// Structure holding the state of the parser and the lexer under it
+struct Parser
+{
+    char *input;            // text being parsed
+    char *pos;              // where the lexer continues
+    char *last_end;         // end of the token consumed last
+    struct Token tok;       // lookahead token
+    int collecting;         // a literal is being collected in literal_buffer
+    struct Arena *arena;    // where everything parsed is allocated
+    int error;              // a syntax error was found
+    const char *incomplete; // why the input ended too early, if it did
+    struct PendingHeredoc *heredocs; // bodies to read after the next newline
+    struct PendingHeredoc **heredoc_tail;
+};
+
+struct StringBuffer literal_buffer = {NULL, 0, 0}; // Literal text of the word being lexed
+
+// Function to tell if a character ends an unquoted word
+int ends_word(char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == '|' || c == '&' || c == ';' || c == '<' || c == '>' || c == '(' || c == ')';
+}
+
+// Function to tell if text starts a process substitution, <(list) or >(list), which is part of a word
+int at_process_substitution(const char *text)
+{
+    return (text[0] == '<' || text[0] == '>') && text[1] == '(';
+}
+
+// Function to add an empty piece to the end of the word being lexed
+struct WordPart *add_part(struct Parser *parser, struct WordPart ***tail, enum WordPartType type, int quoted)
+{
+    struct WordPart *part = (struct WordPart *)arena_alloc(parser->arena, sizeof(struct WordPart));
+    memset(part, 0, sizeof(struct WordPart));
+    part->type = type;
+    part->quoted = quoted;
+    **tail = part;
+    *tail = &part->next;
+    return part;
+}
+
+// Function to close the literal being collected and add it to a word
+void finish_literal(struct Parser *parser, struct WordPart ***tail)
+{
+    if (!parser->collecting)
+    {
+        return;
+    }
+    struct WordPart *part = add_part(parser, tail, PART_LITERAL, 0);
+    part->text = (char *)arena_alloc(parser->arena, literal_buffer.length + 1);
+    memcpy(part->text, literal_buffer.data, literal_buffer.length + 1);
+    parser->collecting = 0;
+}
+
+// Function to start collecting a literal if one is not already being collected
+void start_literal(struct Parser *parser)
+{
+    if (!parser->collecting)
+    {
+        parser->collecting = 1;
+        literal_buffer.length = 0;
+        buffer_append(&literal_buffer, "", 0);
+    }
+}
+
+void advance(struct Parser *parser);
+void syntax_error(struct Parser *parser);
+struct ListItem *parse_list(struct Parser *parser, int nested);
+
+// Function to read a command substitution, $(list) or `list`, or a process substitution
+// parser->pos is just after the $(, <(, >( or the opening backquote. The command is
+// parsed right away, by a parser of its own into the same arena, so it gets
+// compiled and run like any other list. The text between backquotes has its
+// backslash escapes removed first. Returns -1 after an error.
+int lex_substitution(struct Parser *parser, struct WordPart ***tail, enum WordPartType type, int quoted, int backquoted)
+{
+    struct Parser inner;
+    char *resume = NULL; // where the word goes on after a backquoted command
+    inner.input = parser->pos;
+    if (backquoted)
+    {
+        char *close = parser->pos;
+        while (*close != '\0' && *close != '`')
+        {
+            close += (*close == '\\' && close[1] != '\0') ? 2 : 1;
+        }
+        if (*close == '\0')
+        {
+            parser->incomplete = "unterminated command substitution";
+            return -1;
+        }
+        // A backslash only escapes $ ` \ here, and " inside double quotes
+        char *text = (char *)arena_alloc(parser->arena, close - parser->pos + 1);
+        char *out = text;
+        for (char *c = parser->pos; c < close; c++)
+        {
+            if (*c == '\\' && (c[1] == '$' || c[1] == '`' || c[1] == '\\' || (quoted && c[1] == '"')))
+            {
+                c++;
+            }
+            *out++ = *c;
+        }
+        *out = '\0';
+        inner.input = text;
+        resume = close + 1;
+    }
+    inner.pos = inner.input;
+    inner.error = 0;
+    inner.incomplete = NULL;
+    inner.arena = parser->arena;
+    inner.heredocs = NULL;
+    inner.heredoc_tail = &inner.heredocs;
+    finish_literal(parser, tail);
+    advance(&inner);
+
+    struct ListItem *list = parse_list(&inner, 1);
+    if (!inner.error && inner.tok.type == TOK_EOF && !backquoted)
+    {
+        inner.incomplete = "unterminated command substitution";
+    }
+    else if (!inner.error && inner.tok.type != (backquoted ? TOK_EOF : TOK_RPAREN))
+    {
+        syntax_error(&inner);
+    }
+    if (inner.incomplete != NULL && backquoted)
+    {
+        // The backquotes are closed, so more input cannot complete the command
+        fprintf(stderr, "quash: syntax error: %s\n", inner.incomplete);
+        return -1;
+    }
+    if (inner.incomplete != NULL)
+    {
+        parser->incomplete = inner.incomplete;
+        return -1;
+    }
+    if (inner.error)
+    {
+        return -1;
+    }
+
+    struct WordPart *part = add_part(parser, tail, type, quoted);
+    part->list = list;
+    parser->pos = backquoted ? resume : inner.pos;
+    return 1;
+}
+
+struct Word *text_word(struct Parser *parser, char *text, int quoted, int quotes);
+
+// Function to read a $ reference at parser->pos (just after the $)
+// Returns 0 if what follows is not a variable, in which case the $ is
+// literal, and -1 if an arithmetic expansion, or a command substitution,
+// is not closed or not valid.
+int lex_variable(struct Parser *parser, struct WordPart ***tail, int quoted)
+{
+    char *name = parser->pos;
+    char *end;
+    char *next;
+    char *operator_at = NULL; // the operator of ${NAME:-word} and the like
+    int operator_colon = 0;
+    enum WordPartType type = PART_VARIABLE;
+
+    if (name[0] == '(' && name[1] == '(')
+    {
+        // $(( expression )) ends at the )) outside any inner parentheses
+        int depth = 0;
+        name += 2;
+        for (end = name; *end != '\0'; end++)
+        {
+            if (*end == '(')
+            {
+                depth++;
+            }
+            else if (*end == ')' && depth > 0)
+            {
+                depth--;
+            }
+            else if (*end == ')' && end[1] == ')')
+            {
+                break;
+            }
+        }
+        if (*end == '\0')
+        {
+            parser->incomplete = "unterminated arithmetic expansion";
+            return -1;
+        }
+        next = end + 2;
+        type = PART_ARITH;
+    }
+    else if (name[0] == '(')
+    {
+        parser->pos++;
+        return lex_substitution(parser, tail, PART_COMMAND, quoted, 0);
+    }
+    else if (*name == '{')
+    {
+        // The } that closes it is the first one outside the ${ } and $( )
+        // the word of an operator may have
+        int depth = 0;
+        for (end = name + 1; *end != '\0' && (*end != '}' || depth > 0); end++)
+        {
+            depth += *end == '{' || *end == '(';
+            depth -= depth > 0 && (*end == '}' || *end == ')');
+        }
+        if (*end == '\0' || end == name + 1)
+        {
+            return 0;
+        }
+        next = end + 1;
+        name++;
+        char *op = name + (strchr("?$#!@*0123456789", *name) != NULL ? 1 : variable_name_end(name) - name);
+        int colon = *op == ':';
+        if (op > name && op + colon < end && strchr("-+=", op[colon]) != NULL)
+        {
+            operator_at = op;
+            operator_colon = colon;
+        }
+    }
+    else if ((*name >= 'a' && *name <= 'z') || (*name >= 'A' && *name <= 'Z') || *name == '_')
+    {
+        end = (char *)variable_name_end(name);
+        next = end;
+    }
+    else if (*name != '\0' && strchr("?$#!@*0123456789", *name) != NULL)
+    {
+        // Special parameters are a single character
+        end = name + 1;
+        next = end;
+    }
+    else
+    {
+        return 0;
+    }
+
+    finish_literal(parser, tail);
+    struct WordPart *part = add_part(parser, tail, type, quoted);
+    part->text = (char *)arena_alloc(parser->arena, end - name + 1);
+    memcpy(part->text, name, end - name);
+    part->text[end - name] = '\0';
+    char *word = part->text;
+    if (operator_at != NULL)
+    {
+        // The name and the word after the operator are split apart
+        part->op = operator_at[operator_colon];
+        part->colon = operator_colon;
+        part->text[operator_at - name] = '\0';
+        word = part->text + (operator_at - name) + operator_colon + 1;
+    }
+    if (operator_at != NULL || type == PART_ARITH)
+    {
+        // Expanded as if in double quotes when the command runs
+        part->word = text_word(parser, word, 0, operator_at == NULL ? 0 : quoted ? 2 : 1);
+        if (part->word == NULL)
+        {
+            return -1;
+        }
+    }
+    parser->pos = next;
+    return 1;
+}
+
+// Function to add a character to the literal being collected
+void add_literal(struct Parser *parser, char c)
+{
+    start_literal(parser);
+    buffer_append(&literal_buffer, &c, 1);
+}
+
+// Function to read a word, handling quotes, escapes, $ references and command substitutions
+// Returns NULL after reporting an unterminated quote.
+struct Word *lex_word(struct Parser *parser)
+{
+    struct Word *word = (struct Word *)arena_alloc(parser->arena, sizeof(struct Word));
+    struct WordPart **tail = &word->parts;
+    int found; // what lex_variable returned
+    parser->collecting = 0;
+    word->parts = NULL;
+    word->literal = NULL;
+    word->quoted = 0;
+    word->next = NULL;
+    char *name_end = (char *)variable_name_end(parser->pos);
+    word->assignment = *name_end == '=' && valid_name(parser->pos, name_end);
+
+    while (!ends_word(*parser->pos) || at_process_substitution(parser->pos))
+    {
+        char c = *parser->pos++;
+        if (c == '\'')
+        {
+            // Everything up to the next single quote is taken as it is
+            char *close = strchr(parser->pos, '\'');
+            if (close == NULL)
+            {
+                parser->incomplete = "unterminated quote";
+                return NULL;
+            }
+            word->quoted = 1;
+            start_literal(parser);
+            buffer_append(&literal_buffer, parser->pos, close - parser->pos);
+            parser->pos = close + 1;
+        }
+        else if (c == '"')
+        {
+            word->quoted = 1;
+            start_literal(parser);
+            while (*parser->pos != '"')
+            {
+                c = *parser->pos++;
+                if (c == '\0')
+                {
+                    parser->incomplete = "unterminated quote";
+                    return NULL;
+                }
+                if (c == '\\' && *parser->pos != '\0' && strchr("$`\"\\\n", *parser->pos) != NULL)
+                {
+                    // Inside double quotes a backslash only escapes these
+                    c = *parser->pos++;
+                    if (c == '\n')
+                    {
+                        continue;
+                    }
+                }
+                else if (c == '`')
+                {
+                    if (lex_substitution(parser, &tail, PART_COMMAND, 1, 1) < 0)
+                    {
+                        return NULL;
+                    }
+                    continue;
+                }
+                else if (c == '$' && (found = lex_variable(parser, &tail, 1)) != 0)
+                {
+                    if (found < 0)
+                    {
+                        return NULL;
+                    }
+                    continue;
+                }
+                add_literal(parser, c);
+            }
+            parser->pos++;
+        }
+        else if (c == '\\')
+        {
+            if (*parser->pos == '\n')
+            {
+                // Line continuation
+                parser->pos++;
+            }
+            else if (*parser->pos != '\0')
+            {
+                add_literal(parser, *parser->pos++);
+            }
+            else
+            {
+                add_literal(parser, c);
+            }
+        }
+        else if (c == '`')
+        {
+            if (lex_substitution(parser, &tail, PART_COMMAND, 0, 1) < 0)
+            {
+                return NULL;
+            }
+        }
+        else if ((c == '<' || c == '>') && *parser->pos == '(')
+        {
+            parser->pos++;
+            if (lex_substitution(parser, &tail, c == '<' ? PART_PROCESS_READ : PART_PROCESS_WRITE, 0, 0) < 0)
+            {
+                return NULL;
+            }
+        }
+        else if (c == '$' && (found = lex_variable(parser, &tail, 0)) != 0)
+        {
+            if (found < 0)
+            {
+                return NULL;
+            }
+            continue;
+        }
+        else
+        {
+            add_literal(parser, c);
+        }
+    }
+    finish_literal(parser, &tail);
+
+    // Words that need no expansion are kept ready to use
+    if (word->parts == NULL)
+    {
+        word->literal = "";
+    }
+    else if (word->parts->next == NULL && word->parts->type == PART_LITERAL)
+    {
+        word->literal = word->parts->text;
+    }
+    return word;
+}
+
+// Function to turn text that is expanded as if in double quotes into a word
+// That is the body of a here-document, the expression of $(( )) and the
+// word of ${NAME:-word}. Unless quoted is set, $ references, command
+// substitutions and the backslash escapes of double quotes work in it, and
+// it is lexed by a parser of its own. With quotes set, quotes in the text
+// are removed the way they are from a word, which the word of ${NAME:-word}
+// needs; 2 means the text is already inside double quotes, where single
+// quotes are kept as they are. The result counts as quoted, so it is never split and empty text
+// is still an empty word. Returns NULL after an error.
+struct Word *text_word(struct Parser *parser, char *text, int quoted, int quotes)
+{
+    struct Word *word = (struct Word *)arena_alloc(parser->arena, sizeof(struct Word));
+    memset(word, 0, sizeof(struct Word));
+    word->quoted = 1;
+    if (quoted)
+    {
+        word->literal = text;
+        return word;
+    }
+
+    struct Parser body;
+    memset(&body, 0, sizeof(struct Parser));
+    body.input = text;
+    body.pos = text;
+    body.arena = parser->arena;
+    body.heredoc_tail = &body.heredocs;
+    struct WordPart **tail = &word->parts;
+    int in_double = quotes == 2; // inside double quotes, with quotes set
+    while (*body.pos != '\0')
+    {
+        char c = *body.pos++;
+        char *close;
+        if (quotes && c == '"')
+        {
+            in_double = !in_double;
+            continue;
+        }
+        if (quotes && c == '\'' && !in_double && (close = strchr(body.pos, '\'')) != NULL)
+        {
+            start_literal(&body);
+            buffer_append(&literal_buffer, body.pos, close - body.pos);
+            body.pos = close + 1;
+            continue;
+        }
+        if (c == '\\' && *body.pos != '\0' && (strchr("$`\\\n", *body.pos) != NULL || (quotes && strchr("\"'", *body.pos) != NULL)))
+        {
+            c = *body.pos++;
+            if (c != '\n')
+            {
+                add_literal(&body, c);
+            }
+            continue;
+        }
+
+        int found = c == '`' ? lex_substitution(&body, &tail, PART_COMMAND, 1, 1) : c == '$' ? lex_variable(&body, &tail, 1) : 0;
+        if (found < 0)
+        {
+            // The body is all there, so more input cannot complete it
+            if (body.incomplete != NULL)
+            {
+                fprintf(stderr, "quash: syntax error: %s\n", body.incomplete);
+            }
+            return NULL;
+        }
+        if (found == 0)
+        {
+            add_literal(&body, c);
+        }
+    }
+    finish_literal(&body, &tail);
+
+    if (word->parts == NULL)
+    {
+        word->literal = "";
+    }
+    else if (word->parts->next == NULL && word->parts->type == PART_LITERAL)
+    {
+        word->literal = word->parts->text;
+    }
+    return word;
+}
+
+// Function to read the bodies of the here-documents whose operators were on the line just ended
+// parser->pos is at the start of the next line. Every body runs up to a
+// line that holds only its delimiter, and becomes the target of its
+// redirection. Returns -1 if the input ends before a delimiter line, or a
+// body is not valid.
+int read_heredocs(struct Parser *parser)
+{
+    while (parser->heredocs != NULL)
+    {
+        struct PendingHeredoc *heredoc = parser->heredocs;
+        size_t delimiter_length = strlen(heredoc->delimiter);
+        char *start = parser->pos;
+        char *line = start;
+        size_t length = 0; // of the body once tabs are stripped
+        while (1)
+        {
+            char *content = line;
+            while (heredoc->strip_tabs && *content == '\t')
+            {
+                content++;
+            }
+            char *end = strchr(content, '\n');
+            if (end == NULL)
+            {
+                end = content + strlen(content);
+            }
+            if ((size_t)(end - content) == delimiter_length && memcmp(content, heredoc->delimiter, delimiter_length) == 0)
+            {
+                parser->pos = *end != '\0' ? end + 1 : end;
+                break;
+            }
+            if (*end == '\0')
+            {
+                parser->incomplete = "unterminated here-document";
+                return -1;
+            }
+            length += end + 1 - content;
+            line = end + 1;
+        }
+
+        // Copy the body out, without the tabs when they go
+        char *text = (char *)arena_alloc(parser->arena, length + 1);
+        char *out = text;
+        for (char *c = start; c < line; c++)
+        {
+            if (heredoc->strip_tabs && (c == start || c[-1] == '\n'))
+            {
+                while (*c == '\t')
+                {
+                    c++;
+                }
+            }
+            *out++ = *c;
+        }
+        *out = '\0';
+
+        heredoc->redirect->target = text_word(parser, text, heredoc->quoted, 0);
+        if (heredoc->redirect->target == NULL)
+        {
+            return -1;
+        }
+        parser->heredocs = heredoc->next;
+    }
+    parser->heredoc_tail = &parser->heredocs;
+    return 0;
+}
+
+// Function to read the next token from the input
+struct Token next_token(struct Parser *parser)
+{
+    struct Token tok;
+    tok.word = NULL;
+
+    // Skip blanks, line continuations and comments
+    while (1)
+    {
+        char c = *parser->pos;
+        if (c == ' ' || c == '\t')
+        {
+            parser->pos++;
+        }
+        else if (c == '\\' && parser->pos[1] == '\n')
+        {
+            parser->pos += 2;
+        }
+        else if (c == '#')
+        {
+            while (*parser->pos != '\0' && *parser->pos != '\n')
+            {
+                parser->pos++;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    // Digits right before a redirection operator are the fd it applies to
+    tok.start = parser->pos;
+    tok.io_number = -1;
+    char *digits_end = parser->pos;
+    while (*digits_end >= '0' && *digits_end <= '9' && digits_end - parser->pos < 4)
+    {
+        digits_end++;
+    }
+    if (digits_end > parser->pos && (*digits_end == '<' || *digits_end == '>') && !at_process_substitution(digits_end))
+    {
+        tok.io_number = atoi(parser->pos);
+        parser->pos = digits_end;
+    }
+
+    char c = *parser->pos;
+    char next = c ? parser->pos[1] : '\0';
+    char third = next ? parser->pos[2] : '\0';
+    int length = 1;
+    if (at_process_substitution(parser->pos))
+    {
+        c = 'w'; // the start of a word
+    }
+    switch (c)
+    {
+    case '\0':
+        tok.type = TOK_EOF;
+        if (parser->heredocs != NULL)
+        {
+            // The bodies have yet to come
+            parser->incomplete = "unterminated here-document";
+            tok.type = TOK_ERROR;
+        }
+        return tok;
+    case '\n':
+        tok.type = TOK_NEWLINE;
+        break;
+    case ';':
+        tok.type = TOK_SEMI;
+        break;
+    case '|':
+        tok.type = next == '|' ? TOK_OR_IF : TOK_PIPE;
+        length = next == '|' ? 2 : 1;
+        break;
+    case '&':
+        tok.type = next == '&' ? TOK_AND_IF : next != '>' ? TOK_AMP : third == '>' ? TOK_AND_DGREAT : TOK_AND_GREAT;
+        length = tok.type == TOK_AMP ? 1 : tok.type == TOK_AND_DGREAT ? 3 : 2;
+        break;
+    case '<':
+        tok.type = next == '&' ? TOK_LESSAND : next == '>' ? TOK_LESSGREAT : TOK_LESS;
+        length = tok.type == TOK_LESS ? 1 : 2;
+        if (next == '<')
+        {
+            tok.type = third == '<' ? TOK_TLESS : third == '-' ? TOK_DLESSDASH : TOK_DLESS;
+            length = tok.type == TOK_DLESS ? 2 : 3;
+        }
+        break;
+    case '>':
+        tok.type = next == '>' ? TOK_DGREAT : next == '&' ? TOK_GREATAND : next == '|' ? TOK_CLOBBER : TOK_GREAT;
+        length = tok.type == TOK_GREAT ? 1 : 2;
+        break;
+    case '(':
+        tok.type = TOK_LPAREN;
+        break;
+    case ')':
+        tok.type = TOK_RPAREN;
+        break;
+    default:
+        tok.word = lex_word(parser);
+        tok.type = tok.word ? TOK_WORD : TOK_ERROR;
+        return tok;
+    }
+
+    parser->pos += length;
+    if (tok.type == TOK_NEWLINE && parser->heredocs != NULL && read_heredocs(parser) == -1)
+    {
+        tok.type = TOK_ERROR;
+    }
+    return tok;
+}
+
+// Function to move to the next token
+void advance(struct Parser *parser)
+{
+    parser->last_end = parser->pos;
+    parser->tok = next_token(parser);
+    if (parser->tok.type == TOK_ERROR)
+    {
+        parser->error = 1;
+    }
+}
+
+// Function to report a syntax error at the current token
+void syntax_error(struct Parser *parser)
+{
+    if (parser->error)
+    {
+        return; // already reported
+    }
+    parser->error = 1;
+    if (parser->tok.type == TOK_EOF)
+    {
+        // Not an error yet, the rest of the command may still be coming
+        parser->incomplete = "unexpected end of file";
+    }
+    else if (parser->tok.type == TOK_NEWLINE)
+    {
+        fprintf(stderr, "quash: syntax error near unexpected newline\n");
+    }
+    else
+    {
+        int length = (int)(parser->pos - parser->tok.start);
+        fprintf(stderr, "quash: syntax error near unexpected token `%.*s'\n", length, parser->tok.start);
+    }
+}
+
+// Function to tell if the current token is the given reserved word
+// Reserved words are only recognised unquoted and where a command can start.
+int at_keyword(struct Parser *parser, const char *keyword)
+{
+    return parser->tok.type == TOK_WORD && !parser->tok.word->quoted && parser->tok.word->literal != NULL && strcmp(parser->tok.word->literal, keyword) == 0;
+}
+
+// Function to consume a reserved word the grammar requires at this point
+int expect_keyword(struct Parser *parser, const char *keyword)
+{
+    if (!at_keyword(parser, keyword))
+    {
+        syntax_error(parser);
+        return 0;
+    }
+    advance(parser);
+    return 1;
+}
+
+// Function to tell if the current token is a reserved word that ends a list
+int at_closing_keyword(struct Parser *parser)
+{
+    static const char *closing[] = {"then", "elif", "else", "fi", "do", "done", "}"};
+    for (size_t i = 0; i < sizeof(closing) / sizeof(closing[0]); i++)
+    {
+        if (at_keyword(parser, closing[i]))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Function to tell if the current token starts a compound command
+int starts_compound(struct Parser *parser)
+{
+    return parser->tok.type == TOK_LPAREN || at_keyword(parser, "if") || at_keyword(parser, "while") || at_keyword(parser, "until") || at_keyword(parser, "for") || at_keyword(parser, "{");
+}
+
+// Function to allocate an empty command of the given type
+struct Command *new_command(struct Parser *parser, enum CommandType type)
+{
+    struct Command *command = (struct Command *)arena_alloc(parser->arena, sizeof(struct Command));
+    memset(command, 0, sizeof(struct Command));
+    command->type = type;
+    return command;
+}
+
+// Function to tell if the current token is a redirection operator
+int at_redirect(struct Parser *parser)
+{
+    enum TokenType type = parser->tok.type;
+    return type == TOK_LESS || type == TOK_GREAT || type == TOK_DGREAT || type == TOK_CLOBBER || type == TOK_LESSGREAT || type == TOK_GREATAND || type == TOK_LESSAND || type == TOK_AND_GREAT || type == TOK_AND_DGREAT || type == TOK_DLESS || type == TOK_DLESSDASH || type == TOK_TLESS;
+}
+
+// Function to tell if a redirection target names an fd to duplicate or, as -, to close
+int fd_target(const char *text)
+{
+    if (strcmp(text, "-") == 0)
+    {
+        return 1;
+    }
+    const char *c = text;
+    while (*c >= '0' && *c <= '9')
+    {
+        c++;
+    }
+    return c > text && *c == '\0';
+}
+
+// Function to add a redirection to the end of a list
+struct Redirect *add_redirect(struct Parser *parser, struct Redirect ***tail, enum RedirectType type, int fd, struct Word *target)
+{
+    struct Redirect *redirect = (struct Redirect *)arena_alloc(parser->arena, sizeof(struct Redirect));
+    redirect->type = type;
+    redirect->fd = fd;
+    redirect->target = target;
+    redirect->next = NULL;
+    **tail = redirect;
+    *tail = &redirect->next;
+    return redirect;
+}
+
+// Function to queue a here-document, whose delimiter is the current word, for its body to be read
+// Quoting any part of the delimiter, even with a backslash, makes the body
+// literal, so that is looked for in the source text of the word.
+void add_heredoc(struct Parser *parser, struct Redirect *redirect, int strip_tabs)
+{
+    struct PendingHeredoc *heredoc = (struct PendingHeredoc *)arena_alloc(parser->arena, sizeof(struct PendingHeredoc));
+    char *source = parser->tok.start;
+    size_t length = parser->pos - source;
+    heredoc->redirect = redirect;
+    heredoc->quoted = memchr(source, '\'', length) != NULL || memchr(source, '"', length) != NULL || memchr(source, '\\', length) != NULL;
+    heredoc->strip_tabs = strip_tabs;
+    heredoc->delimiter = parser->tok.word->literal;
+    if (heredoc->delimiter == NULL)
+    {
+        heredoc->delimiter = (char *)arena_alloc(parser->arena, length + 1);
+        memcpy(heredoc->delimiter, source, length);
+        heredoc->delimiter[length] = '\0';
+    }
+    heredoc->next = NULL;
+    *parser->heredoc_tail = heredoc;
+    parser->heredoc_tail = &heredoc->next;
+}
+
+// Function to parse a redirection operator and its target onto a list
+// &>word is taken apart into >word 2>&1, and so is >&word when word is not
+// an fd number. A here-document gets its body as the target once the line
+// it is on has been read. Returns -1 after a syntax error.
+int parse_redirect(struct Parser *parser, struct Redirect ***tail)
+{
+    enum TokenType operator = parser->tok.type;
+    int fd = parser->tok.io_number;
+    int fd_given = fd != -1;
+    enum RedirectType type;
+    switch (operator)
+    {
+    case TOK_LESS:
+        type = REDIRECT_IN;
+        break;
+    case TOK_GREAT:
+    case TOK_CLOBBER:
+    case TOK_AND_GREAT:
+        type = REDIRECT_OUT;
+        break;
+    case TOK_DGREAT:
+    case TOK_AND_DGREAT:
+        type = REDIRECT_APPEND;
+        break;
+    case TOK_LESSGREAT:
+        type = REDIRECT_READ_WRITE;
+        break;
+    case TOK_GREATAND:
+    case TOK_LESSAND:
+        type = REDIRECT_DUP;
+        break;
+    case TOK_TLESS:
+        type = REDIRECT_HERESTRING;
+        break;
+    default:
+        type = REDIRECT_HEREDOC;
+        break;
+    }
+    if (fd == -1)
+    {
+        fd = (type == REDIRECT_OUT || type == REDIRECT_APPEND || operator == TOK_GREATAND) ? 1 : 0;
+    }
+    advance(parser);
+    if (parser->tok.type != TOK_WORD)
+    {
+        syntax_error(parser);
+        return -1;
+    }
+
+    struct Word *target = parser->tok.word;
+    int both = operator == TOK_AND_GREAT || operator == TOK_AND_DGREAT;
+    if (operator == TOK_GREATAND && !fd_given && target->literal != NULL && !fd_target(target->literal))
+    {
+        type = REDIRECT_OUT;
+        both = 1;
+    }
+    struct Redirect *redirect = add_redirect(parser, tail, type, fd, target);
+    if (both)
+    {
+        struct Word *stdout_fd = (struct Word *)arena_alloc(parser->arena, sizeof(struct Word));
+        memset(stdout_fd, 0, sizeof(struct Word));
+        stdout_fd->literal = "1";
+        add_redirect(parser, tail, REDIRECT_DUP, 2, stdout_fd);
+    }
+    if (type == REDIRECT_HEREDOC)
+    {
+        add_heredoc(parser, redirect, operator == TOK_DLESSDASH);
+    }
+    advance(parser);
+    return 0;
+}
+
+struct Command *parse_command(struct Parser *parser);
+
+// Function to parse the list inside a compound command, which cannot be empty
+struct ListItem *parse_nested_list(struct Parser *parser)
+{
+    struct ListItem *list = parse_list(parser, 1);
+    if (list == NULL)
+    {
+        syntax_error(parser);
+    }
+    return parser->error ? NULL : list;
+}
+
+// Function to parse an if command, from its if or elif to the closing fi
+// An elif is parsed as a nested if that the outer one falls through to, and
+// it consumes the fi they share.
+struct Command *parse_if(struct Parser *parser)
+{
+    struct Command *command = new_command(parser, COMMAND_IF);
+    advance(parser);
+    command->condition = parse_nested_list(parser);
+    if (command->condition == NULL || !expect_keyword(parser, "then"))
+    {
+        return NULL;
+    }
+    command->body = parse_nested_list(parser);
+    if (command->body == NULL)
+    {
+        return NULL;
+    }
+
+    if (at_keyword(parser, "elif"))
+    {
+        command->otherwise = parse_if(parser);
+        return command->otherwise ? command : NULL;
+    }
+    if (at_keyword(parser, "else"))
+    {
+        advance(parser);
+        command->otherwise = new_command(parser, COMMAND_GROUP);
+        command->otherwise->body = parse_nested_list(parser);
+        if (command->otherwise->body == NULL)
+        {
+            return NULL;
+        }
+    }
+    return expect_keyword(parser, "fi") ? command : NULL;
+}
+
+// Function to parse the do list done body of a loop
+struct ListItem *parse_do_group(struct Parser *parser)
+{
+    if (!expect_keyword(parser, "do"))
+    {
+        return NULL;
+    }
+    struct ListItem *body = parse_nested_list(parser);
+    if (body == NULL || !expect_keyword(parser, "done"))
+    {
+        return NULL;
+    }
+    return body;
+}
+
+// Function to parse a for loop: for name [in words]; do list; done
+struct Command *parse_for(struct Parser *parser)
+{
+    struct Command *command = new_command(parser, COMMAND_FOR);
+    advance(parser);
+    struct Word *name = parser->tok.type == TOK_WORD ? parser->tok.word : NULL;
+    if (name == NULL || name->literal == NULL || name->quoted || !valid_name(name->literal, name->literal + strlen(name->literal)))
+    {
+        syntax_error(parser);
+        return NULL;
+    }
+    command->name = name->literal;
+    advance(parser);
+    while (parser->tok.type == TOK_NEWLINE)
+    {
+        advance(parser);
+    }
+
+    if (at_keyword(parser, "in"))
+    {
+        struct Word **tail = &command->words;
+        command->for_in = 1;
+        advance(parser);
+        while (parser->tok.type == TOK_WORD)
+        {
+            *tail = parser->tok.word;
+            tail = &parser->tok.word->next;
+            advance(parser);
+        }
+        *tail = NULL;
+        if (parser->tok.type != TOK_SEMI && parser->tok.type != TOK_NEWLINE)
+        {
+            syntax_error(parser);
+            return NULL;
+        }
+        advance(parser);
+    }
+    else if (parser->tok.type == TOK_SEMI)
+    {
+        advance(parser);
+    }
+    while (parser->tok.type == TOK_NEWLINE)
+    {
+        advance(parser);
+    }
+
+    command->body = parse_do_group(parser);
+    return command->body ? command : NULL;
+}
+
+// Function to parse a compound command and the redirections after it
+struct Command *parse_compound(struct Parser *parser)
+{
+    struct Command *command;
+    if (at_keyword(parser, "if"))
+    {
+        command = parse_if(parser);
+    }
+    else if (at_keyword(parser, "while") || at_keyword(parser, "until"))
+    {
+        command = new_command(parser, at_keyword(parser, "while") ? COMMAND_WHILE : COMMAND_UNTIL);
+        advance(parser);
+        command->condition = parse_nested_list(parser);
+        command->body = command->condition ? parse_do_group(parser) : NULL;
+    }
+    else if (at_keyword(parser, "for"))
+    {
+        command = parse_for(parser);
+    }
+    else if (parser->tok.type == TOK_LPAREN)
+    {
+        command = new_command(parser, COMMAND_SUBSHELL);
+        advance(parser);
+        command->body = parse_nested_list(parser);
+        if (command->body != NULL && parser->tok.type != TOK_RPAREN)
+        {
+            syntax_error(parser);
+        }
+        else if (command->body != NULL)
+        {
+            advance(parser);
+        }
+    }
+    else
+    {
+        command = new_command(parser, COMMAND_GROUP);
+        advance(parser);
+        command->body = parse_nested_list(parser);
+        if (command->body != NULL)
+        {
+            expect_keyword(parser, "}");
+        }
+    }
+    if (command == NULL || parser->error)
+    {
+        return NULL;
+    }
+
+    struct Redirect **redirect_tail = &command->redirects;
+    while (at_redirect(parser))
+    {
+        if (parse_redirect(parser, &redirect_tail) == -1)
+        {
+            return NULL;
+        }
+    }
+    return command;
+}
+
+// Function to tell if the current word starts a name() function definition
+int at_function_definition(struct Parser *parser)
+{
+    if (parser->tok.type != TOK_WORD || parser->tok.word->literal == NULL || parser->tok.word->quoted || parser->tok.word->assignment)
+    {
+        return 0;
+    }
+    // The lexer stopped right after the word, look past blanks for the (
+    char *next = parser->pos;
+    while (*next == ' ' || *next == '\t')
+    {
+        next++;
+    }
+    return *next == '(';
+}
+
+// Function to parse a function definition, name() or function name [()],
+// followed by the compound command that is its body
+struct Command *parse_function(struct Parser *parser)
+{
+    struct Command *command = new_command(parser, COMMAND_FUNCTION);
+    int keyword = at_keyword(parser, "function");
+    if (keyword)
+    {
+        advance(parser);
+        if (parser->tok.type != TOK_WORD || parser->tok.word->literal == NULL)
+        {
+            syntax_error(parser);
+            return NULL;
+        }
+    }
+    command->name = parser->tok.word->literal;
+    advance(parser);
+    if (parser->tok.type == TOK_LPAREN || !keyword)
+    {
+        if (parser->tok.type != TOK_LPAREN)
+        {
+            syntax_error(parser);
+            return NULL;
+        }
+        advance(parser);
+        if (parser->tok.type != TOK_RPAREN)
+        {
+            syntax_error(parser);
+            return NULL;
+        }
+        advance(parser);
+    }
+    while (parser->tok.type == TOK_NEWLINE)
+    {
+        advance(parser);
+    }
+    if (!starts_compound(parser))
+    {
+        syntax_error(parser);
+        return NULL;
+    }
+    command->definition = parse_compound(parser);
+    return command->definition ? command : NULL;
+}
+
+// Function to parse a command: a compound command, a function definition,
+// or a simple command with its words and redirections
+struct Command *parse_command(struct Parser *parser)
+{
+    if (starts_compound(parser))
+    {
+        return parse_compound(parser);
+    }
+    if (at_keyword(parser, "function") || at_function_definition(parser))
+    {
+        return parse_function(parser);
+    }
+    if (at_closing_keyword(parser))
+    {
+        syntax_error(parser);
+        return NULL;
+    }
+
+    struct Command *command = new_command(parser, COMMAND_SIMPLE);
+    struct Word **assignment_tail = &command->assignments;
+    struct Word **word_tail = &command->words;
+    struct Redirect **redirect_tail = &command->redirects;
+    int empty = 1;
+
+    while (!parser->error)
+    {
+        if (parser->tok.type == TOK_WORD && parser->tok.word->assignment && word_tail == &command->words)
+        {
+            // Assignments only count as such before the command name
+            *assignment_tail = parser->tok.word;
+            assignment_tail = &parser->tok.word->next;
+            advance(parser);
+        }
+        else if (parser->tok.type == TOK_WORD)
+        {
+            *word_tail = parser->tok.word;
+            word_tail = &parser->tok.word->next;
+            advance(parser);
+        }
+        else if (at_redirect(parser))
+        {
+            if (parse_redirect(parser, &redirect_tail) == -1)
+            {
+                return NULL;
+            }
+        }
+        else
+        {
+            break;
+        }
+        empty = 0;
+    }
+    *assignment_tail = NULL;
+    *word_tail = NULL;
+
+    if (empty)
+    {
+        syntax_error(parser);
+        return NULL;
+    }
+    return parser->error ? NULL : command;
+}
+
+// Function to parse a pipeline of commands joined by |
+struct Pipeline *parse_pipeline(struct Parser *parser)
+{
+    char *start = parser->tok.start;
+    int capacity = 4;
+    struct Pipeline *pipeline = (struct Pipeline *)arena_alloc(parser->arena, sizeof(struct Pipeline));
+    pipeline->commands = (struct Command **)arena_alloc(parser->arena, capacity * sizeof(struct Command *));
+    pipeline->count = 0;
+    pipeline->timed = 0;
+
+    // time is only a keyword as the unquoted first word of a pipeline
+    if (at_keyword(parser, "time"))
+    {
+        pipeline->timed = 1;
+        advance(parser);
+    }
+
+    while (1)
+    {
+        struct Command *command = parse_command(parser);
+        if (command == NULL)
+        {
+            return NULL;
+        }
+        if (pipeline->count == capacity)
+        {
+            // Grow the stage array, the old one is simply left in the arena
+            struct Command **commands = (struct Command **)arena_alloc(parser->arena, 2 * capacity * sizeof(struct Command *));
+            memcpy(commands, pipeline->commands, capacity * sizeof(struct Command *));
+            pipeline->commands = commands;
+            capacity *= 2;
+        }
+        pipeline->commands[pipeline->count++] = command;
+
+        if (parser->tok.type != TOK_PIPE)
+        {
+            break;
+        }
+        advance(parser);
+        while (parser->tok.type == TOK_NEWLINE)
+        {
+            advance(parser);
+        }
+    }
+
+    // Keep the source text of the pipeline for the jobs list
+    size_t length = parser->last_end - start;
+    pipeline->text = (char *)arena_alloc(parser->arena, length + 1);
+    memcpy(pipeline->text, start, length);
+    pipeline->text[length] = '\0';
+    return pipeline;
+}
+
+// Function to parse a list of pipelines separated by ; & && or ||
+// At the top level the list is one complete command and ends at a newline.
+// Nested inside a compound command, newlines separate pipelines like ; and
+// the list ends at the reserved word or ) that closes it.
+struct ListItem *parse_list(struct Parser *parser, int nested)
+{
+    struct ListItem *list = NULL;
+    struct ListItem **tail = &list;
+    struct ListItem *and_or = NULL; // first entry of the and-or list being parsed
+    char *and_or_start = NULL;      // where its text starts
+    enum ListConnector connector = LIST_SEQUENCE;
+    while (!parser->error)
+    {
+        while (nested && connector == LIST_SEQUENCE && parser->tok.type == TOK_NEWLINE)
+        {
+            advance(parser);
+        }
+        if (parser->tok.type == TOK_EOF || (!nested && parser->tok.type == TOK_NEWLINE) || (nested && (parser->tok.type == TOK_RPAREN || at_closing_keyword(parser))))
+        {
+            break;
+        }
+
+        if (connector == LIST_SEQUENCE)
+        {
+            and_or_start = parser->tok.start;
+        }
+        struct Pipeline *pipeline = parse_pipeline(parser);
+        if (pipeline == NULL)
+        {
+            break;
+        }
+        struct ListItem *item = (struct ListItem *)arena_alloc(parser->arena, sizeof(struct ListItem));
+        item->pipeline = pipeline;
+        item->connector = connector;
+        item->background = 0;
+        item->text = pipeline->text;
+        item->next = NULL;
+        *tail = item;
+        tail = &item->next;
+        if (connector == LIST_SEQUENCE)
+        {
+            and_or = item;
+        }
+
+        connector = LIST_SEQUENCE;
+        if (parser->tok.type == TOK_AND_IF || parser->tok.type == TOK_OR_IF)
+        {
+            connector = parser->tok.type == TOK_AND_IF ? LIST_AND : LIST_OR;
+            advance(parser);
+            while (parser->tok.type == TOK_NEWLINE)
+            {
+                advance(parser);
+            }
+            if (parser->tok.type == TOK_EOF)
+            {
+                // The rest of the list has to come on the next line
+                syntax_error(parser);
+            }
+        }
+        else if (parser->tok.type == TOK_AMP || parser->tok.type == TOK_SEMI)
+        {
+            if (parser->tok.type == TOK_AMP && and_or != item)
+            {
+                // The whole and-or list becomes one job
+                size_t length = parser->last_end - and_or_start;
+                and_or->text = (char *)arena_alloc(parser->arena, length + 1);
+                memcpy(and_or->text, and_or_start, length);
+                and_or->text[length] = '\0';
+            }
+            if (parser->tok.type == TOK_AMP)
+            {
+                // & puts the whole and-or list in the background
+                for (struct ListItem *entry = and_or; entry != NULL; entry = entry->next)
+                {
+                    entry->background = 1;
+                }
+            }
+            advance(parser);
+        }
+        else if (parser->tok.type != TOK_NEWLINE && parser->tok.type != TOK_EOF && !(nested && (parser->tok.type == TOK_RPAREN || at_closing_keyword(parser))))
+        {
+            syntax_error(parser);
+        }
+    }
+    return list;
+}
+
+// Results of parse_input
+enum ParseResult
+{
+    PARSE_OK,
+    PARSE_ERROR,     // a syntax error was reported
+    PARSE_INCOMPLETE // the text ended inside the command
+};
+
+// Function to parse one complete command from the input
+// A complete command is a list of pipelines separated by ; & && or || and
+// ended by a newline; compound commands inside it can span lines. This is
+// the only pass over the input text: the lexer is pulled one token at a
+// time by the parser, and everything it builds lives in the given arena.
+// The list is stored in *list (NULL for a blank line) and *end is set to
+// where the next command starts.
+// PARSE_INCOMPLETE means the text ran out first; *reason then says why, or
+// is NULL when only the final newline was missing and the list is usable.
+enum ParseResult parse_input(char *input, struct Arena *arena, struct ListItem **list, char **end, const char **reason)
+{
+    struct Parser parser;
+    parser.input = input;
+    parser.pos = input;
+    parser.error = 0;
+    parser.incomplete = NULL;
+    parser.arena = arena;
+    parser.heredocs = NULL;
+    parser.heredoc_tail = &parser.heredocs;
+    advance(&parser);
+
+    *list = parse_list(&parser, 0);
+
+    *reason = parser.incomplete;
+    if (parser.incomplete != NULL)
+    {
+        *end = parser.pos;
+        return PARSE_INCOMPLETE;
+    }
+    if (parser.error)
+    {
+        // Skip the rest of the line so the next command starts cleanly
+        while (parser.tok.type != TOK_NEWLINE && *parser.pos != '\0' && *parser.pos != '\n')
+        {
+            parser.pos++;
+        }
+        *end = (parser.tok.type != TOK_NEWLINE && *parser.pos) ? parser.pos + 1 : parser.pos;
+        return PARSE_ERROR;
+    }
+    *end = parser.pos;
+    return parser.tok.type == TOK_NEWLINE ? PARSE_OK : PARSE_INCOMPLETE;
+}
+
+// Operations of the compiled form of a list
+enum OpCode
+{
+    OP_RUN,            // run pipeline, in the background if value is set
+    OP_BACKGROUND,     // fork a shell that runs code, an and-or list, as one job named text
+    OP_JUMP,           // continue at target
+    OP_JUMP_IF_FAIL,   // continue at target if the status is not zero
+    OP_JUMP_IF_OK,     // continue at target if the status is zero
+    OP_SET_STATUS,     // set the status to value
+    OP_LOOP_START,     // start a while or until loop that ends at target
+    OP_LOOP_TOP,       // start an iteration of the innermost while or until loop
+    OP_FOR_START,      // expand the words of the for loop command, the loop ends at target
+    OP_FOR_NEXT,       // set the loop variable to the next word, or go to target after the last
+    OP_LOOP_STATUS,    // the body of the innermost loop finished with the current status
+    OP_LOOP_END,       // leave the innermost loop, its status becomes the status
+    OP_DEFINE,         // define the function command with the body code
+    OP_BREAK,          // break [n], the arguments are in command
+    OP_CONTINUE,       // continue [n]
+    OP_RETURN          // return [n]
+};
+
+// Structure for one instruction of compiled code
+struct Instruction
+{
+    enum OpCode op;
+    int target;                 // instruction to jump to
+    int value;
+    struct Pipeline *pipeline;  // OP_RUN
+    struct Command *command;    // for loops, definitions, break, continue and return
+    struct Code *code;          // OP_BACKGROUND and OP_DEFINE
+    char *text;                 // OP_BACKGROUND
+};
+
+// Structure for a list compiled into instructions
+// A command is compiled once, after it is parsed, into the same arena as its
+// parse tree; loops and functions then run the instructions again and again
+// without walking the tree or looking at the source text.
+struct Code
+{
+    struct Instruction *instructions;
+    int count;
+    int capacity;
+    int depth;                  // loops open while compiling
+    int loop_depth;             // most loops ever open at once
+    struct SharedArena *arena;  // arena the code and its parse tree live in
+};
+
+// Function to create empty code in a shared arena
+struct Code *new_code(struct SharedArena *arena)
+{
+    struct Code *code = (struct Code *)arena_alloc(&arena->arena, sizeof(struct Code));
+    memset(code, 0, sizeof(struct Code));
+    code->arena = arena;
+    return code;
+}
+
+// Function to add an instruction and return its index
+int emit(struct Code *code, enum OpCode op)
+{
+    if (code->count == code->capacity)
+    {
+        // Grow the array, the old one is simply left in the arena
+        int capacity = code->capacity ? code->capacity * 2 : 16;
+        struct Instruction *instructions = (struct Instruction *)arena_alloc(&code->arena->arena, capacity * sizeof(struct Instruction));
+        if (code->count > 0)
+        {
+            memcpy(instructions, code->instructions, code->count * sizeof(struct Instruction));
+        }
+        code->instructions = instructions;
+        code->capacity = capacity;
+    }
+    struct Instruction *instruction = &code->instructions[code->count];
+    memset(instruction, 0, sizeof(struct Instruction));
+    instruction->op = op;
+    return code->count++;
+}
+
+void compile_list(struct Code *code, struct ListItem *list);
+void compile_command(struct Code *code, struct Command *command);
+
+// Function to compile a command on its own, for when it runs as a pipeline stage
+struct Code *compile_stage(struct SharedArena *arena, struct Command *command)
+{
+    struct Code *code = new_code(arena);
+    compile_command(code, command);
+    return code;
+}
+
+// Function to tell if a simple command is break, continue or return
+// They change where the code goes next, so they are compiled into
+// instructions instead of being run as builtins.
+enum OpCode control_op(struct Command *command)
+{
+    struct Word *word = command->words;
+    if (command->type != COMMAND_SIMPLE || command->assignments != NULL || word == NULL || word->quoted || word->literal == NULL)
+    {
+        return OP_RUN;
+    }
+    if (strcmp(word->literal, "break") == 0)
+    {
+        return OP_BREAK;
+    }
+    if (strcmp(word->literal, "continue") == 0)
+    {
+        return OP_CONTINUE;
+    }
+    if (strcmp(word->literal, "return") == 0)
+    {
+        return OP_RETURN;
+    }
+    return OP_RUN;
+}
+
+// Function to compile the command substitutions in a list of words
+void compile_words(struct SharedArena *arena, struct Word *words)
+{
+    for (struct Word *word = words; word != NULL; word = word->next)
+    {
+        for (struct WordPart *part = word->parts; part != NULL; part = part->next)
+        {
+            if (part->list != NULL)
+            {
+                part->code = new_code(arena);
+                compile_list(part->code, part->list);
+            }
+            if (part->word != NULL)
+            {
+                // as are the ones in $(( )) and ${NAME:-word}
+                compile_words(arena, part->word);
+            }
+        }
+    }
+}
+
+// Function to compile a pipeline
+// A lone compound command in the foreground is compiled in line, so loops
+// and ifs cost no more than the commands inside them. Compound stages of a
+// real pipeline, or ones with redirections, get code of their own that
+// run_pipeline runs in a subshell or with the redirections in place.
+void compile_pipeline(struct Code *code, struct Pipeline *pipeline, int background)
+{
+    // Command substitutions are compiled along with the command they are in
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        struct Command *command = pipeline->commands[i];
+        compile_words(code->arena, command->assignments);
+        compile_words(code->arena, command->words);
+        for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+        {
+            compile_words(code->arena, redirect->target);
+        }
+    }
+
+    struct Command *first = pipeline->commands[0];
+    if (pipeline->count == 1 && !background && !pipeline->timed)
+    {
+        enum OpCode control = control_op(first);
+        if (control != OP_RUN)
+        {
+            int index = emit(code, control);
+            code->instructions[index].command = first;
+            return;
+        }
+        if (first->type == COMMAND_FUNCTION || (first->type != COMMAND_SIMPLE && first->type != COMMAND_SUBSHELL && first->redirects == NULL))
+        {
+            compile_command(code, first);
+            return;
+        }
+    }
+
+    for (int i = 0; i < pipeline->count; i++)
+    {
+        if (pipeline->commands[i]->type != COMMAND_SIMPLE)
+        {
+            pipeline->commands[i]->code = compile_stage(code->arena, pipeline->commands[i]);
+        }
+    }
+    int run = emit(code, OP_RUN);
+    code->instructions[run].pipeline = pipeline;
+    code->instructions[run].value = background;
+}
+
+// Function to compile a loop body followed by the jump back to its top
+void compile_loop_body(struct Code *code, struct ListItem *body, int top)
+{
+    compile_list(code, body);
+    emit(code, OP_LOOP_STATUS);
+    int jump = emit(code, OP_JUMP);
+    code->instructions[jump].target = top;
+}
+
+// Function to compile a compound command or function definition in line
+// if:    condition; JUMP_IF_FAIL else; body; JUMP end; else: otherwise; end:
+// while: LOOP_START end; top: LOOP_TOP; condition; JUMP_IF_FAIL end; body;
+//        LOOP_STATUS; JUMP top; end: LOOP_END
+// for:   FOR_START end; top: FOR_NEXT end; body; LOOP_STATUS; JUMP top;
+//        end: LOOP_END
+void compile_command(struct Code *code, struct Command *command)
+{
+    switch (command->type)
+    {
+    case COMMAND_IF:
+    {
+        compile_list(code, command->condition);
+        int test = emit(code, OP_JUMP_IF_FAIL);
+        compile_list(code, command->body);
+        int skip = emit(code, OP_JUMP);
+        code->instructions[test].target = code->count;
+        if (command->otherwise != NULL)
+        {
+            compile_command(code, command->otherwise);
+        }
+        else
+        {
+            // An if where no branch ran has a status of zero
+            emit(code, OP_SET_STATUS);
+        }
+        code->instructions[skip].target = code->count;
+        break;
+    }
+    case COMMAND_WHILE:
+    case COMMAND_UNTIL:
+    {
+        int start = emit(code, OP_LOOP_START);
+        int top = emit(code, OP_LOOP_TOP);
+        if (++code->depth > code->loop_depth)
+        {
+            code->loop_depth = code->depth;
+        }
+        compile_list(code, command->condition);
+        int test = emit(code, command->type == COMMAND_WHILE ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK);
+        compile_loop_body(code, command->body, top);
+        code->depth--;
+        code->instructions[start].target = code->count;
+        code->instructions[test].target = code->count;
+        emit(code, OP_LOOP_END);
+        break;
+    }
+    case COMMAND_FOR:
+    {
+        int start = emit(code, OP_FOR_START);
+        code->instructions[start].command = command;
+        int top = emit(code, OP_FOR_NEXT);
+        code->instructions[top].command = command;
+        if (++code->depth > code->loop_depth)
+        {
+            code->loop_depth = code->depth;
+        }
+        compile_loop_body(code, command->body, top);
+        code->depth--;
+        code->instructions[start].target = code->count;
+        code->instructions[top].target = code->count;
+        emit(code, OP_LOOP_END);
+        break;
+    }
+    case COMMAND_FUNCTION:
+    {
+        // The body is compiled like a pipeline of just the compound
+        // command, so redirections on it are applied on every call
+        struct Pipeline *pipeline = (struct Pipeline *)arena_alloc(&code->arena->arena, sizeof(struct Pipeline));
+        pipeline->commands = &command->definition;
+        pipeline->count = 1;
+        pipeline->timed = 0;
+        pipeline->text = command->name;
+        struct Code *body = new_code(code->arena);
+        compile_pipeline(body, pipeline, 0);
+        int define = emit(code, OP_DEFINE);
+        code->instructions[define].command = command;
+        code->instructions[define].code = body;
+        break;
+    }
+    case COMMAND_SUBSHELL:
+    {
+        // Only reached for the body of a subshell, which is already forked
+        compile_list(code, command->body);
+        break;
+    }
+    case COMMAND_GROUP:
+        compile_list(code, command->body);
+        break;
+    case COMMAND_SIMPLE:
+        break;
+    }
+}
+
+// Function to compile one and-or list, pipelines joined by && and ||
+// An entry after && or || is jumped over when the status says so, which
+// leaves the status alone for the entries after it. Returns the entry after
+// the and-or list.
+struct ListItem *compile_and_or(struct Code *code, struct ListItem *item, int background)
+{
+    do
+    {
+        int skip = -1;
+        if (item->connector != LIST_SEQUENCE)
+        {
+            skip = emit(code, item->connector == LIST_AND ? OP_JUMP_IF_FAIL : OP_JUMP_IF_OK);
+        }
+        compile_pipeline(code, item->pipeline, background);
+        if (skip >= 0)
+        {
+            code->instructions[skip].target = code->count;
+        }
+        item = item->next;
+    } while (item != NULL && item->connector != LIST_SEQUENCE);
+    return item;
+}
+
+// Function to compile a list
+// A background and-or list of more than one pipeline gets code of its own
+// that a forked copy of the shell runs, so the whole list becomes a single job.
+void compile_list(struct Code *code, struct ListItem *list)
+{
+    struct ListItem *item = list;
+    while (item != NULL)
+    {
+        if (item->background && item->next != NULL && item->next->connector != LIST_SEQUENCE)
+        {
+            struct Code *job = new_code(code->arena);
+            int background = emit(code, OP_BACKGROUND);
+            code->instructions[background].code = job;
+            code->instructions[background].text = item->text;
+            item = compile_and_or(job, item, 0);
+        }
+        else
+        {
+            item = compile_and_or(code, item, item->background);
+        }
+    }
+}
+
+posix_spawnattr_t spawn_attributes; // Attributes every spawned command starts with
+
+// Structure for a process substitution started for the pipeline being run
+struct ProcessSubstitution
+{
+    int fd;    // the shell's end of the pipe, close-on-exec
+    pid_t pid; // the shell running the list
+    struct ProcessSubstitution *next;
+};
+
+struct ProcessSubstitution *process_substitutions = NULL; // Pipes commands get under their own fd numbers
+
+#define ZYGOTE_FDS_MAX 64 // Most fds a command started by the zygote can be given
+
+// Structure for a request to the zygote to start a command
+// The strings follow it on the socket: the path, then the arguments, then
+// the environment, each ending in a NUL. The fds the command gets are sent
+// with it, and fd_targets says which fd each one becomes.
+struct ZygoteRequest
+{
+    size_t length;                  // bytes of strings that follow
+    int argc;
+    int envc;
+    pid_t pgid;                     // process group as for setup_spawn_attributes
+    int fd_count;                   // fds sent with the request
+    int fd_targets[ZYGOTE_FDS_MAX]; // fd the command gets each one as
+    unsigned int closed;            // bit n set: fd n is closed in the command
+};
+
+// Structure for the zygote's answer to a request
+struct ZygoteReply
+{
+    pid_t pid; // the command, -1 if it could not be started
+    int error; // errno of the clone or exec that failed, 0 if it started
+};
+
+struct StringBuffer zygote_buffer = {NULL, 0, 0}; // Request being sent to the zygote
+
+int plan_fd_open(const struct FdPlan *plan, int fd);
+
+// Function to read exactly length bytes, returns 0 at end of file or on an error
+int read_exact(int fd, void *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = read(fd, data, length);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return 0;
+        }
+        data = (char *)data + count;
+        length -= count;
+    }
+    return 1;
+}
+
+// Structure for what the zygote hands the child it starts
+struct ZygoteChild
+{
+    const struct ZygoteRequest *request;
+    const int *fds;   // fds received with the request
+    const char *path;
+    char **args;
+    char **envp;
+    const sigset_t *mask; // signal mask the command starts with
+    int error;            // set by the child if it does not get to exec
+};
+
+// Function to put the fds of a request in place and exec its command, in the child the zygote made
+// Every fd is first copied above all the targets and all the fds received,
+// so putting one in place can never overwrite another still to be moved.
+// The child runs on the zygote's memory until it execs, so only system
+// calls are made, and a failure is left in child->error for the zygote.
+int zygote_exec(void *data)
+{
+    struct ZygoteChild *child = (struct ZygoteChild *)data;
+    const struct ZygoteRequest *request = child->request;
+    int copies[ZYGOTE_FDS_MAX];
+    int base = REDIRECT_FDS;
+    for (int i = 0; i < request->fd_count; i++)
+    {
+        base = request->fd_targets[i] >= base ? request->fd_targets[i] + 1 : base;
+        base = child->fds[i] >= base ? child->fds[i] + 1 : base;
+    }
+    int error = 0;
+    if (request->pgid != -1 && setpgid(0, request->pgid) == -1)
+    {
+        error = errno;
+    }
+    for (int i = 0; i < request->fd_count && error == 0; i++)
+    {
+        copies[i] = fcntl(child->fds[i], F_DUPFD_CLOEXEC, base);
+        error = copies[i] == -1 ? errno : 0;
+    }
+    for (int i = 0; i < request->fd_count && error == 0; i++)
+    {
+        error = dup2(copies[i], request->fd_targets[i]) == -1 ? errno : 0;
+    }
+    for (int fd = 0; fd < REDIRECT_FDS && error == 0; fd++)
+    {
+        if (request->closed & (1u << fd))
+        {
+            close(fd);
+        }
+    }
+    if (error == 0)
+    {
+        sigprocmask(SIG_SETMASK, child->mask, NULL);
+        execve(child->path, child->args, child->envp);
+        error = errno;
+    }
+    child->error = error;
+    _exit(127);
+}
+
+// Function the zygote runs, starting the commands the shell asks for until it closes the socket
+// The commands are cloned with CLONE_PARENT, which makes them children of
+// the shell rather than of the zygote: the shell reaps them, puts them in
+// the foreground and signals them exactly as if it had started them itself.
+// Like posix_spawn the child borrows the zygote's memory until it execs, so
+// no page tables are copied and whether the exec worked is simply there to
+// read once clone returns.
+void zygote_main(int fd, const sigset_t *mask)
+{
+    struct StringBuffer strings = {NULL, 0, 0};
+    size_t stack_size = 65536;
+    char *stack = (char *)mmap(NULL, stack_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+    {
+        _exit(0);
+    }
+    union
+    {
+        char data[CMSG_SPACE(ZYGOTE_FDS_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    while (1)
+    {
+        struct ZygoteRequest request;
+        struct iovec iov = {&request, sizeof(request)};
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control.data;
+        message.msg_controllen = sizeof(control.data);
+        ssize_t count = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+        if (count <= 0)
+        {
+            _exit(0);
+        }
+        int fds[ZYGOTE_FDS_MAX];
+        int received = 0;
+        for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != NULL; header = CMSG_NXTHDR(&message, header))
+        {
+            if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+            {
+                received = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                memcpy(fds, CMSG_DATA(header), received * sizeof(int));
+            }
+        }
+        strings.length = 0;
+        buffer_reserve(&strings, sizeof(request) + 1);
+        if (!read_exact(fd, (char *)&request + count, sizeof(request) - count))
+        {
+            _exit(0);
+        }
+        buffer_reserve(&strings, request.length);
+        char **vector = (char **)malloc((request.argc + request.envc + 2) * sizeof(char *));
+        if (vector == NULL || !read_exact(fd, strings.data, request.length))
+        {
+            _exit(0);
+        }
+
+        // Split the strings into the arrays execve takes
+        char *next = strings.data;
+        char *path = next;
+        next += strlen(next) + 1;
+        char **args = vector;
+        char **envp = vector + request.argc + 1;
+        for (int i = 0; i < request.argc; i++, next += strlen(next) + 1)
+        {
+            args[i] = next;
+        }
+        args[request.argc] = NULL;
+        for (int i = 0; i < request.envc; i++, next += strlen(next) + 1)
+        {
+            envp[i] = next;
+        }
+        envp[request.envc] = NULL;
+
+        struct ZygoteReply reply = {-1, 0};
+        if (received != request.fd_count)
+        {
+            reply.error = EMFILE;
+        }
+        else
+        {
+            struct ZygoteChild child = {&request, fds, path, args, envp, mask, 0};
+            reply.pid = clone(zygote_exec, stack + stack_size, CLONE_VM | CLONE_VFORK | CLONE_PARENT | SIGCHLD, &child);
+            reply.error = reply.pid == -1 ? errno : child.error;
+        }
+        for (int i = 0; i < received; i++)
+        {
+            close(fds[i]);
+        }
+        free(vector);
+        if (write_all(fd, (const char *)&reply, sizeof(reply)) != 0)
+        {
+            _exit(0);
+        }
+    }
+}
+
+// Function to start the zygote, a copy of the shell made at startup that starts commands for it
+// It is forked before the shell has set up anything of its own, so it has
+// only the fds the shell was started with, every signal at its default, and
+// the signal mask commands are to get. Ctrl-C and Ctrl-Z are blocked in the
+// zygote itself: they are meant for the command in the foreground.
+void start_zygote()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+    {
+        perror("socketpair");
+        return;
+    }
+    sigset_t mask;
+    sigprocmask(SIG_BLOCK, NULL, &mask);
+    pid_t pid = fork();
+    if (pid == -1)
+    {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(fds[0]);
+        sigset_t terminal;
+        sigemptyset(&terminal);
+        sigaddset(&terminal, SIGINT);
+        sigaddset(&terminal, SIGQUIT);
+        sigaddset(&terminal, SIGTSTP);
+        sigprocmask(SIG_BLOCK, &terminal, NULL);
+        zygote_main(fds[1], &mask);
+    }
+    close(fds[1]);
+    zygote_fd = move_fd_high(fds[0]);
+}
+
+// Function to give up on the zygote, posix_spawn starts every command from then on
+void stop_zygote()
+{
+    close(zygote_fd);
+    zygote_fd = -1;
+}
+
+// Function to have the zygote start a command, as posix_spawn would
+// Every fd the command gets goes over the socket with SCM_RIGHTS, so the
+// zygote never has to know what the shell's fds are. Returns 0 with *err
+// set as posix_spawn would set it, or -1 if the zygote cannot take this
+// command and it is up to posix_spawn. A zygote that stops answering is
+// not asked again.
+int zygote_spawn(pid_t *pid, const char *path, char **args, char **envp, const struct FdPlan *plan, pid_t pgid, int *err)
+{
+    struct ZygoteRequest request;
+    int fds[ZYGOTE_FDS_MAX];
+    memset(&request, 0, sizeof(request));
+    request.pgid = pgid;
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        if (!plan_fd_open(plan, fd))
+        {
+            request.closed |= 1u << fd;
+            continue;
+        }
+        request.fd_targets[request.fd_count] = fd;
+        fds[request.fd_count++] = plan->fds[fd];
+    }
+    for (struct ProcessSubstitution *substitution = process_substitutions; substitution != NULL; substitution = substitution->next)
+    {
+        if (request.fd_count == ZYGOTE_FDS_MAX)
+        {
+            return -1;
+        }
+        request.fd_targets[request.fd_count] = substitution->fd;
+        fds[request.fd_count++] = substitution->fd;
+    }
+
+    // The header goes first in the same buffer, so the request is one write
+    zygote_buffer.length = 0;
+    buffer_reserve(&zygote_buffer, sizeof(request));
+    zygote_buffer.length = sizeof(request);
+    buffer_append(&zygote_buffer, path, strlen(path) + 1);
+    for (; args[request.argc] != NULL; request.argc++)
+    {
+        buffer_append(&zygote_buffer, args[request.argc], strlen(args[request.argc]) + 1);
+    }
+    for (; envp[request.envc] != NULL; request.envc++)
+    {
+        buffer_append(&zygote_buffer, envp[request.envc], strlen(envp[request.envc]) + 1);
+    }
+    request.length = zygote_buffer.length - sizeof(request);
+    memcpy(zygote_buffer.data, &request, sizeof(request));
+
+    union
+    {
+        char data[CMSG_SPACE(ZYGOTE_FDS_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {zygote_buffer.data, zygote_buffer.length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    if (request.fd_count > 0)
+    {
+        memset(&control, 0, sizeof(control));
+        message.msg_control = control.data;
+        message.msg_controllen = CMSG_SPACE(request.fd_count * sizeof(int));
+        struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+        header->cmsg_level = SOL_SOCKET;
+        header->cmsg_type = SCM_RIGHTS;
+        header->cmsg_len = CMSG_LEN(request.fd_count * sizeof(int));
+        memcpy(CMSG_DATA(header), fds, request.fd_count * sizeof(int));
+    }
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(zygote_fd, &message, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+
+    // A large environment may not fit in one message, the rest follows without the fds
+    struct ZygoteReply reply;
+    if (sent == -1 || write_all(zygote_fd, zygote_buffer.data + sent, zygote_buffer.length - sent) != 0 || !read_exact(zygote_fd, &reply, sizeof(reply)))
+    {
+        stop_zygote();
+        return -1;
+    }
+    if (reply.error != 0 && reply.pid > 0)
+    {
+        // The child that failed to exec is the shell's to reap
+        waitpid(reply.pid, NULL, 0);
+    }
+    *pid = reply.pid;
+    *err = reply.error;
+    return 0;
+}
+
+// Function to set up spawn attributes
+// The shell ignores SIGPIPE so a builtin writing into a closed pipe gets an
+// error instead of killing the shell, but ignored signals survive exec, so
+// commands have to be given the default action back, and the signal mask
+// the shell started with, as it blocks some for itself. A pgid other than -1
+// puts the command in that process group, or a new one of its own if 0.
+void setup_spawn_attributes(posix_spawnattr_t *attributes, pid_t pgid)
+{
+    sigset_t defaults;
+    sigemptyset(&defaults);
+    sigaddset(&defaults, SIGPIPE);
+    posix_spawnattr_init(attributes);
+    posix_spawnattr_setsigdefault(attributes, &defaults);
+    posix_spawnattr_setsigmask(attributes, &child_signal_mask);
+    if (pgid != -1)
+    {
+        posix_spawnattr_setpgroup(attributes, pgid);
+    }
+    posix_spawnattr_setflags(attributes, POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK | (pgid != -1 ? POSIX_SPAWN_SETPGROUP : 0));
+}
+
+// Function to start an external command with posix_spawn, returns 0 or the errno it failed with
+// The moves of the fd plan are applied as spawn file actions, so the shell
+// never has to copy its own page tables the way fork does. Every fd of the
+// shell is close-on-exec, so nothing but the moves is needed to keep the
+// command from inheriting fds it was not given.
+int posix_spawn_command(pid_t *pid, const char *path, char **args, char **envp, const struct FdPlan *plan, pid_t pgid)
+{
+    posix_spawn_file_actions_t actions;
+
+    posix_spawn_file_actions_init(&actions);
+    struct FdMove moves[FD_MOVES_MAX];
+    int move_count = plan_moves(plan, moves);
+    int spare = park_fd(moves, move_count);
+    if (spare == -2)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        return errno;
+    }
+    for (int i = 0; i < move_count; i++)
+    {
+        if (moves[i].from == FD_CLOSED)
+        {
+            posix_spawn_file_actions_addclose(&actions, moves[i].to);
+        }
+        else
+        {
+            posix_spawn_file_actions_adddup2(&actions, moves[i].from, moves[i].to);
+        }
+    }
+    for (struct ProcessSubstitution *substitution = process_substitutions; substitution != NULL; substitution = substitution->next)
+    {
+        // Duplicating an fd onto itself clears close-on-exec in the child only
+        posix_spawn_file_actions_adddup2(&actions, substitution->fd, substitution->fd);
+    }
+
+    posix_spawnattr_t group_attributes;
+    posix_spawnattr_t *attributes = &spawn_attributes;
+    if (pgid != -1)
+    {
+        setup_spawn_attributes(&group_attributes, pgid);
+        attributes = &group_attributes;
+    }
+    int err = posix_spawn(pid, path, &actions, attributes, args, envp);
+    posix_spawn_file_actions_destroy(&actions);
+    if (spare >= 0)
+    {
+        close(spare);
+    }
+    if (attributes != &spawn_attributes)
+    {
+        posix_spawnattr_destroy(attributes);
+    }
+    return err;
+}
+
+// Function to launch an external command
+// The zygote starts it when there is one, posix_spawn otherwise. pgid is
+// the process group to start it in as for setup_spawn_attributes. Returns
+// the child pid, or -1 if the command could not be started.
+pid_t spawn_command(const char *path, char **args, char **envp, const struct FdPlan *plan, pid_t pgid)
+{
+    pid_t pid;
+    int err;
+    if (zygote_fd == -1 || zygote_spawn(&pid, path, args, envp, plan, pgid, &err) != 0)
+    {
+        err = posix_spawn_command(&pid, path, args, envp, plan, pgid);
+    }
+    if (err == ENOENT && strcmp(path, args[0]) != 0 && access(path, X_OK) != 0)
+    {
+        // The remembered location is stale, look the command up again
+        hash_forget(args[0]);
+        path = hash_lookup(args[0]);
+        if (path != NULL)
+        {
+            return spawn_command(path, args, envp, plan, pgid);
+        }
+    }
+    if (err != 0)
+    {
+        fprintf(stderr, "%s: %s\n", args[0], strerror(err));
+        return -1;
+    }
+    return pid;
+}
+
+// Function to give a forked child the fds of its plan
+// unused_fd is a pipe end the child must not keep open, -1 if there is none.
+// A forked shell may never exec, so the fds the plan owns are closed too
+// rather than left to close-on-exec.
+void setup_child_fds(const struct FdPlan *plan, int unused_fd)
+{
+    if (unused_fd != -1)
+    {
+        close(unused_fd);
+    }
+
+    struct FdMove moves[FD_MOVES_MAX];
+    int move_count = plan_moves(plan, moves);
+    if (park_fd(moves, move_count) == -2)
+    {
+        perror("fcntl");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < move_count; i++)
+    {
+        if (moves[i].from == FD_CLOSED)
+        {
+            close(moves[i].to);
+        }
+        else if (dup2(moves[i].from, moves[i].to) == -1)
+        {
+            perror("dup2");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for (int i = 0; i < plan->owned_count; i++)
+    {
+        int fd = plan->owned[i];
+        if (fd >= REDIRECT_FDS || plan->fds[fd] == fd)
+        {
+            close(fd);
+        }
+    }
+}
+
+// Function to put a forked child in the process group of its job
+// group is NULL for a foreground command that stays in the shell's group,
+// as in a script, and points at 0 until the job's first process starts and
+// leads a new group.
+// Parent and child both make the call, so the child is in its group before
+// either goes on, whichever runs first.
+void join_group(pid_t pid, pid_t *group)
+{
+    if (group != NULL)
+    {
+        setpgid(pid, *group);
+    }
+}
+
+// Function to execute a command with input and output redirection
+// Starts the command with the fds of plan and returns the child pid without
+// waiting for it, so a pipeline can have every stage running at once.
+// unused_fd is a pipe end the parent still holds that the child must not
+// keep open (-1 if none), envp the environment external commands get, and
+// group the process group of the job as for join_group.
+// External commands go through spawn_command; only builtins, which have to
+// run shell code in the child, pay for a full fork. Building with
+// -DQUASH_NO_SPAWN forces the fork path for everything, for comparison.
+pid_t execute_command(char **args, char **envp, struct FdPlan *plan, int unused_fd, pid_t *group)
+{
+    pid_t pid;
+    struct Builtin *builtin = find_command_builtin(args);
+    int is_builtin = builtin != NULL;
+    int use_fork = is_builtin;
+#ifdef QUASH_NO_SPAWN
+    use_fork = 1;
+#endif
+
+    // Resolve external commands through the hash table before starting them
+    const char *path = NULL;
+    if (!is_builtin && (path = hash_lookup(args[0])) == NULL)
+    {
+        fprintf(stderr, "%s: command not found\n", args[0]);
+        pid = -127;
+        use_fork = 0;
+    }
+    else if (!use_fork)
+    {
+        // posix_spawn only returns once the child has exec'd, so the span
+        // covers the exec as well
+        long long trace_start = tracing ? trace_now() : 0;
+        pid = spawn_command(path, args, envp, plan, group != NULL ? *group : -1);
+        if (tracing)
+        {
+            trace_span("spawn", trace_start, args[0]);
+        }
+        if (pid == -1)
+        {
+            pid = -127;
+        }
+    }
+    else
+    {
+        // Flush so the child does not inherit and repeat pending output
+        fflush(stdout);
+        long long trace_start = tracing ? trace_now() : 0;
+        pid = fork();
+        if (tracing && pid != 0)
+        {
+            trace_span("fork", trace_start, args[0]);
+        }
+    }
+
+    if (use_fork && pid < 0)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+
+    if (use_fork && pid == 0)
+    { // Child process
+        long long trace_start = tracing ? trace_now() : 0;
+        join_group(0, group);
+        setup_child_fds(plan, unused_fd);
+        setup_child_signals();
+        if (is_builtin)
+        {
+            exit(run_builtin(builtin, args, 0, 1, 2));
+        }
+        else
+        {
+            for (struct ProcessSubstitution *substitution = process_substitutions; substitution != NULL; substitution = substitution->next)
+            {
+                fcntl(substitution->fd, F_SETFD, 0);
+            }
+            if (tracing && trace_children)
+            {
+                trace_exec(trace_start);
+            }
+            execve(path, args, envp);
+            perror("execve");
+            exit(EXIT_FAILURE);
+        }
+    }
+    else
+    { // Parent process
+        if (use_fork)
+        {
+            join_group(pid, group);
+        }
+        if (group != NULL && *group == 0 && pid > 0)
+        {
+            *group = pid;
+        }
+        close_plan(plan);
+    }
+    return pid;
+}
+
+// Function to wait for every process of a foreground pipeline
+// Reaps the stages in order and returns the exit status of the last one.
+// A pid of zero or below marks a stage that never started, its negation is
+// the exit status to report for it. If usages is not NULL it gets the
+// resources each reaped stage used. A pipeline in a process group of its
+// own, group not 0, can be stopped from the terminal: the stages not reaped
+// yet then become a stopped job named command, and the status is 128 plus
+// the signal that stopped it.
+int wait_for_pipeline(pid_t *pids, int count, struct rusage *usages, pid_t group, const char *command)
+{
+    int status = 0;
+    struct rusage usage;
+    for (int i = 0; i < count; i++)
+    {
+        struct rusage *stage_usage = usages ? &usages[i] : &usage;
+        if (pids[i] <= 0)
+        {
+            status = (-pids[i]) << 8;
+        }
+        else if (wait_child(pids[i], &status, group != 0 ? WUNTRACED : 0, stage_usage) == -1)
+        {
+            perror("wait4");
+        }
+        else if (WIFSTOPPED(status))
+        {
+            // The other stages got the same signal and report it to the jobs reaping
+            struct Job *job = add_job(pids + i, count - i, group, command);
+            job_exited(pids[i], status, stage_usage);
+            printf("\nStopped: [%d] %d %s\n", job->job_id, job->pgid, job->command);
+            return 128 + WSTOPSIG(status);
+        }
+    }
+    return exit_status(status);
+}
+
+// Structure for an argument vector that grows as words are expanded into it
+struct ArgvBuilder
+{
+    char **items;
+    int count;
+    int capacity;
+};
+
+struct StringBuffer field_buffer = {NULL, 0, 0}; // Field being built by expand_word
+struct ArgvBuilder argv_builder = {NULL, 0, 0};   // Fields of the command being expanded
+
+// Function to add an argument to an argument vector
+void argv_push(struct ArgvBuilder *argv, char *arg)
+{
+    if (argv->count + 1 >= argv->capacity)
+    {
+        argv->capacity = argv->capacity ? argv->capacity * 2 : 32;
+        argv->items = (char **)realloc(argv->items, argv->capacity * sizeof(char *));
+        if (argv->items == NULL)
+        {
+            perror("realloc");
+            exit(EXIT_FAILURE);
+        }
+    }
+    argv->items[argv->count++] = arg;
+}
+
+// Function to write a number as decimal text into a buffer of at least 21 bytes
+// Loops turn numbers into text on every iteration, and this is much cheaper
+// than going through snprintf.
+char *number_text(char *buffer, long long value)
+{
+    char digits[20];
+    int length = 0;
+    unsigned long long magnitude = value < 0 ? 0 - (unsigned long long)value : (unsigned long long)value;
+    do
+    {
+        digits[length++] = '0' + magnitude % 10;
+        magnitude /= 10;
+    } while (magnitude != 0);
+
+    char *out = buffer;
+    if (value < 0)
+    {
+        *out++ = '-';
+    }
+    while (length > 0)
+    {
+        *out++ = digits[--length];
+    }
+    *out = '\0';
+    return buffer;
+}
+
+// Function to look up a variable by name, including the special parameters
+char *get_variable(const char *name)
+{
+    static char number[32];
+    if (name[0] == '\0' || name[1] != '\0')
+    {
+        // Special parameters are all a single character
+        return lookup_variable(name);
+    }
+    if (strcmp(name, "?") == 0)
+    {
+        return number_text(number, last_status);
+    }
+    if (strcmp(name, "$") == 0)
+    {
+        snprintf(number, sizeof(number), "%d", (int)getpid());
+        return number;
+    }
+    if (strcmp(name, "#") == 0)
+    {
+        snprintf(number, sizeof(number), "%d", positional_count);
+        return number;
+    }
+    if (strcmp(name, "!") == 0)
+    {
+        return last_background_pid > 0 ? number_text(number, last_background_pid) : NULL;
+    }
+    if (name[0] >= '0' && name[0] <= '9' && name[1] == '\0')
+    {
+        int index = name[0] - '0';
+        if (index == 0)
+        {
+            return shell_name;
+        }
+        return index <= positional_count ? positional_args[index - 1] : NULL;
+    }
+    if (strcmp(name, "@") == 0 || strcmp(name, "*") == 0)
+    {
+        // All the positional parameters joined by spaces
+        size_t length = 1;
+        for (int i = 0; i < positional_count; i++)
+        {
+            length += strlen(positional_args[i]) + 1;
+        }
+        char *joined = (char *)arena_alloc(&line_arena, length);
+        char *end = joined;
+        for (int i = 0; i < positional_count; i++)
+        {
+            if (i > 0)
+            {
+                *end++ = ' ';
+            }
+            size_t arg_length = strlen(positional_args[i]);
+            memcpy(end, positional_args[i], arg_length);
+            end += arg_length;
+        }
+        *end = '\0';
+        return joined;
+    }
+    return lookup_variable(name);
+}
+
+// Structure holding the state of an arithmetic expansion
+struct Arith
+{
+    const char *pos; // where the expression continues
+    int error;       // an error was reported, the value is meaningless
+    int skip;        // inside a branch that is not taken: no assignments
+};
+
+int expansion_error = 0; // An expansion of the current command failed and reported why
+
+// Function to report an error in an arithmetic expression
+void arith_error(struct Arith *arith, const char *message)
+{
+    if (!arith->error)
+    {
+        fprintf(stderr, "quash: arithmetic: %s\n", message);
+        arith->error = 1;
+    }
+}
+
+// Function to skip blanks in an arithmetic expression
+void arith_blanks(struct Arith *arith)
+{
+    while (*arith->pos == ' ' || *arith->pos == '\t' || *arith->pos == '\n')
+    {
+        arith->pos++;
+    }
+}
+
+// Function to get the value of a variable used in an arithmetic expression
+// Unset and empty variables are 0, anything else has to be an integer.
+long long arith_variable(struct Arith *arith, const char *name)
+{
+    char *value = get_variable(name);
+    while (value != NULL && (*value == ' ' || *value == '\t'))
+    {
+        value++;
+    }
+    if (value == NULL || *value == '\0')
+    {
+        return 0;
+    }
+    char *end;
+    errno = 0;
+    long long number = strtoll(value, &end, 0);
+    while (*end == ' ' || *end == '\t')
+    {
+        end++;
+    }
+    if (*end != '\0' || errno != 0)
+    {
+        arith_error(arith, "variable value is not an integer");
+        return 0;
+    }
+    return number;
+}
+
+// Function to store the result of an assignment in a variable
+void arith_store(struct Arith *arith, const char *name, long long value)
+{
+    if (arith->skip || arith->error)
+    {
+        return;
+    }
+    char number[32];
+    set_variable(name, number_text(number, value), 0);
+}
+
+// Function to read a variable name at the current position into name
+// Returns 0 if there is no name here.
+int arith_name(struct Arith *arith, char *name, size_t size)
+{
+    const char *end = variable_name_end(arith->pos);
+    if (!valid_name(arith->pos, end) || (size_t)(end - arith->pos) >= size)
+    {
+        return 0;
+    }
+    memcpy(name, arith->pos, end - arith->pos);
+    name[end - arith->pos] = '\0';
+    arith->pos = end;
+    return 1;
+}
+
+long long arith_comma(struct Arith *arith);
+long long arith_assign(struct Arith *arith);
+
+// Function to apply a binary operator, with the wrap-around of 64-bit two's complement
+long long arith_apply(struct Arith *arith, const char *op, long long a, long long b)
+{
+    unsigned long long ua = a;
+    unsigned long long ub = b;
+    switch (op[0])
+    {
+    case '*':
+        return (long long)(ua * ub);
+    case '/':
+    case '%':
+        if (b == 0)
+        {
+            if (!arith->skip)
+            {
+                arith_error(arith, "division by zero");
+            }
+            return 0;
+        }
+        if (b == -1)
+        {
+            // Avoid the overflow of the smallest number divided by -1
+            return op[0] == '/' ? (long long)(0 - ua) : 0;
+        }
+        return op[0] == '/' ? a / b : a % b;
+    case '+':
+        return (long long)(ua + ub);
+    case '-':
+        return (long long)(ua - ub);
+    case '<':
+        if (op[1] == '<')
+        {
+            return (long long)(ua << (ub & 63));
+        }
+        return op[1] == '=' ? a <= b : a < b;
+    case '>':
+        if (op[1] == '>')
+        {
+            return a >> (ub & 63);
+        }
+        return op[1] == '=' ? a >= b : a > b;
+    case '=':
+        return a == b;
+    case '!':
+        return a != b;
+    case '&':
+        return op[1] == '&' ? (a && b) : (a & b);
+    case '^':
+        return a ^ b;
+    case '|':
+        return op[1] == '|' ? (a || b) : (a | b);
+    }
+    return 0;
+}
+
+// Function to read a number, a variable, a $ reference or a parenthesised expression
+long long arith_primary(struct Arith *arith)
+{
+    arith_blanks(arith);
+    char c = *arith->pos;
+    if (c == '(')
+    {
+        arith->pos++;
+        long long value = arith_comma(arith);
+        arith_blanks(arith);
+        if (*arith->pos != ')')
+        {
+            arith_error(arith, "missing )");
+            return 0;
+        }
+        arith->pos++;
+        return value;
+    }
+    if (c >= '0' && c <= '9')
+    {
+        char *end;
+        errno = 0;
+        long long value = (long long)strtoull(arith->pos, &end, 0);
+        if (errno != 0 || (*end >= '0' && *end <= '9') || valid_name(end, variable_name_end(end)))
+        {
+            arith_error(arith, "invalid number");
+            return 0;
+        }
+        arith->pos = end;
+        return value;
+    }
+    if (c == '$')
+    {
+        // $NAME, ${NAME} and the special parameters
+        char name[256];
+        const char *start = arith->pos + 1;
+        const char *end;
+        if (*start == '{')
+        {
+            start++;
+            end = strchr(start, '}');
+            arith->pos = end ? end + 1 : start;
+        }
+        else if (*start != '\0' && strchr("?$#@*0123456789", *start) != NULL)
+        {
+            end = start + 1;
+            arith->pos = end;
+        }
+        else
+        {
+            end = variable_name_end(start);
+            arith->pos = end;
+        }
+        if (end == NULL || end == start || (size_t)(end - start) >= sizeof(name))
+        {
+            arith_error(arith, "bad variable reference");
+            return 0;
+        }
+        memcpy(name, start, end - start);
+        name[end - start] = '\0';
+        return arith_variable(arith, name);
+    }
+
+    char name[256];
+    if (!arith_name(arith, name, sizeof(name)))
+    {
+        arith_error(arith, *arith->pos ? "syntax error" : "operand expected");
+        return 0;
+    }
+    long long value = arith_variable(arith, name);
+    arith_blanks(arith);
+    if ((arith->pos[0] == '+' || arith->pos[0] == '-') && arith->pos[1] == arith->pos[0])
+    {
+        // Postfix ++ and --, the old value is the result
+        arith_store(arith, name, arith->pos[0] == '+' ? value + 1 : value - 1);
+        arith->pos += 2;
+    }
+    return value;
+}
+
+// Function to read a unary expression: + - ! ~ and prefix ++ --
+long long arith_unary(struct Arith *arith)
+{
+    arith_blanks(arith);
+    char c = *arith->pos;
+    if ((c == '+' || c == '-') && arith->pos[1] == c)
+    {
+        arith->pos += 2;
+        arith_blanks(arith);
+        char name[256];
+        if (!arith_name(arith, name, sizeof(name)))
+        {
+            arith_error(arith, "++ and -- need a variable");
+            return 0;
+        }
+        long long value = arith_variable(arith, name) + (c == '+' ? 1 : -1);
+        arith_store(arith, name, value);
+        return value;
+    }
+    if (c == '+' || c == '-' || c == '!' || c == '~')
+    {
+        arith->pos++;
+        long long value = arith_unary(arith);
+        if (c == '-')
+        {
+            return (long long)(0 - (unsigned long long)value);
+        }
+        return c == '!' ? !value : c == '~' ? ~value : value;
+    }
+    return arith_primary(arith);
+}
+
+// Function to recognise a binary operator at the current position
+// Returns its precedence, higher binds tighter, and 0 if there is none.
+// Compound assignments such as += and <<= are left for arith_assign.
+int arith_binary_operator(const char *p, char *op)
+{
+    static const struct
+    {
+        const char *text;
+        int precedence;
+        int assignable; // text followed by = is an assignment
+    } operators[] = {
+        {"||", 1, 0}, {"&&", 2, 0}, {"==", 6, 0}, {"!=", 6, 0}, {"<=", 7, 0}, {">=", 7, 0},
+        {"<<", 8, 1}, {">>", 8, 1}, {"|", 3, 1}, {"^", 4, 1}, {"&", 5, 1}, {"<", 7, 0}, {">", 7, 0},
+        {"+", 9, 1}, {"-", 9, 1}, {"*", 10, 1}, {"/", 10, 1}, {"%", 10, 1},
+    };
+    if (*p == '\0' || strchr("|&=!<>^+-*/%", *p) == NULL)
+    {
+        return 0;
+    }
+    for (size_t i = 0; i < sizeof(operators) / sizeof(operators[0]); i++)
+    {
+        // Operators are one or two characters, compare them directly
+        const char *text = operators[i].text;
+        size_t length = text[1] != '\0' ? 2 : 1;
+        if (p[0] == text[0] && (length == 1 || p[1] == text[1]))
+        {
+            if (operators[i].assignable && p[length] == '=')
+            {
+                return 0;
+            }
+            strcpy(op, operators[i].text);
+            return operators[i].precedence;
+        }
+    }
+    return 0;
+}
+
+// Function to read binary operators binding at least as tight as min_precedence
+// The right operand of && and || and is only evaluated for its side effects
+// when it decides the result.
+long long arith_binary(struct Arith *arith, int min_precedence)
+{
+    long long value = arith_unary(arith);
+    while (!arith->error)
+    {
+        arith_blanks(arith);
+        char op[3];
+        int precedence = arith_binary_operator(arith->pos, op);
+        if (precedence == 0 || precedence < min_precedence)
+        {
+            return value;
+        }
+        arith->pos += strlen(op);
+        int short_circuit = (strcmp(op, "&&") == 0 && !value) || (strcmp(op, "||") == 0 && value);
+        arith->skip += short_circuit;
+        long long right = arith_binary(arith, precedence + 1);
+        arith->skip -= short_circuit;
+        value = arith_apply(arith, op, value, right);
+    }
+    return value;
+}
+
+// Function to read a conditional expression, a ? b : c
+long long arith_conditional(struct Arith *arith)
+{
+    long long condition = arith_binary(arith, 1);
+    arith_blanks(arith);
+    if (*arith->pos != '?' || arith->error)
+    {
+        return condition;
+    }
+    arith->pos++;
+    arith->skip += !condition;
+    long long if_true = arith_comma(arith);
+    arith->skip -= !condition;
+    arith_blanks(arith);
+    if (*arith->pos != ':')
+    {
+        arith_error(arith, "missing : in ?:");
+        return 0;
+    }
+    arith->pos++;
+    arith->skip += !!condition;
+    long long if_false = arith_conditional(arith);
+    arith->skip -= !!condition;
+    return condition ? if_true : if_false;
+}
+
+// Function to read an assignment, NAME op= expression, or a conditional expression
+long long arith_assign(struct Arith *arith)
+{
+    arith_blanks(arith);
+    const char *start = arith->pos;
+    char name[256];
+    if (arith_name(arith, name, sizeof(name)))
+    {
+        arith_blanks(arith);
+        if (*arith->pos == '\0' || strchr("=*/%+-<>&^|", *arith->pos) == NULL)
+        {
+            // Nothing that could be an assignment operator follows
+            arith->pos = start;
+            return arith_conditional(arith);
+        }
+        static const char *assignments[] = {"=", "*=", "/=", "%=", "+=", "-=", "<<=", ">>=", "&=", "^=", "|="};
+        for (size_t i = 0; i < sizeof(assignments) / sizeof(assignments[0]); i++)
+        {
+            size_t length = strlen(assignments[i]);
+            if (strncmp(arith->pos, assignments[i], length) != 0 || (length == 1 && arith->pos[1] == '='))
+            {
+                continue;
+            }
+            arith->pos += length;
+            long long value = arith_assign(arith);
+            if (length > 1)
+            {
+                // a op= b is a = a op b
+                char op[3] = {assignments[i][0], length == 3 ? assignments[i][1] : '\0', '\0'};
+                value = arith_apply(arith, op, arith_variable(arith, name), value);
+            }
+            arith_store(arith, name, value);
+            return value;
+        }
+        arith->pos = start; // just a name, read it again as an operand
+    }
+    return arith_conditional(arith);
+}
+
+// Function to read a comma separated list of expressions, the last one is the value
+long long arith_comma(struct Arith *arith)
+{
+    long long value = arith_assign(arith);
+    arith_blanks(arith);
+    while (*arith->pos == ',' && !arith->error)
+    {
+        arith->pos++;
+        value = arith_assign(arith);
+        arith_blanks(arith);
+    }
+    return value;
+}
+
+// Function to evaluate the expression of a $(( )) expansion
+// The arithmetic is that of C on 64-bit integers, with variables read and
+// assigned by name. Returns the value as text in the line arena, or NULL
+// after reporting an error.
+char *arith_expand(const char *expression)
+{
+    struct Arith arith = {expression, 0, 0};
+    long long value = 0;
+    arith_blanks(&arith);
+    if (*arith.pos != '\0')
+    {
+        value = arith_comma(&arith);
+    }
+    if (!arith.error && *arith.pos != '\0')
+    {
+        arith_error(&arith, "syntax error");
+    }
+    if (arith.error)
+    {
+        expansion_error = 1;
+        return NULL;
+    }
+    char number[32];
+    return arena_strdup(&line_arena, number_text(number, value));
+}
+
+int substitution_status = 0; // Exit status of the last command substitution of the command being expanded
+
+char *command_substitute(struct Code *code);
+char *process_substitute(struct WordPart *part);
+void expand_word(struct Word *word, struct ArgvBuilder *argv, int split);
+
+// Function to expand a word into a single string, as in double quotes
+// Used for the parts of a word that hold words of their own, so the field
+// being built around it keeps its buffer. The string is in the line arena.
+char *expand_word_text(struct Word *word)
+{
+    if (word->literal != NULL)
+    {
+        return word->literal;
+    }
+    struct StringBuffer outer_field = field_buffer;
+    struct ArgvBuilder text = {NULL, 0, 0};
+    field_buffer = (struct StringBuffer){NULL, 0, 0};
+    expand_word(word, &text, 0);
+    char *result = text.count > 0 ? text.items[0] : "";
+    free(text.items);
+    free(field_buffer.data);
+    field_buffer = outer_field;
+    return result;
+}
+
+// Function to apply the operator of ${NAME-word}, ${NAME+word} or ${NAME=word} to the value of NAME
+// With a colon, as in ${NAME:-word}, an empty value counts as unset too.
+// The word is only expanded if it is used.
+char *parameter_operator(struct WordPart *part, char *value)
+{
+    int set = value != NULL && (!part->colon || *value != '\0');
+    if (part->op == '+')
+    {
+        return set ? expand_word_text(part->word) : NULL;
+    }
+    if (set)
+    {
+        return value;
+    }
+    char *word = expand_word_text(part->word);
+    if (part->op == '=')
+    {
+        if (!valid_name(part->text, part->text + strlen(part->text)))
+        {
+            fprintf(stderr, "quash: %s: cannot assign this way\n", part->text);
+            expansion_error = 1;
+            return NULL;
+        }
+        set_variable(part->text, word, 0);
+    }
+    return word;
+}
+
+// Function to end the field being built and add it to the arguments
+void finish_field(struct ArgvBuilder *argv)
+{
+    char *field = (char *)arena_alloc(&line_arena, field_buffer.length + 1);
+    memcpy(field, field_buffer.data ? field_buffer.data : "", field_buffer.length + 1);
+    argv_push(argv, field);
+    field_buffer.length = 0;
+}
+
+// Function to expand a word into zero or more arguments
+// Variables are substituted, and if split is set the values of unquoted ones
+// are split into separate arguments on blanks. Words without any expansion
+// are added as they are, without copying.
+void expand_word(struct Word *word, struct ArgvBuilder *argv, int split)
+{
+    if (word->literal != NULL)
+    {
+        argv_push(argv, word->literal);
+        return;
+    }
+
+    int have_field = word->quoted;
+    field_buffer.length = 0;
+    for (struct WordPart *part = word->parts; part != NULL; part = part->next)
+    {
+        if (part->type == PART_LITERAL)
+        {
+            buffer_append(&field_buffer, part->text, strlen(part->text));
+            have_field = 1;
+            continue;
+        }
+
+        if (part->type == PART_VARIABLE && part->quoted && split && strcmp(part->text, "@") == 0)
+        {
+            // "$@" gives every positional parameter as its own word
+            for (int i = 0; i < positional_count; i++)
+            {
+                if (i > 0)
+                {
+                    finish_field(argv);
+                }
+                buffer_append(&field_buffer, positional_args[i], strlen(positional_args[i]));
+                have_field = 1;
+            }
+            continue;
+        }
+
+        char *value;
+        if (part->type == PART_ARITH)
+        {
+            value = arith_expand(expand_word_text(part->word));
+        }
+        else if (part->type == PART_COMMAND)
+        {
+            value = command_substitute(part->code);
+        }
+        else if (part->type == PART_PROCESS_READ || part->type == PART_PROCESS_WRITE)
+        {
+            value = process_substitute(part);
+        }
+        else if (part->op != 0)
+        {
+            value = parameter_operator(part, get_variable(part->text));
+        }
+        else if (part->text[0] == '#' && part->text[1] != '\0')
+        {
+            // ${#NAME} is the length of the value
+            char *length = get_variable(part->text + 1);
+            char number[32];
+            value = arena_strdup(&line_arena, number_text(number, length != NULL ? strlen(length) : 0));
+        }
+        else
+        {
+            value = get_variable(part->text);
+        }
+        if (value == NULL)
+        {
+            continue;
+        }
+        if (part->quoted || !split)
+        {
+            buffer_append(&field_buffer, value, strlen(value));
+            have_field = 1;
+            continue;
+        }
+
+        // Unquoted values are split into fields on blanks
+        for (char *c = value; *c; c++)
+        {
+            if (*c == ' ' || *c == '\t' || *c == '\n')
+            {
+                if (have_field)
+                {
+                    finish_field(argv);
+                    have_field = 0;
+                }
+            }
+            else
+            {
+                buffer_append(&field_buffer, c, 1);
+                have_field = 1;
+            }
+        }
+    }
+    if (have_field)
+    {
+        finish_field(argv);
+    }
+}
+
+// Function to expand the words of a command into a NULL terminated argv
+// The array is allocated from the line arena; *count gets the number of arguments.
+char **expand_command(struct Command *command, int *count)
+{
+    argv_builder.count = 0;
+    for (struct Word *word = command->words; word != NULL; word = word->next)
+    {
+        expand_word(word, &argv_builder, 1);
+    }
+    argv_push(&argv_builder, NULL);
+
+    char **args = (char **)arena_alloc(&line_arena, argv_builder.count * sizeof(char *));
+    memcpy(args, argv_builder.items, argv_builder.count * sizeof(char *));
+    *count = argv_builder.count - 1;
+    return args;
+}
+
+// Function to expand the assignments of a command into "NAME=value" strings
+// Assignment values are not split into fields. Returns an arena array and
+// sets *count, or NULL when the command has no assignments.
+char **expand_assignments(struct Command *command, int *count)
+{
+    *count = 0;
+    if (command->assignments == NULL)
+    {
+        return NULL;
+    }
+    argv_builder.count = 0;
+    for (struct Word *word = command->assignments; word != NULL; word = word->next)
+    {
+        expand_word(word, &argv_builder, 0);
+    }
+    char **result = (char **)arena_alloc(&line_arena, argv_builder.count * sizeof(char *));
+    memcpy(result, argv_builder.items, argv_builder.count * sizeof(char *));
+    *count = argv_builder.count;
+    return result;
+}
+
+// Function to build the environment for a command run as NAME=value cmd
+// The shell's own environment is used as it is when there are no
+// assignments; otherwise a copy with the assignments applied is made in
+// the line arena, leaving the shell's variables alone.
+char **command_envp(char **assignments, int count)
+{
+    char **base = get_envp();
+    if (count == 0)
+    {
+        return base;
+    }
+
+    char **envp = (char **)arena_alloc(&line_arena, (exported_count + count + 1) * sizeof(char *));
+    int length = 0;
+    for (char **env = base; *env != NULL; env++)
+    {
+        size_t name_length = strchr(*env, '=') - *env + 1;
+        int overridden = 0;
+        for (int i = 0; i < count && !overridden; i++)
+        {
+            overridden = strncmp(assignments[i], *env, name_length) == 0;
+        }
+        if (!overridden)
+        {
+            envp[length++] = *env;
+        }
+    }
+    for (int i = 0; i < count; i++)
+    {
+        // A later assignment to the same name wins
+        size_t name_length = strchr(assignments[i], '=') - assignments[i] + 1;
+        int repeated = 0;
+        for (int j = i + 1; j < count && !repeated; j++)
+        {
+            repeated = strncmp(assignments[i], assignments[j], name_length) == 0;
+        }
+        if (!repeated)
+        {
+            envp[length++] = assignments[i];
+        }
+    }
+    envp[length] = NULL;
+    return envp;
+}
+
+// Function to expand a redirection target, which has to be a single word
+char *expand_target(struct Word *word)
+{
+    struct ArgvBuilder target = {NULL, 0, 0};
+    expand_word(word, &target, 1);
+    char *result = target.count == 1 ? target.items[0] : NULL;
+    if (result == NULL)
+    {
+        fprintf(stderr, "quash: ambiguous redirect\n");
+    }
+    free(target.items);
+    return result;
+}
+
+// Function to give a here-document or here-string as an fd to read it from
+// A body no bigger than PIPE_BUF is written into a pipe, which always has
+// room for that much; larger ones go into a memfd. Neither touches the disk.
+// Returns -1 after reporting an error.
+int here_document_fd(struct Redirect *redirect)
+{
+    struct ArgvBuilder body = {NULL, 0, 0};
+    expand_word(redirect->target, &body, 0);
+    char *text = body.count > 0 ? body.items[0] : "";
+    free(body.items);
+    size_t length = strlen(text);
+    int newline = redirect->type == REDIRECT_HERESTRING;
+
+    int fds[2];
+    if (length + newline <= PIPE_BUF)
+    {
+        if (pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe");
+            return -1;
+        }
+    }
+    else
+    {
+        fds[0] = fds[1] = memfd_create("quash-heredoc", MFD_CLOEXEC);
+        if (fds[0] == -1)
+        {
+            perror("memfd_create");
+            return -1;
+        }
+    }
+
+    int err = write_all(fds[1], text, length);
+    if (err == 0 && newline)
+    {
+        err = write_all(fds[1], "\n", 1);
+    }
+    if (fds[0] != fds[1])
+    {
+        close(fds[1]);
+    }
+    else if (err == 0 && lseek(fds[0], 0, SEEK_SET) == -1)
+    {
+        err = errno;
+    }
+    if (err != 0)
+    {
+        fprintf(stderr, "quash: here-document: %s\n", strerror(err));
+        close(fds[0]);
+        return -1;
+    }
+    return fds[0];
+}
+
+// Function to tell if a command's fd can be duplicated, as it is at this point of its plan
+// An fd the command would inherit from the shell has to be open and not
+// close-on-exec, so the fds the shell keeps for itself cannot be reached.
+int plan_fd_open(const struct FdPlan *plan, int fd)
+{
+    if (fd >= REDIRECT_FDS || plan->fds[fd] == FD_CLOSED)
+    {
+        return 0;
+    }
+    if (plan->fds[fd] != fd)
+    {
+        return 1;
+    }
+    int flags = fcntl(fd, F_GETFD);
+    return flags != -1 && !(flags & FD_CLOEXEC);
+}
+
+// Function to apply the redirections of a command to its fd plan
+// They are applied in order, so a duplication copies whatever its source
+// is at that point and 2>&1 >file is not the same as >file 2>&1. Files are
+// opened close-on-exec and owned by the plan. Returns -1 after reporting
+// an error.
+int open_redirects(struct Command *command, struct FdPlan *plan)
+{
+    for (struct Redirect *redirect = command->redirects; redirect != NULL; redirect = redirect->next)
+    {
+        if (redirect->fd >= REDIRECT_FDS)
+        {
+            fprintf(stderr, "quash: %d: bad file descriptor\n", redirect->fd);
+            return -1;
+        }
+        if (redirect->type == REDIRECT_HEREDOC || redirect->type == REDIRECT_HERESTRING)
+        {
+            int fd = here_document_fd(redirect);
+            if (fd == -1)
+            {
+                return -1;
+            }
+            plan_own(plan, redirect->fd, fd);
+            continue;
+        }
+
+        char *target = expand_target(redirect->target);
+        if (target == NULL)
+        {
+            return -1;
+        }
+        if (redirect->type == REDIRECT_DUP)
+        {
+            if (strcmp(target, "-") == 0)
+            {
+                plan_set(plan, redirect->fd, FD_CLOSED);
+                continue;
+            }
+            if (!fd_target(target) || !plan_fd_open(plan, atoi(target)))
+            {
+                fprintf(stderr, "quash: %s: bad file descriptor\n", target);
+                return -1;
+            }
+            plan_set(plan, redirect->fd, plan->fds[atoi(target)]);
+            continue;
+        }
+
+        int fd;
+        int mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+        if (redirect->type == REDIRECT_IN)
+        {
+            fd = open(target, O_RDONLY | O_CLOEXEC);
+        }
+        else if (redirect->type == REDIRECT_OUT)
+        {
+            fd = open(target, O_WRONLY | O_TRUNC | O_CREAT | O_CLOEXEC, mode);
+        }
+        else if (redirect->type == REDIRECT_APPEND)
+        {
+            fd = open(target, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, mode);
+        }
+        else
+        {
+            fd = open(target, O_RDWR | O_CREAT | O_CLOEXEC, mode);
+        }
+        if (fd == -1)
+        {
+            perror(target);
+            return -1;
+        }
+        plan_own(plan, redirect->fd, fd);
+    }
+    return 0;
+}
+
+// Structure for a builtin pipeline stage running on its own thread
+struct BuiltinThread
+{
+    pthread_t thread;
+    int stage;    // position in the pipeline
+    struct Builtin *builtin;
+    char **args;
+    struct FdPlan plan;
+    int status;
+    struct rusage *usage; // where to put what the stage used, or NULL
+};
+
+// Function to run a builtin stage inside the shell, measuring it if asked
+// The usage is the calling thread's, so it covers only this stage.
+int run_builtin_stage(struct Builtin *builtin, char **args, const struct FdPlan *plan, struct rusage *usage)
+{
+    if (usage == NULL)
+    {
+        return run_builtin(builtin, args, plan->fds[0], plan->fds[1], plan->fds[2]);
+    }
+    struct rusage before;
+    getrusage(RUSAGE_THREAD, &before);
+    int status = run_builtin(builtin, args, plan->fds[0], plan->fds[1], plan->fds[2]);
+    getrusage(RUSAGE_THREAD, usage);
+    subtract_usage(usage, &before);
+    return status;
+}
+
+// Thread body for a builtin stage, it owns its fds and closes them when done
+// so the next stage sees end of file
+void *builtin_thread_main(void *arg)
+{
+    struct BuiltinThread *stage = (struct BuiltinThread *)arg;
+    stage->status = run_builtin_stage(stage->builtin, stage->args, &stage->plan, stage->usage);
+    close_plan(&stage->plan);
+    return NULL;
+}
+
+// Function to report what a timed pipeline used on stderr
+// The totals come first, like other shells print them, then one line per
+// stage so the stage holding the pipeline up stands out.
+void print_times(char **names, struct rusage *usages, int count, struct timespec *started)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long real = (now.tv_sec - started->tv_sec) * 1000000000LL + (now.tv_nsec - started->tv_nsec);
+
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < count; i++)
+    {
+        add_usage(&total, &usages[i]);
+    }
+
+    struct BuiltinIO io = {0, 2, 2, {NULL, 0, 0}, 0};
+    io_printf(&io, "\nreal\t%lld.%03llds\n", real / 1000000000, real / 1000000 % 1000);
+    io_printf(&io, "user\t%ld.%03lds\n", (long)total.ru_utime.tv_sec, (long)total.ru_utime.tv_usec / 1000);
+    io_printf(&io, "sys\t%ld.%03lds\n", (long)total.ru_stime.tv_sec, (long)total.ru_stime.tv_usec / 1000);
+    for (int i = 0; i < count; i++)
+    {
+        io_printf(&io, "[%d] %s: ", i + 1, names[i]);
+        print_usage(&io, &usages[i]);
+        io_printf(&io, "\n");
+    }
+    io_flush(&io);
+    free(io.out.data);
+}
+
+#define FUNCTION_BUCKETS 64     // Buckets in the function table
+#define FUNCTION_DEPTH_MAX 1000 // Function calls that can be running at once
+
+// Structure for a defined function
+struct Function
+{
+    char *name;
+    struct Code *code;         // compiled body
+    struct SharedArena *arena; // holds the code and the parse tree it points into
+    struct Function *next;
+};
+
+struct Function *functions[FUNCTION_BUCKETS]; // name hash -> chain of functions
+int function_count = 0;                       // functions defined, nothing to look up while it is zero
+int function_depth = 0;                       // function calls being run
+int return_requested = 0;                     // return was run, stop the function being run
+
+// Function to find the function with this name, NULL if there is none
+struct Function *find_function(const char *name)
+{
+    if (function_count == 0)
+    {
+        return NULL;
+    }
+    struct Function *function = functions[hash_bytes(name, strlen(name)) & (FUNCTION_BUCKETS - 1)];
+    while (function != NULL && strcmp(function->name, name) != 0)
+    {
+        function = function->next;
+    }
+    return function;
+}
+
+// Function to define a function, replacing one with the same name
+// The function keeps the arena of its code alive until it is replaced.
+void define_function(const char *name, struct Code *code)
+{
+    struct Function *function = find_function(name);
+    code->arena->references++;
+    if (function != NULL)
+    {
+        shared_arena_release(function->arena);
+    }
+    else
+    {
+        unsigned int bucket = hash_bytes(name, strlen(name)) & (FUNCTION_BUCKETS - 1);
+        function = (struct Function *)malloc(sizeof(struct Function));
+        if (function == NULL)
+        {
+            perror("malloc");
+            exit(EXIT_FAILURE);
+        }
+        function->name = strdup(name);
+        function->next = functions[bucket];
+        functions[bucket] = function;
+        function_count++;
+    }
+    function->code = code;
+    function->arena = code->arena;
+}
+
+// Function to free every function
+void free_functions()
+{
+    for (int i = 0; i < FUNCTION_BUCKETS; i++)
+    {
+        while (functions[i] != NULL)
+        {
+            struct Function *next = functions[i]->next;
+            shared_arena_release(functions[i]->arena);
+            free(functions[i]->name);
+            free(functions[i]);
+            functions[i] = next;
+        }
+    }
+    function_count = 0;
+}
+
+void execute_code(struct Code *code);
+
+// Function to call a function with args as its positional parameters
+// The body holds a reference to its arena while it runs, so it can redefine
+// itself without pulling its own code out from under it.
+int call_function(struct Function *function, char **args, int count)
+{
+    if (function_depth == FUNCTION_DEPTH_MAX)
+    {
+        fprintf(stderr, "quash: %s: maximum function nesting level exceeded\n", args[0]);
+        return 1;
+    }
+    char **saved_args = positional_args;
+    int saved_count = positional_count;
+    struct SharedArena *arena = function->arena;
+    arena->references++;
+    positional_args = args + 1;
+    positional_count = count - 1;
+    function_depth++;
+
+    execute_code(function->code);
+
+    function_depth--;
+    return_requested = 0;
+    positional_args = saved_args;
+    positional_count = saved_count;
+    shared_arena_release(arena);
+    return last_status;
+}
+
+// Function to run a compound command's code or a function call
+int run_stage_code(struct Code *code, struct Function *function, char **args, int count)
+{
+    if (function != NULL)
+    {
+        return call_function(function, args, count);
+    }
+    execute_code(code);
+    return last_status;
+}
+
+// Function to run shell code inside the shell with the fds of a plan
+// Every fd the plan changes is moved aside for the duration and put back
+// afterwards. Sources that are themselves changed are read from the copies
+// moved aside, so the order of the dup2 calls does not matter. The caller
+// still owns the plan's fds. If usage is not NULL it gets what the shell and
+// the children it waited for used.
+int run_shell_code(struct Code *code, struct Function *function, char **args, int count, const struct FdPlan *plan, struct rusage *usage)
+{
+    int saved[REDIRECT_FDS];
+    fflush(stdout);
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        // -1 if the fd was closed to begin with
+        saved[fd] = plan->fds[fd] != fd ? fcntl(fd, F_DUPFD_CLOEXEC, REDIRECT_FDS) : FD_CLOSED;
+    }
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        int source = plan->fds[fd];
+        if (source == fd)
+        {
+            continue;
+        }
+        if (source >= 0 && source < REDIRECT_FDS && plan->fds[source] != source)
+        {
+            source = saved[source];
+        }
+        if (source < 0 || dup2(source, fd) == -1)
+        {
+            close(fd);
+        }
+    }
+
+    struct rusage before_self;
+    struct rusage before_children;
+    if (usage != NULL)
+    {
+        getrusage(RUSAGE_SELF, &before_self);
+        getrusage(RUSAGE_CHILDREN, &before_children);
+    }
+    int status = run_stage_code(code, function, args, count);
+    if (usage != NULL)
+    {
+        struct rusage children;
+        getrusage(RUSAGE_SELF, usage);
+        getrusage(RUSAGE_CHILDREN, &children);
+        subtract_usage(usage, &before_self);
+        subtract_usage(&children, &before_children);
+        add_usage(usage, &children);
+    }
+
+    fflush(stdout);
+    for (int fd = 0; fd < REDIRECT_FDS; fd++)
+    {
+        if (saved[fd] == FD_CLOSED)
+        {
+            continue;
+        }
+        if (saved[fd] == -1 || dup2(saved[fd], fd) == -1)
+        {
+            close(fd);
+        }
+        close(saved[fd]);
+    }
+    return status;
+}
+
+// Function to run shell code in a forked copy of the shell
+// Used for compound commands and function calls that are one stage of a
+// pipeline, run in the background, or are a subshell. Takes ownership of
+// the fds of the plan and puts it in group like execute_command, and
+// returns the child pid.
+pid_t fork_shell_code(struct Code *code, struct Function *function, char **args, int count, struct FdPlan *plan, int unused_fd, pid_t *group, char *input)
+{
+    // Flush so the child does not inherit and repeat pending output, and
+    // so it adds its own trace events without repeating ours
+    fflush(stdout);
+    if (tracing)
+    {
+        trace_flush();
+    }
+    long long trace_start = tracing ? trace_now() : 0;
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("fork");
+        exit(EXIT_FAILURE);
+    }
+    if (pid == 0)
+    {
+        join_group(0, group);
+        setup_child_fds(plan, unused_fd);
+        interactive = 0;
+        setup_child_signals();
+        if (tracing && !trace_children)
+        {
+            drop_tracing();
+        }
+        int status = run_stage_code(code, function, args, count);
+        fflush(stdout);
+        if (tracing)
+        {
+            trace_flush();
+        }
+        exit(status);
+    }
+
+    if (tracing)
+    {
+        trace_span("fork", trace_start, input);
+    }
+    join_group(pid, group);
+    if (group != NULL && *group == 0)
+    {
+        *group = pid;
+    }
+    close_plan(plan);
+    return pid;
+}
+
+struct StringBuffer capture_buffer = {NULL, 0, 0}; // Output of the command substitution being run
+
+// Function to find the builtin a command substitution consists of, if it can run in the shell
+// That is a single pure builtin, with no assignments or redirections and a
+// name that no function overrides; anything else needs a subshell.
+struct Builtin *substitution_builtin(struct Code *code)
+{
+    if (code->count != 1 || code->instructions[0].op != OP_RUN || code->instructions[0].value)
+    {
+        return NULL;
+    }
+    struct Pipeline *pipeline = code->instructions[0].pipeline;
+    struct Command *command = pipeline->commands[0];
+    if (pipeline->count != 1 || pipeline->timed || command->type != COMMAND_SIMPLE || command->assignments != NULL || command->redirects != NULL)
+    {
+        return NULL;
+    }
+    struct Word *name = command->words;
+    if (name == NULL || name->literal == NULL || find_function(name->literal) != NULL)
+    {
+        return NULL;
+    }
+    struct Builtin *builtin = find_builtin(name->literal);
+    if (builtin == NULL || !(builtin->flags & BUILTIN_PURE))
+    {
+        return NULL;
+    }
+    if (builtin->options != NULL)
+    {
+        // Whether it runs at all depends on its arguments, which have to
+        // be known before anything is expanded
+        int count = 0;
+        for (struct Word *word = name; word != NULL; word = word->next, count++)
+        {
+            if (word->literal == NULL)
+            {
+                return NULL;
+            }
+        }
+        char **args = (char **)arena_alloc(&line_arena, (count + 1) * sizeof(char *));
+        count = 0;
+        for (struct Word *word = name; word != NULL; word = word->next)
+        {
+            args[count++] = word->literal;
+        }
+        args[count] = NULL;
+        return builtin_takes(builtin, args) ? builtin : NULL;
+    }
+    return builtin;
+}
+
+// Function to run a command substitution and return its output
+// A pure builtin runs right in the shell and writes into the capture
+// buffer; anything else runs in a forked shell whose output is read from a
+// pipe into the same buffer. Trailing newlines are dropped, and the result
+// is copied to the line arena. The exit status goes to substitution_status.
+char *command_substitute(struct Code *code)
+{
+    long long trace_start = tracing ? trace_now() : 0;
+    struct Builtin *builtin = substitution_builtin(code);
+    if (builtin != NULL)
+    {
+        // The words are expanded with buffers of their own, so the word
+        // this substitution is part of is left as it was
+        struct StringBuffer outer_field = field_buffer;
+        struct ArgvBuilder outer_argv = argv_builder;
+        field_buffer = (struct StringBuffer){NULL, 0, 0};
+        argv_builder = (struct ArgvBuilder){NULL, 0, 0};
+        int count;
+        char **args = expand_command(code->instructions[0].pipeline->commands[0], &count);
+
+        capture_buffer.length = 0;
+        struct BuiltinIO io = {0, -1, 2, capture_buffer, 0};
+        substitution_status = builtin->run(args, &io);
+        capture_buffer = io.out;
+        free(field_buffer.data);
+        free(argv_builder.items);
+        field_buffer = outer_field;
+        argv_builder = outer_argv;
+    }
+    else
+    {
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) == -1)
+        {
+            perror("pipe");
+            exit(EXIT_FAILURE);
+        }
+        struct FdPlan plan;
+        init_plan(&plan, 0, fds[1]);
+        pid_t pid = fork_shell_code(code, NULL, NULL, 0, &plan, fds[0], NULL, NULL);
+        capture_buffer.length = 0;
+        int err = read_all(fds[0], &capture_buffer);
+        if (err != 0)
+        {
+            fprintf(stderr, "quash: command substitution: %s\n", strerror(err));
+        }
+        close(fds[0]);
+        substitution_status = wait_for_pipeline(&pid, 1, NULL, 0, NULL);
+    }
+    // $? in the rest of the command already sees the status
+    last_status = substitution_status;
+
+    // Drop the trailing newlines where they are, then copy the rest out
+    size_t length = capture_buffer.length;
+    while (length > 0 && capture_buffer.data[length - 1] == '\n')
+    {
+        length--;
+    }
+    char *value = (char *)arena_alloc(&line_arena, length + 1);
+    if (length > 0)
+    {
+        memcpy(value, capture_buffer.data, length);
+    }
+    value[length] = '\0';
+    if (tracing)
+    {
+        trace_span("substitute", trace_start, builtin != NULL ? builtin->name : NULL);
+    }
+    return value;
+}
+
+// Function to start a process substitution and return the /dev/fd path that reaches it
+// The list runs in a forked shell with one end of a pipe as its stdout
+// (<(list)) or stdin (>(list)). The shell keeps the other end until the
+// pipeline being expanded has started, and every command of that pipeline
+// gets it under the same fd number.
+char *process_substitute(struct WordPart *part)
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1)
+    {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    struct ProcessSubstitution *substitution = (struct ProcessSubstitution *)arena_alloc(&line_arena, sizeof(struct ProcessSubstitution));
+    substitution->next = process_substitutions;
+
+    // The list itself has no use for the pipes of earlier substitutions.
+    // The shell's end goes above the fds redirections can name, so it cannot
+    // be taken for one of them.
+    process_substitutions = NULL;
+    struct FdPlan plan;
+    if (part->type == PART_PROCESS_READ)
+    {
+        substitution->fd = move_fd_high(fds[0]);
+        init_plan(&plan, 0, fds[1]);
+    }
+    else
+    {
+        substitution->fd = move_fd_high(fds[1]);
+        init_plan(&plan, fds[0], 1);
+    }
+    substitution->pid = fork_shell_code(part->code, NULL, NULL, 0, &plan, substitution->fd, NULL, NULL);
+    process_substitutions = substitution;
+
+    char *path = (char *)arena_alloc(&line_arena, sizeof("/dev/fd/") + 21);
+    strcpy(path, "/dev/fd/");
+    number_text(path + strlen(path), substitution->fd);
+    return path;
+}
+
+// Structure for the expanded words of a pipeline stage
+struct StageWords
+{
+    char **assignments;
+    int assignment_count;
+    char **args;
+    int count;
+    int failed; // an expansion failed and reported why
+    int status; // of the last command substitution
+};
+
+// Function to run a pipeline, waiting for it unless it is in the background
+// Builtins that touch no shell state run inside the shell: as the last stage
+// they run directly, anywhere else on a thread so the shell can go on to
+// start the stages that read their output. Builtins that change the shell,
+// and any builtin in a background pipeline, run in a forked child instead.
+// So do those of a pipeline in the foreground of a terminal, which gets a
+// process group of its own and the terminal, so Ctrl-Z can stop it as a
+// whole and leave it as a job.
+// Compound commands and function calls run inside the shell when they are
+// the whole pipeline in the foreground, and in a forked shell otherwise.
+// A forked shell never execs, so it would keep every pipe end a running
+// thread holds; the builtins before such a stage are forked too.
+void run_pipeline(struct Pipeline *pipeline, int background)
+{
+    int num_pipes = pipeline->count - 1;
+    int(*pipes_fd)[2] = arena_alloc(&line_arena, (num_pipes + 1) * sizeof(*pipes_fd));                     // create num_pipes pipes
+    pid_t *pids = arena_alloc(&line_arena, pipeline->count * sizeof(pid_t));                              // pid of every stage
+    struct BuiltinThread *threads = arena_alloc(&line_arena, pipeline->count * sizeof(struct BuiltinThread)); // builtin stages on threads
+    struct StageWords *stages = arena_alloc(&line_arena, pipeline->count * sizeof(struct StageWords));       // expanded words of every stage
+    int thread_count = 0;
+    int last_shell_code = -1;                         // last stage that runs in a forked shell
+    int terminal = interactive && !background;       // the pipeline goes in the foreground of the terminal
+    pid_t group = 0;                                  // process group of a job-controlled pipeline
+    pid_t *job_group = background || terminal ? &group : NULL;
+    int terminal_given = 0;
+    int outer_trace_children = trace_children;
+    trace_children &= !background;
+
+    // Every stage is expanded before any pipe exists or any stage starts, so
+    // the shells that substitutions fork hold no pipe of this pipeline that
+    // would keep a stage from seeing end of file
+    struct ProcessSubstitution *outer_substitutions = process_substitutions;
+    for (int i = 0; i <= num_pipes; i++)
+    {
+        struct Command *command = pipeline->commands[i];
+        struct StageWords *stage = &stages[i];
+        long long trace_start = tracing ? trace_now() : 0;
+        expansion_error = 0;
+        substitution_status = 0;
+        stage->assignment_count = 0;
+        stage->assignments = NULL;
+        stage->count = 0;
+        stage->args = NULL;
+        if (command->type == COMMAND_SIMPLE)
+        {
+            stage->assignments = expand_assignments(command, &stage->assignment_count);
+            stage->args = expand_command(command, &stage->count);
+        }
+        stage->failed = expansion_error;
+        stage->status = substitution_status;
+        if (command->type != COMMAND_SIMPLE || (stage->count > 0 && find_function(stage->args[0]) != NULL))
+        {
+            last_shell_code = i;
+        }
+        if (tracing)
+        {
+            trace_span("expand", trace_start, stage->count > 0 ? stage->args[0] : NULL);
+        }
+    }
+
+    // time collects what every stage used, builtins included
+    int timed = pipeline->timed && !background;
+    struct rusage *usages = NULL;
+    char **names = NULL;
+    struct timespec started;
+    if (timed)
+    {
+        usages = arena_alloc(&line_arena, pipeline->count * sizeof(struct rusage));
+        memset(usages, 0, pipeline->count * sizeof(struct rusage));
+        names = arena_alloc(&line_arena, pipeline->count * sizeof(char *));
+        clock_gettime(CLOCK_MONOTONIC, &started);
+    }
+
+    for (int i = 0; i <= num_pipes; i++)
+    {
+        if (terminal && group != 0 && !terminal_given)
+        {
+            // The first stage to start leads the group, hand it the terminal
+            // before it can try to read from it
+            give_terminal(group);
+            terminal_given = 1;
+        }
+        struct Command *command = pipeline->commands[i];
+        int assignment_count = stages[i].assignment_count;
+        char **assignments = stages[i].assignments;
+        int command_args_count = stages[i].count;
+        char **command_args = stages[i].args;
+        // Functions come before builtins of the same name
+        struct Function *function = command_args_count > 0 ? find_function(command_args[0]) : NULL;
+        struct Builtin *builtin = command_args_count > 0 && function == NULL ? find_command_builtin(command_args) : NULL;
+        if (timed)
+        {
+            names[i] = command_args_count > 0 ? command_args[0] : command->type != COMMAND_SIMPLE ? pipeline->text : "";
+        }
+
+        if (i < num_pipes)
+        {
+            // Pipes are close-on-exec, a command only keeps the ends it is given
+            if (pipe2(pipes_fd[i], O_CLOEXEC) == -1)
+            {
+                perror("pipe");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        // Wire the stage between the previous and next pipe, then apply its
+        // redirections on top, so they take precedence over the pipe
+        struct FdPlan plan;
+        init_plan(&plan, (i > 0) ? pipes_fd[i - 1][0] : 0, (i < num_pipes) ? pipes_fd[i][1] : 1);
+        int unused_fd = (i < num_pipes) ? pipes_fd[i][0] : -1;
+        long long trace_start = tracing ? trace_now() : 0;
+        expansion_error = 0;
+        int failed = stages[i].failed || open_redirects(command, &plan) == -1 || expansion_error;
+        if (tracing && command->redirects != NULL)
+        {
+            trace_span("redirect", trace_start, NULL);
+        }
+
+        int shell_code = !failed && (command->type != COMMAND_SIMPLE || function != NULL);
+        if (shell_code && (num_pipes > 0 || background || command->type == COMMAND_SUBSHELL))
+        {
+            pids[i] = fork_shell_code(command->code, function, command_args, command_args_count, &plan, unused_fd, job_group, pipeline->text);
+            continue;
         }
 
-        // Iterate through the characters in the token
-        for (int i = 0; token[i] != '\0'; i++)
+        int pure = builtin != NULL && (builtin->flags & BUILTIN_PURE);
+        int in_shell = builtin != NULL && !failed && (pure ? !terminal && (num_pipes == 0 || (!background && i > last_shell_code)) : num_pipes == 0);
+        if (shell_code)
         {
-            if (token[0] == '\'' && inside_double_quote == 0 && !comment)
+            // A lone function call takes its assignments as shell variables
+            for (int j = 0; j < assignment_count; j++)
             {
-                inside_single_quote = 1;
+                set_variable_entry(assignments[j], 0);
             }
-            else if (token[0] == '"' && !inside_single_quote && !comment)
+            pids[i] = -run_shell_code(command->code, function, command_args, command_args_count, &plan, timed ? &usages[i] : NULL);
+        }
+        else if (in_shell && i < num_pipes)
+        {
+            // The thread now owns the fds of the plan
+            struct BuiltinThread *stage = &threads[thread_count];
+            stage->stage = i;
+            stage->builtin = builtin;
+            stage->args = command_args;
+            stage->plan = plan;
+            stage->usage = timed ? &usages[i] : NULL;
+            if (pthread_create(&stage->thread, NULL, builtin_thread_main, stage) != 0)
             {
-                inside_double_quote = 1;
+                perror("pthread_create");
+                exit(EXIT_FAILURE);
             }
-            else if (token[i] == '#' && !inside_single_quote && !inside_double_quote)
+            thread_count++;
+            pids[i] = 0;
+            continue;
+        }
+        else if (in_shell)
+        {
+            // Last stage or a lone builtin: run it right here
+            trace_start = tracing ? trace_now() : 0;
+            int status = run_builtin_stage(builtin, command_args, &plan, timed ? &usages[i] : NULL);
+            if (tracing)
             {
-                // If # is found outside of quotes, it starts a comment
-                comment = 1;
-                // Ignore the rest of the line and break
-                break;
+                trace_span("builtin", trace_start, command_args[0]);
             }
+            pids[i] = -status;
         }
-
-        // If not inside a comment, add the token to the args
-        if (!comment)
+        else if (!failed && command_args_count > 0)
+        {
+            // Start the stage without waiting so every stage runs at once
+            char **envp = command_envp(assignments, assignment_count);
+            pids[i] = execute_command(command_args, envp, &plan, unused_fd, job_group);
+            continue;
+        }
+        else
         {
-            if (inside_double_quote)
+            // Nothing to start, but a command of only assignments sets
+            // shell variables, unless it is one stage of several or runs
+            // in the background, as those would be run in a subshell,
+            if (!failed && num_pipes == 0 && !background)
             {
-                // Remove quotes from the token
-                if (token[0] == '"')
+                for (int j = 0; j < assignment_count; j++)
                 {
-                    memmove(token, token + 1, strlen(token));
-                    // Check if the last character is a quote and remove it
-                    if (token[strlen(token) - 1] == '"')
-                    {
-                        token[strlen(token) - 1] = '\0';
-                        inside_double_quote = !inside_double_quote;
-                    }
+                    set_variable_entry(assignments[j], 0);
                 }
+            }
+            // and the status is that of the last command substitution
+            pids[i] = failed ? -1 : -stages[i].status;
+        }
 
-                args[arg_count] = token;
-                while (inside_double_quote)
-                {
-                    int i = 0;
-                    int j = 0;
-                    token = strtok(NULL, " ");
+        // Release the stage's fds, execute_command does this itself
+        close_plan(&plan);
+    }
 
-                    if (token[strlen(token) - 1] == '"')
-                    {
-                        while (args[arg_count][i] != '\0')
-                        {
-                            i++;
-                        }
-                        args[arg_count][i++] = ' ';
-                        while (token[j] != '\0')
-                        {
-                            args[arg_count][i] = token[j];
-                            i++;
-                            j++;
-                        }
-
-                        args[arg_count][strlen(args[arg_count]) - 2] = '\0';
-                        inside_double_quote = !inside_double_quote;
-                        continue;
-                    }
-                    else
-                    {
-                        while (args[arg_count][i] != '\0')
-                        {
-                            i++;
-                        }
-                        args[arg_count][i++] = ' ';
-                        while (token[j] != '\0')
-                        {
-                            args[arg_count][i] = token[j];
-                            i++;
-                            j++;
-                        }
-                        args[arg_count][i] = '\0';
-                    }
-                }
-                arg_count++;
+    // All pipe ends were closed or handed over as the stages were started,
+    // so reap the whole pipeline together
+    for (int i = 0; i < thread_count; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        pids[threads[i].stage] = -threads[i].status;
+    }
+    // Now that nothing more needs them, close the ends of the process
+    // substitutions the pipeline's words started. Outside the background
+    // they are waited for after the pipeline, so they have finished writing
+    // before the next command; the jobs reaping takes care of the others.
+    struct ProcessSubstitution *substitutions = process_substitutions;
+    process_substitutions = outer_substitutions;
+    for (struct ProcessSubstitution *substitution = substitutions; substitution != outer_substitutions; substitution = substitution->next)
+    {
+        close(substitution->fd);
+    }
+    if (background == 0)
+    {
+        long long trace_start = tracing ? trace_now() : 0;
+        if (terminal && group != 0 && !terminal_given)
+        {
+            give_terminal(group);
+        }
+        struct Job *last_job = jobs_tail;
+        last_status = wait_for_pipeline(pids, pipeline->count, usages, group, pipeline->text);
+        if (terminal && group != 0)
+        {
+            give_terminal(getpgrp());
+        }
+        // A pipeline that was stopped may still read what they write, the
+        // jobs reaping takes care of them then
+        for (struct ProcessSubstitution *substitution = substitutions; substitution != outer_substitutions && jobs_tail == last_job; substitution = substitution->next)
+        {
+            waitpid(substitution->pid, NULL, 0);
+        }
+        if (tracing)
+        {
+            trace_span("wait", trace_start, pipeline->text);
+            trace_collect_execs();
+        }
+    }
+    else
+    {
+        // The stages that started make up one job
+        add_background_job(pids, pipeline->count, group, pipeline->text);
+        last_status = 0;
+    }
+    if (timed)
+    {
+        print_times(names, usages, pipeline->count, &started);
+    }
+    trace_children = outer_trace_children;
+}
+
+// Structure for a loop being run by execute_code
+struct LoopFrame
+{
+    int continue_pc;       // where the next iteration starts
+    int end_pc;            // the loop's OP_LOOP_END
+    struct ArenaMark mark; // line arena as it was before the first iteration
+    char **values;         // words a for loop goes over
+    int count;
+    int index;             // next word to use
+    int status;            // status of the last body that finished
+};
+
+// Function to run break or continue, returning where to go next
+// Leaves the loops it breaks out of on the frame stack for the caller to
+// drop; returns -1 if there is no loop to go to.
+int loop_control(struct Instruction *instruction, struct LoopFrame *frames, int *depth)
+{
+    int count;
+    char **args = expand_command(instruction->command, &count);
+    long levels = 1;
+    if (count > 1)
+    {
+        char *end;
+        levels = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1] || levels < 1)
+        {
+            fprintf(stderr, "quash: %s: %s: loop count out of range\n", args[0], args[1]);
+            last_status = 1;
+            return -1;
+        }
+    }
+    last_status = 0;
+    if (*depth == 0)
+    {
+        fprintf(stderr, "quash: %s: only meaningful in a loop\n", args[0]);
+        return -1;
+    }
+    *depth -= levels < *depth ? levels - 1 : *depth - 1;
+    struct LoopFrame *frame = &frames[*depth - 1];
+    frame->status = 0;
+    return instruction->op == OP_BREAK ? frame->end_pc : frame->continue_pc;
+}
+
+// Function to run return [n] in a function
+void return_control(struct Instruction *instruction)
+{
+    int count;
+    char **args = expand_command(instruction->command, &count);
+    if (function_depth == 0)
+    {
+        fprintf(stderr, "quash: return: can only return from a function\n");
+        last_status = 1;
+        return;
+    }
+    if (count > 1)
+    {
+        char *end;
+        long status = strtol(args[1], &end, 10);
+        if (*end != '\0' || end == args[1])
+        {
+            fprintf(stderr, "quash: return: %s: numeric argument required\n", args[1]);
+            status = 2;
+        }
+        last_status = status & 255;
+    }
+    return_requested = 1;
+}
+
+// Function to run compiled code
+// Loops keep their state in a stack of frames, and every iteration releases
+// what the one before allocated from the line arena, so a loop runs in the
+// same memory however many times it goes round.
+void execute_code(struct Code *code)
+{
+    struct LoopFrame *frames = NULL;
+    int depth = 0;
+    if (code->loop_depth > 0)
+    {
+        frames = (struct LoopFrame *)arena_alloc(&line_arena, code->loop_depth * sizeof(struct LoopFrame));
+    }
+
+    int pc = 0;
+    while (pc < code->count && !exit_requested && !return_requested)
+    {
+        struct Instruction *instruction = &code->instructions[pc++];
+        struct LoopFrame *frame = depth > 0 ? &frames[depth - 1] : NULL;
+        switch (instruction->op)
+        {
+        case OP_RUN:
+            run_pipeline(instruction->pipeline, instruction->value);
+            break;
+        case OP_BACKGROUND:
+        {
+            // The whole and-or list runs in the foreground of a forked shell
+            struct FdPlan plan;
+            init_plan(&plan, 0, 1);
+            pid_t group = 0;
+            int outer_trace_children = trace_children;
+            trace_children = 0;
+            pid_t pid = fork_shell_code(instruction->code, NULL, NULL, 0, &plan, -1, &group, instruction->text);
+            trace_children = outer_trace_children;
+            add_background_job(&pid, 1, group, instruction->text);
+            last_status = 0;
+            break;
+        }
+        case OP_JUMP:
+            pc = instruction->target;
+            break;
+        case OP_JUMP_IF_FAIL:
+            if (last_status != 0)
+            {
+                pc = instruction->target;
             }
-            else if (inside_single_quote)
+            break;
+        case OP_JUMP_IF_OK:
+            if (last_status == 0)
             {
-                // Remove quotes from the token
-                if (token[0] == '\'')
-                {
-                    memmove(token, token + 1, strlen(token));
-                    // Check if the last character is a quote and remove it
-                    if (token[strlen(token) - 1] == '\'')
-                    {
-                        token[strlen(token) - 1] = '\0';
-                        inside_single_quote = !inside_single_quote;
-                    }
-                }
-                args[arg_count] = token;
-                while (inside_single_quote)
-                {
-                    int i = 0;
-                    int j = 0;
-                    token = strtok(NULL, " ");
-                    if (token[strlen(token) - 1] == '\'')
-                    {
-                        while (args[arg_count][i] != '\0')
-                        {
-                            i++;
-                        }
-                        args[arg_count][i++] = ' ';
-                        while (token[j] != '\0')
-                        {
-                            args[arg_count][i] = token[j];
-                            i++;
-                            j++;
-                        }
-                        args[arg_count][strlen(args[arg_count]) - 2] = '\0';
-                        inside_single_quote = !inside_single_quote;
-                        continue;
-                    }
-                    else
-                    {
-                        while (args[arg_count][i] != '\0')
-                        {
-                            i++;
-                        }
-                        args[arg_count][i++] = ' ';
-                        while (token[j] != '\0')
-                        {
-                            args[arg_count][i] = token[j];
-                            i++;
-                            j++;
-                        }
-                        args[arg_count][i] = '\0';
-                    }
-                }
-                arg_count++;
+                pc = instruction->target;
+            }
+            break;
+        case OP_SET_STATUS:
+            last_status = instruction->value;
+            break;
+        case OP_LOOP_START:
+        case OP_FOR_START:
+            frame = &frames[depth++];
+            frame->values = NULL;
+            frame->count = 0;
+            if (instruction->op == OP_FOR_START && instruction->command->for_in)
+            {
+                frame->values = expand_command(instruction->command, &frame->count);
             }
-            else
+            else if (instruction->op == OP_FOR_START)
             {
-                args[arg_count++] = token;
+                frame->values = positional_args;
+                frame->count = positional_count;
             }
-        }
-        else
+            frame->index = 0;
+            frame->status = 0;
+            frame->continue_pc = pc;
+            frame->end_pc = instruction->target;
+            frame->mark = arena_mark(&line_arena);
+            break;
+        case OP_LOOP_TOP:
+            arena_release(&line_arena, frame->mark);
+            break;
+        case OP_FOR_NEXT:
+            arena_release(&line_arena, frame->mark);
+            if (frame->index == frame->count)
+            {
+                pc = instruction->target;
+                break;
+            }
+            set_variable(instruction->command->name, frame->values[frame->index++], 0);
+            break;
+        case OP_LOOP_STATUS:
+            frame->status = last_status;
+            break;
+        case OP_LOOP_END:
+            last_status = frame->status;
+            depth--;
+            break;
+        case OP_DEFINE:
+            define_function(instruction->command->name, instruction->code);
+            last_status = 0;
+            break;
+        case OP_BREAK:
+        case OP_CONTINUE:
         {
-            // If inside a comment, break to stop further processing
+            int next = loop_control(instruction, frames, &depth);
+            if (next >= 0)
+            {
+                pc = next;
+            }
+            break;
+        }
+        case OP_RETURN:
+            return_control(instruction);
             break;
         }
-
-        // Get the next token
-        token = strtok(NULL, " ");
     }
-
-    // Ensure the last element is NULL to indicate the end of the argument list
-    args[arg_count] = NULL;
-    return arg_count;
 }
 
-int main()
+// Results of read_command
+enum ReadResult
 {
-    // hold input data in this and a copy for job creation
-    char input[MAX_COMMAND_LENGTH];
-    char input_copy[MAX_COMMAND_LENGTH];
-    // save stdin and out file descriptors so we can reuse them
-    int saved_stdout = dup(1);
-    int saved_stdin = dup(0);
-    // define a string of all the built in commands to check for them later
-    char *builtin = " echo export cd pwd quit exit jobs kill ";
-    // start command
-    printf("Welcome...\n");
+    READ_OK,
+    READ_ERROR,      // a syntax error was reported
+    READ_EOF,
+    READ_INTERRUPTED // Ctrl-C dropped what was typed
+};
 
+// Function to read and parse the next complete command from an input source
+// Whole lines are buffered before parsing. If the command turns out to go
+// on past the buffered text (an open quote, a trailing |, a \ at the end of
+// a line) more is read and the command is parsed again from its start.
+enum ReadResult read_command(struct InputSource *source, struct Arena *arena, struct ListItem **list)
+{
+    size_t scan_from = 0; // offset from pos where a new newline has to appear
     while (1)
     {
-        // reset stdin and out if they got messed up
-        if (dup2(saved_stdin, 0) == -1)
-        {
-            perror("dup2");
-            exit(EXIT_FAILURE);
-        }
-
-        if (dup2(saved_stdout, 1) == -1)
+        while (!source->eof && memchr(source->data + source->pos + scan_from, '\n', source->length - source->pos - scan_from) == NULL)
         {
-            perror("dup2");
-            exit(EXIT_FAILURE);
+            size_t buffered = source->length - source->pos;
+            fill_input(source, scan_from ? "> " : "[QUASH]$ ");
+            if (source->interrupted)
+            {
+                source->interrupted = 0;
+                return READ_INTERRUPTED;
+            }
+            scan_from = buffered;
         }
-
-        // update background jobs to see if any finished
-        update_jobs_status();
-        // clean stdout so input isn't messed up accidentally
-        fflush(stdout);
-        // Here we go boys
-        printf("[QUASH]$ ");
-
-        // Read user input
-        if (fgets(input, sizeof(input), stdin) == NULL)
+        if (source->pos == source->length)
         {
-            perror("fgets");
-            exit(EXIT_FAILURE);
+            return READ_EOF;
         }
 
-        // Remove the newline character at the end
-        input[strcspn(input, "\n")] = '\0';
-
-        if (input[0] == '\0')
+        char *end;
+        const char *reason;
+        long long trace_start = tracing ? trace_now() : 0;
+        enum ParseResult result = parse_input(source->data + source->pos, arena, list, &end, &reason);
+        if (tracing)
         {
-            continue;
+            trace_span("parse", trace_start, NULL);
         }
-        // copy input to copy for use in job
-        strcpy(input_copy, input);
-
-        // Tokenize the user input into arguments, handling comments and quoted sections
-        // arguments will be held in args
-        char *args[MAX_ARGUMENTS];
-        // number of arguments found
-        int arg_count = 0;
-        // if the command should run in the background
-        int background = 0;
-
-        // tokenize the string into arguments, this returns the number of arguments found
-        // input is expanded so evnironment varibales are expanded, still don't know whether they want the full value for jobs, but too late.
-        arg_count = tokenize_input(expand_environment_variables(input), args, arg_count);
-
-        // if there is more than one argument
-        if (arg_count > 1)
+        if (result == PARSE_INCOMPLETE && !source->eof && (reason != NULL || end == source->data + source->length))
         {
-            // check if the last argument is the background symbol
-            if (strcmp(args[arg_count - 1], "&") == 0)
+            // Read another line and try again
+            if (interactive)
             {
-                // if it is, say its background, get rid of the symbol, and correct the arg count
-                background = 1;
-                args[arg_count - 1] = '\0';
-                arg_count -= 1;
+                printf("> ");
+                prompt_pending = 1;
             }
-        }
-
-        // if there are no arguments, go back to the start
-        if (arg_count == 0)
-        {
+            scan_from = source->length - source->pos;
             continue;
         }
 
-        int done = 0;
-        // if the first argument is quit or exit, end the process byt setting the done value
-        if ((strcmp(args[0], "quit") == 0) || (strcmp(args[0], "exit") == 0))
+        source->pos = end - source->data;
+        if (result == PARSE_ERROR)
         {
-            // if there is another command then complain and contiue
-            if (args[1] != NULL)
-            {
-                printf("%s does not require additional arguments\n", args[0]);
-                continue;
-            }
-            // otherwise set done
-            else
-            {
-                done = 1;
-            }
+            return READ_ERROR;
         }
-        // if done flag is set, then end the while loop
-        if (done == 1)
+        if (result == PARSE_INCOMPLETE && reason != NULL)
         {
-            break;
+            fprintf(stderr, "quash: syntax error: %s\n", reason);
+            source->pos = source->length;
+            return READ_ERROR;
         }
+        return READ_OK;
+    }
+}
 
-        // Check for pipe symbols
-        int pipe_positions[MAX_ARGUMENTS]; // To store positions of pipe symbols
-        int num_pipes = 0;                 // number of pipes found
-        int redirected = 0;                // if the command was redirected by pipes so its not run twice
+int serve_fd = -1; // Connection of the request a --serve worker is running, -1 otherwise
 
-        // check all the arguments
-        for (int i = 0; i < arg_count; i++)
-        {
-            if (strcmp(args[i], "|") == 0)
-            { // if its a pipe
-                if (num_pipes < MAX_ARGUMENTS)
-                {
-                    pipe_positions[num_pipes] = i; // set index as a pipe position
-                    num_pipes++;                   // increase number of pipes
-                }
-                else
-                {
-                    fprintf(stderr, "Too many pipes in the command\n"); // otherwise complain about it
-                    exit(EXIT_FAILURE);                                 // and exit
-                }
-            }
-        }
+#define SERVE_RETRY_MIN_MS 10   // First wait of a --serve worker before it tries a failed accept again
+#define SERVE_RETRY_MAX_MS 1000 // Longest such wait, it doubles up to this
 
-        if (num_pipes > 0)
-        {                   // if there are pipes
-            redirected = 1; // say this is redirected so its not done again
-            // Handle piped commands
-            int pipes_fd[num_pipes][2]; // create num_pipes pipes
-            int command_start = 0;      // refrence for where pipe starts
-            int command_end = 0;        // the end
+// Function to read a --serve request from a new connection and set the worker up to run it
+// The client's stdin, stdout and stderr become the worker's own, so the
+// output streams straight to the client without going through the daemon.
+// The worker then has the request's directory and exactly its environment,
+// and its command text as input, the way quash -c would. Returns 0, or -1
+// if the request cannot be run.
+int take_request(int client, struct InputSource *source)
+{
+    struct ServeRequest request;
+    struct iovec iov = {&request, sizeof(request)};
+    struct msghdr message;
+    union
+    {
+        char data[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+    ssize_t count = recvmsg(client, &message, MSG_CMSG_CLOEXEC);
 
-            for (int i = 0; i <= num_pipes; i++)
+    // Only the first three fds are kept, any more a client sends are closed
+    int fds[3];
+    int received = 0;
+    for (struct cmsghdr *header = count >= 0 ? CMSG_FIRSTHDR(&message) : NULL; header != NULL; header = CMSG_NXTHDR(&message, header))
+    {
+        if (header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS)
+        {
+            int *data = (int *)CMSG_DATA(header);
+            int header_fds = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for (int i = 0; i < header_fds; i++)
             {
-                if (i < num_pipes)
+                int fd;
+                memcpy(&fd, data + i, sizeof(fd));
+                if (received < 3)
                 {
-                    command_end = pipe_positions[i];
+                    fds[received++] = fd;
                 }
                 else
                 {
-                    command_end = arg_count;
+                    close(fd);
                 }
+            }
+        }
+    }
+    char *strings = NULL;
+    if (count > 0 && read_exact(client, (char *)&request + count, sizeof(request) - count) && request.magic == SERVE_MAGIC && request.length <= SERVE_REQUEST_MAX && received == 3)
+    {
+        strings = (char *)malloc(request.length + 1);
+    }
+    if (strings == NULL || !read_exact(client, strings, request.length))
+    {
+        free(strings);
+        for (int i = 0; i < received; i++)
+        {
+            close(fds[i]);
+        }
+        return -1;
+    }
+    strings[request.length] = '\0';
 
-                char *command_args[MAX_ARGUMENTS];
-                int command_args_count = 0;
-
-                for (int j = command_start; j < command_end; j++)
-                {
-                    command_args[command_args_count] = args[j];
-                    command_args_count++;
-                }
+    // Moved above 2 first, so no fd is overwritten before it is in place
+    for (int fd = 0; fd < 3; fd++)
+    {
+        fds[fd] = move_fd_high(fds[fd]);
+    }
+    for (int fd = 0; fd < 3; fd++)
+    {
+        dup2(fds[fd], fd);
+        close(fds[fd]);
+    }
 
-                command_args[command_args_count] = NULL;
+    char *end = strings + request.length;
+    char *directory = strings;
+    char *command = directory + strlen(directory) + 1;
+    if (command >= end || chdir(directory) == -1)
+    {
+        fprintf(stderr, "quash: --serve: %s: %s\n", directory, command >= end ? "bad request" : strerror(errno));
+        free(strings);
+        return -1;
+    }
+    free_variables();
+    for (char *entry = command + strlen(command) + 1; entry < end; entry += strlen(entry) + 1)
+    {
+        if (strchr(entry, '=') != NULL)
+        {
+            set_variable_entry(entry, 1);
+        }
+    }
+    open_string_input(source, command);
+    free(strings);
+    return 0;
+}
 
-                if (i < num_pipes)
-                {
-                    if (pipe(pipes_fd[i]) == -1)
-                    {
-                        perror("pipe");
-                        exit(EXIT_FAILURE);
-                    }
-                }
-                int redirect_in = 0;  // File descriptor for input redirection
-                int redirect_out = 1; // File descriptor for output redirection
+// Function to tell the client of a --serve request how its command ended
+void finish_request(int status)
+{
+    fflush(stdout);
+    fflush(stderr);
+    struct ServeReply reply = {status};
+    if (write_all(serve_fd, (const char *)&reply, sizeof(reply)) != 0)
+    {
+        // The client went away, there is no one left to tell
+    }
+    close(serve_fd);
+    serve_fd = -1;
+}
 
-                for (int i = 0; i < command_args_count; i++)
-                {
-                    if (strcmp(command_args[i], ">") == 0)
-                    {
-                        if (args[i + 1] != NULL)
-                        {
-                            redirect_out = open(command_args[i + 1], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                            if (redirect_out == -1)
-                            {
-                                perror("open");
-                                exit(EXIT_FAILURE);
-                            }
-                            // Terminate the command before redirection
-                            command_args[i] = NULL;
-                            command_args[i + 1] = NULL;
-                            command_args_count--;
-                            command_args_count--;
-                            break;
-                        }
-                        else
-                        {
-                            fprintf(stderr, "Missing filename for output redirection\n");
-                            break;
-                        }
-                    }
-                    else if (strcmp(command_args[i], ">>") == 0)
-                    {
-                        if (command_args[i + 1] != NULL)
-                        {
-                            redirect_out = open(command_args[i + 1], O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                            if (redirect_out == -1)
-                            {
-                                perror("open");
-                                exit(EXIT_FAILURE);
-                            }
-                            // Terminate the command before redirection
-                            command_args[i] = NULL;
-                            command_args[i + 1] = NULL;
-                            command_args_count--;
-                            command_args_count--;
-                            break;
-                        }
-                        else
-                        {
-                            fprintf(stderr, "Missing filename for output redirection\n");
-                            break;
-                        }
-                    }
-                    else if (strcmp(command_args[i], "<") == 0)
-                    {
-                        if (command_args[i + 1] != NULL)
-                        {
-                            redirect_in = open(command_args[i + 1], O_RDONLY);
-                            if (redirect_in == -1)
-                            {
-                                perror("open");
-                                exit(EXIT_FAILURE);
-                            }
-                            // Terminate the command before redirection
-                            command_args[i] = NULL;
-                            command_args[i + 1] = NULL;
-                            command_args_count--;
-                            command_args_count--;
-                        }
-                        else
-                        {
-                            fprintf(stderr, "Missing filename for input redirection\n");
-                            break;
-                        }
-                    }
-                }
+// Function to run quash --serve: listen on a Unix socket and keep a pool of workers taking requests from it
+// Each worker is a fork of the daemon, so it starts with the shell already
+// set up and has nothing left to do but accept a connection and run it. A
+// worker runs one request and exits, which leaves nothing of one request's
+// directory, variables or functions to the next, and the daemon forks a
+// fresh one in its place while the others go on taking requests. At most workers
+// requests run at once, more wait in the listen backlog. A worker whose
+// accept fails, as when the fds run out, waits and tries again rather than
+// exiting: a fresh worker would only fail the same way, and the daemon
+// would spin forking them. The zygote is not
+// used, as what it starts would be children of the daemon rather than of the
+// worker waiting for them. Returns only in a worker, once it has a request.
+void serve(const char *path, long workers, struct InputSource *source)
+{
+    if (zygote_fd != -1)
+    {
+        stop_zygote();
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "quash: --serve: %s: path too long\n", path);
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, path);
+    struct stat info;
+    if (lstat(path, &info) == 0)
+    {
+        // Only a socket no daemon answers on any more is taken over
+        if (!S_ISSOCK(info.st_mode))
+        {
+            fprintf(stderr, "quash: --serve: %s: exists and is not a socket\n", path);
+            exit(EXIT_FAILURE);
+        }
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        int answered = probe != -1 && connect(probe, (struct sockaddr *)&address, sizeof(address)) == 0;
+        if (answered || errno != ECONNREFUSED)
+        {
+            fprintf(stderr, "quash: --serve: %s: %s\n", path, answered ? "a daemon is already running on it" : strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+        close(probe);
+        // Left behind by a daemon that did not get to remove it
+        unlink(path);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd == -1 || bind(listen_fd, (struct sockaddr *)&address, sizeof(address)) == -1 || listen(listen_fd, SOMAXCONN) == -1)
+    {
+        perror(path);
+        exit(EXIT_FAILURE);
+    }
+    listen_fd = move_fd_high(listen_fd);
 
-                if (i == 0)
-                {
-                    // For the first command, set the input to stdin
-                    if (strstr(builtin, command_args[0]) != NULL)
-                    {
-                        handle_builtin(command_args, redirect_in, pipes_fd[i][1], 3);
-                    }
-                    else
-                    {
-                        execute_command(command_args, redirect_in, pipes_fd[i][1], 0, background, 1, input_copy);
-                    }
-                }
-                else if (i == num_pipes)
-                {
-                    // For the last command, set the output to stdout
-                    if (strstr(builtin, command_args[0]) != NULL)
-                    {
-                        handle_builtin(args, pipes_fd[i - 1][0], redirect_out, 4);
-                    }
-                    else
-                    {
-                        execute_command(command_args, pipes_fd[i - 1][0], redirect_out, 1, background, 0, input_copy);
-                    }
-                }
-                else
+    pid_t *pool = (pid_t *)calloc(workers, sizeof(pid_t));
+    if (pool == NULL)
+    {
+        perror("calloc");
+        exit(EXIT_FAILURE);
+    }
+    while (1)
+    {
+        for (long i = 0; i < workers; i++)
+        {
+            if (pool[i] != 0)
+            {
+                continue;
+            }
+            pool[i] = fork();
+            if (pool[i] == -1)
+            {
+                perror("fork");
+                pool[i] = 0;
+                break;
+            }
+            if (pool[i] == 0)
+            {
+                // The worker's children are its own to wait for, so it
+                // needs a SIGCHLD pipe no other worker writes to
+                free(pool);
+                close(sigchld_pipe[0]);
+                close(sigchld_pipe[1]);
+                setup_sigchld();
+                int client;
+                int delay = 0;
+                while ((client = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC)) == -1)
                 {
-                    // For intermediate commands, set both input and output
-                    if (strstr(builtin, command_args[0]) != NULL)
+                    if (errno == EINTR || errno == ECONNABORTED)
                     {
-                        handle_builtin(args, pipes_fd[i - 1][0], pipes_fd[i][1], 5);
+                        continue;
                     }
-                    else
+                    // Reported once, not on every try while it lasts
+                    if (delay == 0)
                     {
-                        execute_command(command_args, pipes_fd[i - 1][0], pipes_fd[i][1], 0, background, 0, input_copy);
+                        perror("accept");
                     }
+                    delay = delay == 0 ? SERVE_RETRY_MIN_MS : delay * 2;
+                    delay = delay > SERVE_RETRY_MAX_MS ? SERVE_RETRY_MAX_MS : delay;
+                    poll(NULL, 0, delay);
                 }
-                if (redirect_in > 0)
-                {
-                    close(redirect_in);
-                }
-                if (redirect_out > 1)
+                close(listen_fd);
+                serve_fd = move_fd_high(client);
+                if (take_request(serve_fd, source) == -1)
                 {
-                    close(redirect_out);
+                    finish_request(2);
+                    _exit(EXIT_FAILURE);
                 }
-                command_start = command_end + 1;
+                return;
             }
-            for (size_t i = 0; i < num_pipes; i++)
+        }
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid == -1 && errno != EINTR)
+        {
+            perror("waitpid");
+            exit(EXIT_FAILURE);
+        }
+        for (long i = 0; i < workers; i++)
+        {
+            if (pool[i] == pid)
             {
-                // Close the pipe file descriptors
-                close(pipes_fd[i][0]);
-                close(pipes_fd[i][1]);
+                pool[i] = 0;
             }
         }
-        else
+    }
+}
+
+int main(int argc, char **argv)
+{
+    // commands come from a -c string, a script file, stdin or --serve requests
+    struct InputSource source;
+    const char *serve_path = NULL;
+    long serve_workers = 0;
+    if (argc > 2 && strcmp(argv[1], "-c") == 0)
+    {
+        open_string_input(&source, argv[2]);
+        if (argc > 3)
+        {
+            shell_name = argv[3];
+            positional_args = argv + 4;
+            positional_count = argc - 4;
+        }
+    }
+    else if (argc > 1 && strcmp(argv[1], "-c") == 0)
+    {
+        fprintf(stderr, "quash: -c: option requires an argument\n");
+        return 2;
+    }
+    else if (argc > 1 && strcmp(argv[1], "--serve") == 0)
+    {
+        // quash --serve SOCKET [WORKERS]: commands come from the requests
+        // the workers take, one worker per online CPU by default
+        if (argc < 3)
+        {
+            fprintf(stderr, "quash: --serve: option requires a socket path\n");
+            return 2;
+        }
+        serve_path = argv[2];
+        serve_workers = sysconf(_SC_NPROCESSORS_ONLN);
+        char *end = NULL;
+        if (argc > 3 && ((serve_workers = strtol(argv[3], &end, 10)) < 1 || *end != '\0'))
         {
-            // If there are no pipes, execute the command as usual
-            int redirect_in = 0;  // File descriptor for input redirection
-            int redirect_out = 1; // File descriptor for output redirection
+            fprintf(stderr, "quash: --serve: %s: invalid worker count\n", argv[3]);
+            return 2;
+        }
+        if (serve_workers < 1)
+        {
+            serve_workers = 1;
+        }
+    }
+    else if (argc > 1)
+    {
+        int fd = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+        {
+            perror(argv[1]);
+            return 127;
+        }
+        open_input(&source, move_fd_high(fd));
+        shell_name = argv[1];
+        positional_args = argv + 2;
+        positional_count = argc - 2;
+    }
+    else
+    {
+        open_input(&source, 0);
+        interactive = isatty(0);
+    }
 
-            for (int i = 0; i < arg_count; i++)
-            {
-                int index = i + 1;
-                if (strcmp(args[i], ">") == 0)
-                {
-                    if (args[i + 1] != NULL)
-                    {
-                        redirect_out = open(args[index], O_WRONLY | O_TRUNC | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                        if (redirect_out == -1)
-                        {
-                            perror("open");
-                            exit(EXIT_FAILURE);
-                        }
-                        // Terminate the command before redirection
-                        args[i] = NULL;
-                        args[i + 1] = NULL;
-                        break;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Missing filename for output redirection\n");
-                        break;
-                    }
-                }
-                else if (strcmp(args[i], ">>") == 0)
-                {
-                    if (args[i + 1] != NULL)
-                    {
-                        redirect_out = open(args[i + 1], O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
-                        if (redirect_out == -1)
-                        {
-                            perror("open");
-                            exit(EXIT_FAILURE);
-                        }
-                        // Terminate the command before redirection
-                        args[i] = NULL;
-                        args[i + 1] = NULL;
-                        break;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Missing filename for output redirection\n");
-                        break;
-                    }
-                }
-                else if (strcmp(args[i], "<") == 0)
-                {
-                    if (args[i + 1] != NULL)
-                    {
-                        redirect_in = open(args[i + 1], O_RDONLY);
-                        if (redirect_in == -1)
-                        {
-                            perror("open");
-                            exit(EXIT_FAILURE);
-                        }
-                        // Terminate the command before redirection
-                        args[i] = NULL;
-                        args[i + 1] = NULL;
-                        i++;
-                    }
-                    else
-                    {
-                        fprintf(stderr, "Missing filename for input redirection\n");
-                        break;
-                    }
-                }
-            }
+    // the environment becomes the shell's exported variables
+    import_environment();
+    // QUASH_ZYGOTE=1 starts commands from a copy of the shell made now,
+    // while it is still small and has no signals of its own set up
+    char *zygote = lookup_variable("QUASH_ZYGOTE");
+    if (zygote != NULL && strcmp(zygote, "1") == 0)
+    {
+        start_zygote();
+    }
+    // QUASH_TRACE=file records where the time goes, phase by phase
+    char *trace_path = lookup_variable("QUASH_TRACE");
+    if (trace_path != NULL && *trace_path != '\0')
+    {
+        setup_tracing(trace_path);
+    }
+    // find builtins by name in O(1)
+    setup_builtins();
+    // reap background jobs as they exit, and in a terminal leave Ctrl-C
+    // and Ctrl-Z to the command in the foreground
+    setup_signals();
+    // children get the default SIGPIPE back, the shell itself ignores it
+    setup_spawn_attributes(&spawn_attributes, -1);
+    signal(SIGPIPE, SIG_IGN);
+    // a --serve daemon only comes back from here in a worker with a request
+    if (serve_path != NULL)
+    {
+        serve(serve_path, serve_workers, &source);
+    }
+    // start command
+    if (interactive)
+    {
+        printf("Welcome...\n");
+    }
 
-            // Execute the command
-            if (redirected == 0)
+    // each command is parsed and compiled into this arena
+    struct SharedArena *command_arena = shared_arena_new();
+    while (!exit_requested)
+    {
+        // everything the previous command allocated goes away here in one
+        // step, except the parse tree and code of the functions it defined
+        arena_reset(&line_arena);
+        if (command_arena->references > 1)
+        {
+            shared_arena_release(command_arena);
+            command_arena = shared_arena_new();
+        }
+        else
+        {
+            arena_reset(&command_arena->arena);
+        }
+
+        // update background jobs to see if any finished
+        update_jobs_status();
+        if (interactive)
+        {
+            // A Ctrl-C that went to the last command is not for the
+            // prompt, but the prompt goes on a line of its own
+            read_signals();
+            if (interrupt_pending)
             {
-                if (strstr(builtin, args[0]) != NULL)
-                {
-                    handle_builtin(args, redirect_in, redirect_out, 0);
-                }
-                else
-                {
-                    execute_command(args, redirect_in, redirect_out, 1, background, 1, input_copy);
-                }
+                printf("\n");
+                interrupt_pending = 0;
             }
+            // Here we go boys
+            printf("[QUASH]$ ");
+            prompt_pending = 1;
+        }
 
-            if (redirect_in > 0)
+        // Read and parse the next command into a list of pipelines
+        struct ListItem *list;
+        enum ReadResult result = read_command(&source, &command_arena->arena, &list);
+        prompt_pending = 0;
+        if (result == READ_EOF)
+        {
+            if (interactive)
             {
-                close(redirect_in);
+                printf("\n");
             }
-            if (redirect_out > 1)
+            break;
+        }
+        if (result == READ_INTERRUPTED)
+        {
+            last_status = 130;
+            continue;
+        }
+        if (result == READ_ERROR)
+        {
+            last_status = 2;
+            if (!interactive)
             {
-                close(redirect_out);
+                // A script with a syntax error is not run any further
+                break;
             }
+            continue;
         }
+        // Compile it once and run the code; loops and functions in it run
+        // their instructions again without going back to the parse tree
+        struct Code *code = new_code(command_arena);
+        compile_list(code, list);
+        execute_code(code);
+        // clean stdout so output from the shell and its children stays in order
+        fflush(stdout);
     }
 
-    close(saved_stdin);
-    close(saved_stdout);
+    if (source.fd > 0)
+    {
+        close(source.fd);
+    }
     update_jobs_status();
+    if (serve_fd != -1)
+    {
+        finish_request(last_status);
+    }
 
-    struct Job *job = jobs_list;
-    while (job != NULL)
+    if (tracing)
     {
-        struct Job *next = job->next;
-        free(job);
-        job = next;
+        finish_tracing();
     }
+    free_jobs_table();
+    free(deadlines);
+    free_functions();
+    shared_arena_release(command_arena);
+    free_variables();
+    hash_clear();
+    arena_free(&line_arena);
+    free(field_buffer.data);
+    free(capture_buffer.data);
+    free(literal_buffer.data);
+    free(argv_builder.items);
+    free(source.data);
 
-    return 0;
-}
\ No newline at end of file
+    return last_status;
+}
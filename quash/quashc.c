@@ -0,0 +1,150 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "serve.h"
+
+// quashc SOCKET COMMAND...
+// Runs COMMAND on a quash --serve daemon listening on SOCKET. The arguments
+// are joined with spaces into one command line, as sh -c "$*" would see
+// them. The command gets this process's stdin, stdout, stderr, directory
+// and environment, and quashc exits with its status.
+
+extern char **environ; // Sent along with the request
+
+// Function to write a whole buffer, returns 0 or the errno of the failed write
+int write_all(int fd, const char *data, size_t length)
+{
+    while (length > 0)
+    {
+        ssize_t count = write(fd, data, length);
+        if (count == -1 && errno != EINTR)
+        {
+            return errno;
+        }
+        if (count > 0)
+        {
+            data += count;
+            length -= count;
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        fprintf(stderr, "usage: quashc SOCKET COMMAND...\n");
+        return 2;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(argv[1]) >= sizeof(address.sun_path))
+    {
+        fprintf(stderr, "quashc: %s: path too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(address.sun_path, argv[1]);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (struct sockaddr *)&address, sizeof(address)) == -1)
+    {
+        perror(argv[1]);
+        return 255;
+    }
+
+    // The strings are measured first, so the header can go at the front of
+    // the one buffer and the request be sent with one write
+    char directory[PATH_MAX];
+    if (getcwd(directory, sizeof(directory)) == NULL)
+    {
+        perror("getcwd");
+        return 255;
+    }
+    struct ServeRequest request = {SERVE_MAGIC, strlen(directory) + 1};
+    for (int i = 2; i < argc; i++)
+    {
+        request.length += strlen(argv[i]) + 1;
+    }
+    for (char **env = environ; *env != NULL; env++)
+    {
+        request.length += strlen(*env) + 1;
+    }
+    size_t length = sizeof(request) + request.length;
+    char *buffer = (char *)malloc(length);
+    if (buffer == NULL)
+    {
+        perror("malloc");
+        return 255;
+    }
+    memcpy(buffer, &request, sizeof(request));
+    char *end = stpcpy(buffer + sizeof(request), directory) + 1;
+    for (int i = 2; i < argc; i++)
+    {
+        // The words are joined with spaces, the last one ends the command
+        end = stpcpy(end, argv[i]);
+        *end++ = i + 1 < argc ? ' ' : '\0';
+    }
+    for (char **env = environ; *env != NULL; env++)
+    {
+        end = stpcpy(end, *env) + 1;
+    }
+
+    // stdin, stdout and stderr go with the first part of the request
+    int fds[3] = {0, 1, 2};
+    union
+    {
+        char data[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {buffer, length};
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+    struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+    header->cmsg_level = SOL_SOCKET;
+    header->cmsg_type = SCM_RIGHTS;
+    header->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(header), fds, sizeof(fds));
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+    } while (sent == -1 && errno == EINTR);
+    if (sent == -1 || write_all(fd, buffer + sent, length - sent) != 0)
+    {
+        perror("quashc: send");
+        return 255;
+    }
+    free(buffer);
+
+    // The output has already gone straight to our fds, only the status comes back
+    struct ServeReply reply;
+    size_t done = 0;
+    while (done < sizeof(reply))
+    {
+        ssize_t count = read(fd, (char *)&reply + done, sizeof(reply) - done);
+        if (count == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            fprintf(stderr, "quashc: the daemon did not answer\n");
+            return 255;
+        }
+        done += count;
+    }
+    close(fd);
+    return reply.status;
+}
@@ -0,0 +1,27 @@
+#ifndef QUASH_SERVE_H
+#define QUASH_SERVE_H
+
+#include <stddef.h>
+
+// The protocol quash --serve and quashc speak over a Unix socket
+
+#define SERVE_MAGIC 0x71617368       // "qash", first field of every --serve request
+#define SERVE_REQUEST_MAX (16 << 20) // Most bytes of strings one --serve request may send
+
+// Structure for the header of a request to quash --serve
+// The client sends it with its stdin, stdout and stderr attached as
+// SCM_RIGHTS, followed by length bytes of strings each ending in a NUL:
+// the directory to run in, the command text, then the environment.
+struct ServeRequest
+{
+    unsigned int magic;
+    size_t length;
+};
+
+// Structure for the answer to a --serve request, sent once the command is done
+struct ServeReply
+{
+    int status; // what the shell would have exited with
+};
+
+#endif
@@ -0,0 +1,295 @@
+#!/bin/sh
+# Regression tests: each case feeds a few lines to quash on its standard
+# input, in a scratch directory, and compares everything it prints with what
+# it should. The banner, prompts and job notices an interactive quash prints
+# are left out of the comparison.
+# Usage: ./tests.sh [path to quash]
+
+QUASH=$(cd "$(dirname "${1:-./quash}")" && pwd)/$(basename "${1:-./quash}")
+QUASHC=${QUASHC:-$(dirname "$QUASH")/quashc}
+DIR=$(mktemp -d)
+trap 'rm -rf "$DIR"' EXIT
+passed=0
+failed=0
+
+# check NAME EXPECTED LINES
+check()
+{
+    actual=$(cd "$DIR" && printf '%s\nexit\n' "$3" | timeout 10 "$QUASH" 2>&1 |
+        sed -e '/^Welcome\.\.\.$/d' -e 's/\[QUASH\]\$ //g' -e '/^Background job started: /d' -e '/^Completed: /d')
+    if [ "$actual" = "$2" ]; then
+        passed=$((passed + 1))
+    else
+        failed=$((failed + 1))
+        printf 'FAIL %s\n--- expected\n%s\n--- actual\n%s\n' "$1" "$2" "$actual"
+    fi
+}
+
+# every stage of a pipeline runs at once, so a stage can write more than a
+# pipe holds before the next one reads it
+check "pipeline larger than a pipe buffer" "100000" "seq 100000 | wc -l"
+check "three stage pipeline" "1" "seq 3 | sort -r | tail -n 1"
+
+# commands started with posix_spawn get their redirections and environment
+check "spawned command redirections" "$(printf 'out\n2')" "/bin/echo out > f
+/bin/cat < f
+/bin/echo more >> f
+wc -l < f"
+check "spawned command environment" "FOO=bar" "export FOO=bar
+env | grep ^FOO="
+
+# command locations are remembered until hash -r
+check "hash remembers a command" "2" "wc -l < /dev/null > /dev/null
+hash | wc -l"
+check "hash -r forgets" "hash: hash table empty" "wc -l < /dev/null > /dev/null
+hash -r
+hash"
+check "unknown command" "nosuchcommand: command not found" "nosuchcommand"
+
+# a script keeps a finished job until jobs has seen it
+check "finished job is kept for jobs" "1
+0" "sleep 0.1 &
+sleep 0.3
+jobs | wc -l
+jobs > /dev/null
+jobs | wc -l"
+
+# jobs are found by number through the job table
+check "jobs lists every job" "2" "sleep 5 &
+sleep 5 &
+jobs | wc -l
+kill 9 %1
+kill 9 %2"
+check "kill of a job that does not exist" "kill: %7: no such job" "kill 9 %7"
+
+# lines and argument lists have no fixed limit
+check "many arguments" "500" "/bin/echo $(seq 500 | tr '\n' ' ') | wc -w"
+check "long argument" "3001" "/bin/echo $(printf '%03000d' 0) | wc -c"
+check "long variable" "2006" "export LONG=$(printf '%02000d' 0)
+env | grep ^LONG= | wc -c"
+
+# words are split by one lexer that knows quotes and operators
+check "quoted words" "a   b c  \$d ef gh" "/bin/echo \"a   b\" 'c  \$d' e\"f g\"h"
+check "escaped quotes" "it's \"q\"" "/bin/echo it\\'s \\\"q\\\""
+check "operators need no spaces" "y" "/bin/echo x|tr x y"
+check "redirection needs no spaces" "a" "/bin/echo a>f
+/bin/cat<f"
+check "unterminated quote" "quash: syntax error: unterminated quote" "/bin/echo \"unterminated"
+
+# scripts run from a file, -c or standard input without the banner and prompts
+printf '/bin/echo one\n/bin/echo two\nexit 4\n/bin/echo not reached\n' > "$DIR/script.sh"
+check "script file" "$(printf 'one\ntwo\n4')" "$QUASH script.sh
+/bin/echo \$?"
+check "-c" "from -c" "$QUASH -c '/bin/echo from -c'"
+check "-c exit status" "3" "$QUASH -c 'exit 3'
+/bin/echo \$?"
+check "no prompt on standard input" "6" "printf '/bin/echo piped\\n' | $QUASH | wc -c"
+
+# builtins are found by exact name and run inside the shell in pipelines
+check "no builtin by a prefix" "ec: command not found" "ec hi"
+check "builtin in a pipeline" "HI THERE" "echo hi there | tr a-z A-Z"
+check "builtin output redirected" "$(printf 'a\nb')" "echo a > f
+echo b >> f
+/bin/cat f"
+check "cd in a pipeline leaves the shell" "/" "cd /
+echo x | cd /tmp
+pwd"
+
+# shell variables stay in the shell until they are exported
+check "unexported variable" "$(printf 'local\n0')" "x=local
+echo \$x
+env | grep -c ^x="
+check "export" "$(printf 'x=local\n2local')" "x=local
+export x
+env | grep ^x=
+export y=2
+echo \$y\$x"
+check "unset" "[]" "x=1
+unset x
+echo [\$x]"
+check "command assignments" "$(printf 'z=9\n[]')" "z=9 env | grep ^z=
+echo [\$z]"
+
+# lists run in order, && and || on the status of what came before
+check "and-or lists" "$(printf 'yes\nno\n1')" "true && echo yes || echo no; false && echo yes || echo no
+false; echo \$?"
+check "parallel runs every item" "$(printf 'a\nb\nc')" "parallel -j 2 echo ::: a b c | sort"
+check "parallel keeps -j running at once" "$(printf 'start\nstart\nend\nend')" \
+    "parallel -j 2 sh -c 'echo start; sleep 0.3; echo end' ::: 1 2"
+check "parallel counts failures" "failed=2" "parallel -j 2 sh -c 'exit \$0' ::: 0 1 0 1; echo failed=\$?"
+
+# time reports the whole pipeline, then every stage
+check "time" "$(printf '\nreal\nuser\nsys\n[1] sleep\n[2] cat')" \
+    "sh -c \"$QUASH -c 'time sleep 0.1 | cat' 2>&1 | cut -f1 | cut -d: -f1\""
+
+# QUASH_TRACE writes a span for every phase of a command line
+check "trace" "$(printf 'hi\n[\n]\n1\n1\n2\n1')" "QUASH_TRACE=trace.json $QUASH -c '/bin/echo hi | /bin/cat'
+head -n 1 trace.json
+tail -n 1 trace.json
+grep -c '\"name\":\"parse\"' trace.json
+grep -c '\"name\":\"wait\"' trace.json
+grep -c '\"name\":\"spawn\"' trace.json
+grep -c '\"name\":\"process_name\"' trace.json"
+
+# make bench runs every benchmark and reports it as JSON
+check "bench" "5" "RUNS=1 SPAWN_N=10 BUILTIN_N=10 PIPE_MB=1 JOBS_N=10 sh $(cd "$(dirname "$0")" && pwd)/bench.sh | grep -c median"
+
+# cat and tee copy inside the shell
+check "cat files" "$(printf 'a\nb')" "echo a > a; echo b > b
+cat a b > c; cat c"
+check "cat through a pipeline" "same" "seq 100000 > big; cat big | cat > big2; cmp big big2 && echo same"
+check "tee" "$(printf 'x\nx\nx')" "echo x | tee t1 t2 | cat; cat t1 t2"
+check "tee -a" "4" "seq 3 > c; seq 1 | tee -a c > /dev/null; wc -l < c"
+check "cat of a missing file" "cat: nosuch: No such file or directory" "cat nosuch"
+
+# test, [ and printf run inside the shell, and $(( )) is evaluated there too
+check "test and [" "$(printf 'lt\nne\nfile\nboth')" "[ 1 -lt 2 ] && echo lt; [ abc = abd ] || echo ne
+echo > f; test -f f && test ! -d f && echo file
+[ -z \"\" -a -n x ] && echo both"
+check "printf" "$(printf 'a-5| 3.14|ff\na\nb')" "printf \"%s-%d|%5.2f|%x\\n\" a 5 3.14159 255
+printf \"%s\\n\" a b"
+check "arithmetic" "$(printf '7 2 -2 1\n16')" "echo \$((1 + 2 * 3)) \$(( (1 << 4) % 7 )) \$((-5 / 2)) \$(( 3 > 2 && 1 ))
+x=4; echo \$((x * x))"
+check "division by zero" "quash: arithmetic: division by zero" "echo \$((1 / 0))"
+
+# control flow and functions
+check "for" "$(printf 'a\nb\nc')" "for i in a b c; do echo \$i; done"
+check "while and until" "$(printf '3\n0')" "i=0; while [ \$i -lt 3 ]; do i=\$((i+1)); done; echo \$i
+until [ \$i -eq 0 ]; do i=\$((i-1)); done; echo \$i"
+check "if elif else" "elif" "if false; then echo no; elif true; then echo elif; else echo else; fi"
+check "break and continue" "$(printf '1\n3')" \
+    "for i in 1 2 3 4; do if [ \$i = 2 ]; then continue; fi; if [ \$i = 4 ]; then break; fi; echo \$i; done"
+check "function" "$(printf 'f x 2\n3')" "f() { echo \"f \$1 \$#\"; return 3; }; f x y; echo \$?"
+check "function in a pipeline" "$(printf 'g1\ng2')" "g() { for j in 1 2; do echo g\$j; done; }; g | cat"
+check "brace group and subshell" "$(printf '2\n2\n1')" "{ echo a; echo b; } | wc -l
+x=1; ( x=2; echo \$x ); echo \$x"
+
+# command substitution
+check "command substitution" "$(printf '[hi]\nback a nested\n[a]')" "x=\$(echo hi); echo [\$x]
+echo \`echo back\` \$(echo a \$(echo nested))
+y=\$(printf \"a\\n\\n\\n\"); echo \"[\$y]\""
+check "large substitution" "50000" "seq 50000 > big; z=\$(cat big); echo \"\$z\" | wc -l"
+check "substitution status" "$(printf '1\next')" "x=\$(false); echo \$?
+w=\$(/bin/echo ext); echo \$w"
+
+# here-documents, here-strings and process substitution
+check "here-document" "$(printf 'hello w\nsub 3\nliteral $x\ntabbed')" "x=w
+cat <<EOF
+hello \$x
+\$(echo sub) \$((1+2))
+EOF
+cat <<'EOF'
+literal \$x
+EOF
+cat <<-EOF
+	tabbed
+	EOF"
+check "here-string" "HERE W" "x=w; tr a-z A-Z <<< \"here \$x\""
+check "process substitution" "$(printf 'diff=1\nDATA')" "diff <(printf \"a\\nb\\n\") <(printf \"a\\nc\\n\") > /dev/null; echo diff=\$?
+echo data | tee >(tr a-z A-Z > up) > /dev/null; sleep 0.1; cat up"
+
+# redirections of any fd, applied in order
+check "stderr redirections" "$(printf '1\n1\n2')" "ls /nonexistent 2> err; wc -l < err
+ls /nonexistent 2>&1 > /dev/null | wc -l
+ls /nonexistent err &> both; wc -l < both"
+check "read-write and numbered fds" "$(printf 'rw\nhi')" "echo rw > rw; cat <> rw
+echo hi 3> three >&3; cat three"
+check "closed fd" "$(printf 'echo: write error: Bad file descriptor\nstatus 1')" "echo closed >&-; echo status \$?"
+check "swapped stdout and stderr" "ERR" \
+    "{ sh -c 'echo out; echo err >&2' 3>&1 1>&2 2>&3 | tr a-z A-Z; } 2>/dev/null"
+check "group redirection" "after" "{ echo to-err >&2; } 2>/dev/null; echo after"
+
+# a background pipeline is one job in a process group of its own
+check "kill reaches the whole pipeline" "$(printf '1\n143\n0')" "sleep 4.7 | sleep 4.7 &
+jobs | wc -l
+kill 15 %1
+wait %1; echo \$?
+ps -eo args | grep -c '^sleep 4.7\$'"
+check "wait for a job" "$(printf 'st=7\nall')" "(exit 7) &
+wait %1; echo st=\$?
+sleep 0.2 & sleep 0.1 & wait; echo all"
+
+# wait -n sleeps until whichever job completes first
+check "wait -n" "$(printf 'first=5\nsecond=3\nnone=127')" \
+    "(sleep 0.6; exit 3) & (sleep 0.1; exit 5) & wait -n; echo first=\$?; wait -n; echo second=\$?; wait -n; echo none=\$?"
+
+# timeout and job deadlines
+check "timeout" "$(printf 'st=124\nst=4')" "timeout 0.2 sleep 5; echo st=\$?
+timeout 5 sh -c 'exit 4'; echo st=\$?"
+check "timeout -k" "st=137" "timeout -k 0.1 0.1 sh -c 'trap \"\" TERM; sleep 5'; echo st=\$?"
+check "job deadline" "job=143" "sleep 5 & timeout 0.2 %1; wait %1; echo job=\$?"
+check "timeout usage" "$(printf 'timeout: usage: timeout [-k GRACE] DURATION COMMAND [ARGS...] | %%JOB\nusage=125')" "timeout; echo usage=\$?"
+
+# with QUASH_ZYGOTE=1 a zygote starts the commands, which stay children of the shell
+check "zygote" "$(printf '1\nhi\nst=3\nnosuch: command not found\n2\nw=0\nZ=1\ndirect child')" \
+    "QUASH_ZYGOTE=1 $QUASH -c 'ps -o comm= --ppid \$\$ | grep -cx $(basename "$QUASH" | cut -c1-15)
+echo hi | /bin/cat
+/bin/sh -c \"exit 3\"; echo st=\$?
+nosuch
+/bin/echo x > f; /usr/bin/wc -c < f
+sleep 0.1 & wait \$!; echo w=\$?
+export Z=1; env | grep ^Z=
+echo \$\$ > pid; sh -c \"echo \\\$PPID\" > ppid; cmp -s pid ppid && echo direct child'"
+
+# quash --serve runs what quashc sends it in the client's directory and environment
+check "serve" "$(printf 'hi\nst=3\n/sub\nV=1\nin')" "$QUASH --serve sock &
+while [ ! -S sock ]; do sleep 0.05; done
+$QUASHC sock 'echo hi; exit 3'; echo st=\$?
+mkdir sub; cd sub
+$QUASHC ../sock pwd | sed 's|.*/||;s|^|/|'
+V=1 $QUASHC ../sock env | grep ^V=
+echo in | $QUASHC ../sock cat
+kill 15 %1"
+# parallel only waits for its own runs
+check "parallel leaves jobs to wait" "job=3" \
+    "(sleep 0.2; exit 3) & parallel -j 2 sleep ::: 0.3 0.3; wait %1; echo job=\$?"
+check "parallel keeps deadlines" "0" \
+    "sleep 5.5 & timeout 0.2 %1; parallel sh -c 'sleep 0.6; ps -eo args | grep -c ^sleep.5.5' ::: x"
+
+# a background subshell must not write into the trace after it is closed
+(cd "$DIR" && QUASH_TRACE=trace.json "$QUASH" -c '(sleep 0.3; true) & { sleep 0.3; true; } &')
+sleep 0.6
+check "trace ends after background jobs" "]" "tail -n 1 trace.json"
+
+# cat and tee leave options they do not know to the external commands
+printf 'a\nb\n' > "$DIR/f.txt"
+check "cat -n runs the external cat" "$(printf '     1\ta\n     2\tb')" "cat -n f.txt"
+check "cat -n in a pipeline" "2" "cat -n f.txt | wc -l"
+check "cat -n in a substitution" "     1	a" "x=\$(cat -n f.txt); echo \"\$x\" | head -n 1"
+check "cat - reads standard input" "x" "echo x | cat -"
+check "tee -a appends" "$(printf 'one\ntwo')" "echo one > log; echo two | tee -a log > /dev/null; cat log"
+check "tee --append appends" "$(printf 'one\ntwo\nno file')" \
+    "echo one > log2; echo two | tee --append log2 > /dev/null; cat log2; cat -- --append 2>/dev/null || echo no file"
+
+# $(( )) is expanded as if in double quotes before it is evaluated
+check "arithmetic with a command substitution" "6" "echo \$(( 2 * \$(echo 3) ))"
+check "nested arithmetic" "7" "echo \$(( 1 + \$(( 2 * 3 )) ))"
+check "arithmetic with a default" "1 6" "x=5; echo \$(( \${u:-0} + 1 )) \$(( \${x:-0} + 1 ))"
+check "arithmetic in a loop" "3" "i=0; while [ \$i -lt 3 ]; do i=\$((i+1)); done; echo \$i"
+check "parameter operators" "def [] alt 7 7 3" \
+    "e=; x=abc; echo \${u:-def} [\${e-unset}] \${x:+alt} \${n:=7} \$n \${#x}"
+
+# shell code forked after a builtin stage still sees end of file
+seq 100000 > "$DIR/big.txt"
+check "builtin into a brace group" "100000" "cat big.txt | { wc -l; }"
+check "builtin into a subshell" "100000" "cat big.txt | ( wc -l )"
+check "builtin into a function" "100000" "f() { wc -l; }; cat big.txt | f"
+
+# parking an fd to break a redirect cycle leaves the shell's own fds alone
+check "redirect cycle on a subshell with a job" "inner done" \
+    "( sleep 0.2 & wait; echo inner done ) 3>&1 1>&2 2>&3"
+check "redirect cycle on a spawned command" "out" \
+    "{ sh -c 'echo out >&2; echo err' 3>&1 1>&2 2>&3 | cat; } 2>/dev/null"
+
+# -k with nothing after it is a usage error, not a read past the arguments
+check "timeout -k usage" "$(printf 'timeout: usage: timeout [-k GRACE] DURATION COMMAND [ARGS...] | %%JOB\nusage=125')" "timeout -k; echo usage=\$?"
+
+# a worker out of fds waits to accept again instead of exiting to be forked anew
+check "serve out of fds" "$(printf 'st=124\n1')" "sh -c 'exec 3</dev/null 4</dev/null 5</dev/null 6</dev/null 7</dev/null 8</dev/null 9</dev/null; ulimit -n 13; exec $QUASH --serve lowfd.sock 1' 2>err &
+while [ ! -S lowfd.sock ]; do sleep 0.05; done
+timeout 0.5 $QUASHC lowfd.sock true; echo st=\$?
+kill 15 %1
+grep -c accept err"
+
+echo "$passed passed, $failed failed"
+[ "$failed" -eq 0 ]